@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/aio_abi.h>
+
+#include "aio_queue.h"
+
+/* per-request bookkeeping, kept alive until the request completes */
+struct aio_slot {
+    void *user_data;
+    struct iovec iov;
+    struct iocb cb;
+};
+
+/* thin wrappers of the raw system calls (no liburing/libaio dependency) */
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p){
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_setup(unsigned nr_events, aio_context_t *ctx){
+    return (int) syscall(__NR_io_setup, nr_events, ctx);
+}
+
+static int sys_io_destroy(aio_context_t ctx){
+    return (int) syscall(__NR_io_destroy, ctx);
+}
+
+static int sys_io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp){
+    return (int) syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static int sys_io_getevents(aio_context_t ctx, long min_nr, long nr, struct io_event *events){
+    return (int) syscall(__NR_io_getevents, ctx, min_nr, nr, events, NULL);
+}
+
+/* sets up the submission/completion rings, returns 0 on success */
+static int uring_init(struct aio_queue *q){
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    q->ring_fd = sys_io_uring_setup(q->depth, &p);
+    if (q->ring_fd < 0){
+        return -1;
+    }
+
+    q->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    q->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        if (q->cq_ring_size > q->sq_ring_size){
+            q->sq_ring_size = q->cq_ring_size;
+        }
+        q->cq_ring_size = q->sq_ring_size;
+    }
+
+    q->sq_ring = mmap(0, q->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQ_RING);
+    if (q->sq_ring == MAP_FAILED){
+        close(q->ring_fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        q->cq_ring = q->sq_ring;
+    }
+    else{
+        q->cq_ring = mmap(0, q->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_CQ_RING);
+        if (q->cq_ring == MAP_FAILED){
+            munmap(q->sq_ring, q->sq_ring_size);
+            close(q->ring_fd);
+            return -1;
+        }
+    }
+    q->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    q->sqes = mmap(0, q->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQES);
+    if (q->sqes == MAP_FAILED){
+        if (q->cq_ring != q->sq_ring){
+            munmap(q->cq_ring, q->cq_ring_size);
+        }
+        munmap(q->sq_ring, q->sq_ring_size);
+        close(q->ring_fd);
+        return -1;
+    }
+
+    q->sq_head = (unsigned *) ((char *) q->sq_ring + p.sq_off.head);
+    q->sq_tail = (unsigned *) ((char *) q->sq_ring + p.sq_off.tail);
+    q->sq_mask = (unsigned *) ((char *) q->sq_ring + p.sq_off.ring_mask);
+    q->sq_array = (unsigned *) ((char *) q->sq_ring + p.sq_off.array);
+    q->cq_head = (unsigned *) ((char *) q->cq_ring + p.cq_off.head);
+    q->cq_tail = (unsigned *) ((char *) q->cq_ring + p.cq_off.tail);
+    q->cq_mask = (unsigned *) ((char *) q->cq_ring + p.cq_off.ring_mask);
+    q->cqes = (char *) q->cq_ring + p.cq_off.cqes;
+
+    return 0;
+}
+
+/* creates a queue allowing up to depth requests in flight
+ * backend AIO_BACKEND_AUTO tries io_uring first and falls back to Linux native AIO
+ */
+struct aio_queue *aio_queue_create(unsigned depth, int backend){
+
+    struct aio_queue *q;
+    q = (struct aio_queue *) calloc(1, sizeof(struct aio_queue));
+    assert(q);
+    assert(depth > 0);
+
+    q->depth = depth;
+    q->ring_fd = -1;
+    q->slots = (struct aio_slot *) calloc(depth, sizeof(struct aio_slot));
+    q->free_slots = (unsigned *) malloc(sizeof(unsigned) * depth);
+    assert(q->slots && q->free_slots);
+    for (unsigned i = 0; i < depth; i++){
+        q->free_slots[i] = depth - 1 - i;
+    }
+    q->num_free = depth;
+
+    if ((backend == AIO_BACKEND_AUTO || backend == AIO_BACKEND_IO_URING) && uring_init(q) == 0){
+        q->backend = AIO_BACKEND_IO_URING;
+        return q;
+    }
+    if (backend == AIO_BACKEND_IO_URING){
+        printf("Error: io_uring is not available (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+    aio_context_t ctx = 0;
+    if (sys_io_setup(depth, &ctx) < 0){
+        printf("Error: Linux AIO is not available (%s)\n", strerror(errno));
+        exit(1);
+    }
+    q->aio_ctx = ctx;
+    q->backend = AIO_BACKEND_LINUX_AIO;
+
+    return q;
+}
+
+void aio_queue_destroy(struct aio_queue *q){
+
+    if (q == NULL){
+        return;
+    }
+    aio_drain(q);
+
+    if (q->backend == AIO_BACKEND_IO_URING){
+        munmap(q->sqes, q->sqes_size);
+        if (q->cq_ring != q->sq_ring){
+            munmap(q->cq_ring, q->cq_ring_size);
+        }
+        munmap(q->sq_ring, q->sq_ring_size);
+        close(q->ring_fd);
+    }
+    else{
+        sys_io_destroy(q->aio_ctx);
+    }
+
+    free(q->slots);
+    free(q->free_slots);
+    free(q);
+}
+
+/* queues one transfer, offset -1 uses the current file position (pipes, io_uring only)
+ * returns 0 on success, -EAGAIN if the queue is full (harvest first), -errno on submission failure
+ */
+static int aio_submit(struct aio_queue *q, int fd, void *buffer, uint32_t transferSize, int64_t offset, void *user_data, int write){
+
+    if (q->num_free == 0){
+        return -EAGAIN;
+    }
+
+    unsigned idx = q->free_slots[--q->num_free];
+    struct aio_slot *slot = &q->slots[idx];
+    slot->user_data = user_data;
+    slot->iov.iov_base = buffer;
+    slot->iov.iov_len = transferSize;
+
+    if (q->backend == AIO_BACKEND_IO_URING){
+        unsigned tail = *q->sq_tail;
+        unsigned index = tail & *q->sq_mask;
+        struct io_uring_sqe *sqe = &((struct io_uring_sqe *) q->sqes)[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->off = (uint64_t) offset;
+        sqe->addr = (uint64_t) (uintptr_t) &slot->iov;
+        sqe->len = 1;
+        sqe->user_data = idx;
+
+        q->sq_array[index] = index;
+        __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        if (sys_io_uring_enter(q->ring_fd, 1, 0, 0) < 0){
+            int err = errno;
+            __atomic_store_n(q->sq_tail, tail, __ATOMIC_RELEASE);
+            q->free_slots[q->num_free++] = idx;
+            return -err;
+        }
+    }
+    else{
+        struct iocb *cb = &slot->cb;
+        memset(cb, 0, sizeof(*cb));
+        cb->aio_data = idx;
+        cb->aio_lio_opcode = write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+        cb->aio_fildes = fd;
+        cb->aio_buf = (uint64_t) (uintptr_t) buffer;
+        cb->aio_nbytes = transferSize;
+        cb->aio_offset = offset;
+
+        if (sys_io_submit(q->aio_ctx, 1, &cb) != 1){
+            int err = errno;
+            q->free_slots[q->num_free++] = idx;
+            return -err;
+        }
+    }
+
+    q->inflight++;
+    q->num_submitted++;
+    if (q->inflight > q->max_inflight){
+        q->max_inflight = q->inflight;
+    }
+
+    return 0;
+}
+
+int aio_submit_write(struct aio_queue *q, int fd, const void *buffer, uint32_t transferSize, int64_t offset, void *user_data){
+    return aio_submit(q, fd, (void *) buffer, transferSize, offset, user_data, 1);
+}
+
+int aio_submit_read(struct aio_queue *q, int fd, void *buffer, uint32_t transferSize, int64_t offset, void *user_data){
+    return aio_submit(q, fd, buffer, transferSize, offset, user_data, 0);
+}
+
+static void aio_complete(struct aio_queue *q, unsigned idx, int64_t result, struct aio_completion *completion){
+
+    completion->user_data = q->slots[idx].user_data;
+    completion->result = result;
+
+    q->free_slots[q->num_free++] = idx;
+    q->inflight--;
+    q->num_completed++;
+    if (result > 0){
+        q->bytes_completed += result;
+    }
+}
+
+/* collects up to max_completions finished requests, blocking until at least min_completions are available
+ * returns the number of completions stored
+ */
+int aio_harvest(struct aio_queue *q, struct aio_completion *completions, int max_completions, int min_completions){
+
+    int count = 0;
+
+    if (min_completions > (int) q->inflight){
+        min_completions = q->inflight;
+    }
+
+    if (q->backend == AIO_BACKEND_IO_URING){
+        while (count < max_completions){
+            unsigned head = *q->cq_head;
+            unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+
+            if (head == tail){
+                if (count >= min_completions){
+                    break;
+                }
+                if (sys_io_uring_enter(q->ring_fd, 0, min_completions - count, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR){
+                    break;
+                }
+                continue;
+            }
+
+            struct io_uring_cqe *cqe = &((struct io_uring_cqe *) q->cqes)[head & *q->cq_mask];
+            aio_complete(q, (unsigned) cqe->user_data, cqe->res, &completions[count++]);
+            __atomic_store_n(q->cq_head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    else{
+        struct io_event events[64];
+        while (count < max_completions){
+            int nr = max_completions - count;
+            if (nr > 64){
+                nr = 64;
+            }
+            int min_nr = (count < min_completions) ? min_completions - count : 0;
+            if (min_nr > nr){
+                min_nr = nr;
+            }
+            int rc = sys_io_getevents(q->aio_ctx, min_nr, nr, events);
+            if (rc < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                break;
+            }
+            for (int i = 0; i < rc; i++){
+                aio_complete(q, (unsigned) events[i].data, events[i].res, &completions[count++]);
+            }
+            if (rc == 0 || count >= min_completions){
+                break;
+            }
+        }
+    }
+
+    return count;
+}
+
+/* waits for every request in flight, returns the number of failed requests */
+int aio_drain(struct aio_queue *q){
+
+    struct aio_completion completions[64];
+    int num_failed = 0;
+
+    while (q->inflight > 0){
+        int n = aio_harvest(q, completions, 64, 1);
+        for (int i = 0; i < n; i++){
+            if (completions[i].result < 0){
+                ++num_failed;
+            }
+        }
+    }
+
+    return num_failed;
+}
+
+const char *aio_backend_name(const struct aio_queue *q){
+    return (q->backend == AIO_BACKEND_IO_URING) ? "io_uring" : "linux-aio";
+}
+
+void aio_print_stats(const struct aio_queue *q){
+    printf("async queue (%s, depth %u): %llu submitted, %llu completed, %llu bytes, max in flight %u\n",
+           aio_backend_name(q), q->depth, (unsigned long long) q->num_submitted, (unsigned long long) q->num_completed,
+           (unsigned long long) q->bytes_completed, q->max_inflight);
+}
@@ -0,0 +1,71 @@
+#ifndef AIO_QUEUE_H
+#define AIO_QUEUE_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* asynchronous DMA submission with queue depth > 1
+ * the driver queues sg_read_iter/sg_write_iter requests and completes them from the interrupt handler,
+ * so several H2C and C2H transfers can be in flight at once
+ * io_uring is used where the kernel supports it, Linux native AIO otherwise
+ * any fd works (regular file or pipe can stand in for /dev/xdma0_*)
+ */
+
+#define AIO_BACKEND_AUTO 0
+#define AIO_BACKEND_IO_URING 1
+#define AIO_BACKEND_LINUX_AIO 2
+
+struct aio_completion {
+    void *user_data;
+    int64_t result; // bytes transferred, or -errno
+};
+
+struct aio_slot;
+
+struct aio_queue {
+    int backend;
+    unsigned depth;
+    unsigned inflight;
+    struct aio_slot *slots;
+    unsigned *free_slots; // stack of free slot indices
+    unsigned num_free;
+
+    /* io_uring */
+    int ring_fd;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    void *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *cqes;
+
+    /* Linux native AIO */
+    unsigned long aio_ctx;
+
+    /* statistics */
+    uint64_t num_submitted;
+    uint64_t num_completed;
+    uint64_t bytes_completed;
+    unsigned max_inflight;
+};
+
+struct aio_queue *aio_queue_create(unsigned depth, int backend);
+
+void aio_queue_destroy(struct aio_queue *q);
+
+int aio_submit_write(struct aio_queue *q, int fd, const void *buffer, uint32_t transferSize, int64_t offset, void *user_data);
+
+int aio_submit_read(struct aio_queue *q, int fd, void *buffer, uint32_t transferSize, int64_t offset, void *user_data);
+
+int aio_harvest(struct aio_queue *q, struct aio_completion *completions, int max_completions, int min_completions);
+
+int aio_drain(struct aio_queue *q);
+
+const char *aio_backend_name(const struct aio_queue *q);
+
+void aio_print_stats(const struct aio_queue *q);
+
+#endif
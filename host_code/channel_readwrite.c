@@ -7,6 +7,10 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <limits.h>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -15,45 +19,147 @@
 #include <unistd.h>
 
 #include "channel_readwrite.h"
+#include "dma_pool.h"
 #include "utils.h"
+#include "xdma-ioctl.h"
 
-/* transferSize of data pointed by the data ptr will be written to the device at addr
- * returns total execution time of function 
+#define DEFAULT_ALIGN 4096 // used when the device does not answer IOCTL_XDMA_ALIGN_GET
+
+/* shared source of zero-padding for gathered tile uploads */
+static const char zero_page[ZERO_PAGE_SIZE] __attribute__((aligned(ZERO_PAGE_SIZE)));
+
+#define MAX_CACHED_CHANNELS 16
+
+/* handles opened by channel_get(), looked up by device path */
+static struct channel_handle *cached_channels[MAX_CACHED_CHANNELS];
+static int num_cached_channels = 0;
+
+/* opens channelDevice once and returns a persistent handle
+ * the staging buffer is allocated lazily by the first transfer
  */
-struct timespec write_to_channel(char *channelDevice, uint32_t addr, uint32_t transferSize, void* data){
+struct channel_handle *channel_open(const char *channelDevice){
+
+    struct channel_handle *ch;
+    ch = (struct channel_handle *) malloc(sizeof(struct channel_handle));
+    assert(ch);
+
+    ch->fd = open(channelDevice, O_RDWR);
+    assert(ch->fd >= 0);
+
+    strncpy(ch->device, channelDevice, sizeof(ch->device) - 1);
+    ch->device[sizeof(ch->device) - 1] = '\0';
+    ch->buffer = NULL;
+    ch->buffer_size = 0;
+    ch->gather_writev = 0;
+    ch->zero_copy_bytes = 0;
+    ch->bounced_bytes = 0;
+
+    /* query the engine alignment once */
+    int align = 0;
+    if (ioctl(ch->fd, IOCTL_XDMA_ALIGN_GET, &align) < 0 || align <= 0){
+        align = DEFAULT_ALIGN;
+    }
+    ch->align = (uint32_t) align;
 
-    /* local variables */    
-    int rc;
-    char *buffer = NULL;
-    char *allocated = NULL;
-    struct timespec ts_start, ts_end;
+    return ch;
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+void channel_close(struct channel_handle *ch){
 
-    /* allocate memory to buffer */
-    posix_memalign((void **)&allocated, 4096/*alignment*/, transferSize + 4096);
-    assert(allocated);
-    buffer = allocated;
-    //printf("host memory buffer = %p\n", buffer);
+    if (ch == NULL){
+        return;
+    }
+    close(ch->fd);
+    dma_pool_free(ch->buffer);
+    free(ch);
+}
 
-    /* first need to copy data to buffer */
-    memcpy(buffer, data, transferSize);
+/* makes sure the staging buffer can hold transferSize bytes
+ * the buffer only grows, so after warm-up no allocation happens on the transfer path
+ */
+static void channel_reserve(struct channel_handle *ch, uint32_t transferSize){
 
-    int fpga_fd = open(channelDevice, O_RDWR); 
-    assert(fpga_fd >= 0);
+    if (transferSize <= ch->buffer_size){
+        return;
+    }
 
-    /* select AXI MM address */
-    off_t off = lseek(fpga_fd, addr, SEEK_SET);
+    uint32_t new_size = (transferSize + 4095) & ~4095u;
+
+    dma_pool_free(ch->buffer);
+    ch->buffer = (char *) dma_pool_alloc(new_size);
+    ch->buffer_size = new_size;
+}
+
+/* staging buffer of ch grown to at least size bytes, as scratch memory of the caller
+ * the first bytes are overwritten by the next bounced transfer on ch, which must not be longer than the part left unused
+ */
+void *channel_staging(struct channel_handle *ch, uint32_t size){
+
+    channel_reserve(ch, size);
+
+    return ch->buffer;
+}
+
+/* allocates a buffer that the engine of ch can DMA from/to directly
+ * the engine alignment (IOCTL_XDMA_ALIGN_GET) is at most a page in most cases, so a page-aligned dma_pool block
+ * satisfies it for device addresses that are multiples of the alignment; larger alignments use posix_memalign
+ */
+void *channel_alloc_buffer(struct channel_handle *ch, size_t size){
+
+    if (ch->align <= 4096){
+        return dma_pool_alloc(size);
+    }
+
+    void *buffer = NULL;
+    posix_memalign(&buffer, ch->align, size);
+    assert(buffer);
+
+    return buffer;
+}
+
+void channel_free_buffer(void *buffer){
+    if (!dma_pool_free(buffer)){
+        free(buffer);
+    }
+}
+
+/* mirrors check_transfer_align() of the driver (AXI MM incremental mode):
+ * host buffer and device address must have the same offset modulo the engine alignment
+ */
+int channel_is_aligned(const struct channel_handle *ch, uint32_t addr, const void *buffer){
+    return ((((uintptr_t) buffer) ^ addr) & (ch->align - 1)) == 0;
+}
+
+void channel_print_stats(const struct channel_handle *ch){
+    printf("%s: alignment %u, zero-copy %llu bytes, bounced %llu bytes\n", ch->device, ch->align,
+           (unsigned long long) ch->zero_copy_bytes, (unsigned long long) ch->bounced_bytes);
+}
+
+/* transferSize of data pointed by the data ptr will be written to the device at addr
+ * returns total execution time of function
+ */
+struct timespec channel_write(struct channel_handle *ch, uint32_t addr, uint32_t transferSize, const void *data){
+
+    int rc;
+    struct timespec ts_start, ts_end;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
     /* Write data to the AXI MM address using SGDMA */
-    rc = write(fpga_fd, buffer, transferSize);
+    if (channel_is_aligned(ch, addr, data)){
+        rc = pwrite(ch->fd, data, transferSize, addr);
+        ch->zero_copy_bytes += transferSize;
+    }
+    else{
+        /* bounce through the staging buffer */
+        channel_reserve(ch, transferSize);
+        memcpy(ch->buffer, data, transferSize);
+        rc = pwrite(ch->fd, ch->buffer, transferSize, addr);
+        ch->bounced_bytes += transferSize;
+    }
     assert(rc == transferSize); // make sure that the entire data is written
 
-    close(fpga_fd);
-    free(allocated);
-
     clock_gettime(CLOCK_MONOTONIC, &ts_end);
-
     timespec_sub(&ts_end, &ts_start);
 
     return ts_end;
@@ -62,39 +168,76 @@ struct timespec write_to_channel(char *channelDevice, uint32_t addr, uint32_t tr
 /* transferSize of data at addr will be read from device to output ptr
  * returns total execution time of function
  */
-struct timespec read_from_channel(char *channelDevice, uint32_t addr, uint32_t transferSize, void *output){
+struct timespec channel_read(struct channel_handle *ch, uint32_t addr, uint32_t transferSize, void *output){
 
-    /* local variables */
     int rc;
-    char *buffer = NULL;
-    char *allocated = NULL;
     struct timespec ts_start, ts_end;
 
     clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
-    posix_memalign((void **)&allocated, 4096/*alignment*/, transferSize + 4096);
-    assert(allocated);
-    buffer = allocated;
-    //printf("host memory buffer = %p\n", buffer);
-
-    /* Open device */
-    int fpga_fd = open(channelDevice, O_RDWR | O_NONBLOCK);
-    assert(fpga_fd >= 0);
-
-    /* zero-initialize buffer and read data from device */
-    memset(buffer, 0x00, transferSize);
-    off_t off = lseek(fpga_fd, addr, SEEK_SET);
-
-    rc = read(fpga_fd, buffer, transferSize);
+    if (channel_is_aligned(ch, addr, output)){
+        rc = pread(ch->fd, output, transferSize, addr);
+        ch->zero_copy_bytes += transferSize;
+    }
+    else{
+        /* bounce through the staging buffer */
+        channel_reserve(ch, transferSize);
+        rc = pread(ch->fd, ch->buffer, transferSize, addr);
+        memcpy(output, ch->buffer, transferSize);
+        ch->bounced_bytes += transferSize;
+    }
     if ((rc > 0) && (rc < transferSize)){
         printf("Short read of %d bytes into a %d bytes buffer, could be a packet read?\n", rc, transferSize);
     }
 
-    /* copy data from buffer to output */
-    memcpy(output, buffer, transferSize);
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
 
-    close(fpga_fd);
-    free(allocated);
+    return ts_end;
+}
+
+/* writes the iovec segments back-to-back to the device starting at addr
+ * the segments go out zero-copy with pwritev, which the driver runs as one DMA per segment (sg_aio_read_write);
+ * they are gathered into the staging buffer and sent with one pwrite instead when ch->gather_writev is set
+ * (the copy is cheaper than the per-segment DMAs) or when a segment does not keep the engine alignment
+ * returns total execution time of function
+ */
+struct timespec channel_writev(struct channel_handle *ch, uint32_t addr, const struct iovec *iov, int iovcnt){
+
+    int rc;
+    struct timespec ts_start, ts_end;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    assert(iovcnt <= IOV_MAX);
+
+    int vectored = !ch->gather_writev;
+    uint32_t transferSize = 0;
+    for (int i = 0; i < iovcnt; i++){
+        vectored &= channel_is_aligned(ch, addr + transferSize, iov[i].iov_base);
+        transferSize += iov[i].iov_len;
+    }
+
+    if (iovcnt == 1 && channel_is_aligned(ch, addr, iov[0].iov_base)){
+        rc = pwrite(ch->fd, iov[0].iov_base, transferSize, addr);
+        ch->zero_copy_bytes += transferSize;
+    }
+    else if (vectored){
+        rc = pwritev(ch->fd, iov, iovcnt, addr);
+        ch->zero_copy_bytes += transferSize;
+    }
+    else{
+        /* gather all segments into the staging buffer */
+        channel_reserve(ch, transferSize);
+        uint32_t offset = 0;
+        for (int i = 0; i < iovcnt; i++){
+            memcpy(ch->buffer + offset, iov[i].iov_base, iov[i].iov_len);
+            offset += iov[i].iov_len;
+        }
+        rc = pwrite(ch->fd, ch->buffer, transferSize, addr);
+        ch->bounced_bytes += transferSize;
+    }
+    assert(rc == transferSize); // make sure that the entire data is written
 
     clock_gettime(CLOCK_MONOTONIC, &ts_end);
     timespec_sub(&ts_end, &ts_start);
@@ -102,6 +245,99 @@ struct timespec read_from_channel(char *channelDevice, uint32_t addr, uint32_t t
     return ts_end;
 }
 
+/* appends a segment, extending the previous one when the memory is contiguous */
+static int iov_append(struct iovec *iov, int iovcnt, const void *base, size_t len){
+
+    if (len == 0){
+        return iovcnt;
+    }
+    if (iovcnt > 0 && (const char *) iov[iovcnt-1].iov_base + iov[iovcnt-1].iov_len == (const char *) base){
+        iov[iovcnt-1].iov_len += len;
+        return iovcnt;
+    }
+    iov[iovcnt].iov_base = (void *) base;
+    iov[iovcnt].iov_len = len;
+
+    return iovcnt + 1;
+}
+
+/* appends len bytes of zeros taken from the shared zero page */
+static int iov_append_zeros(struct iovec *iov, int iovcnt, size_t len){
+
+    while (len > 0){
+        /* continue a previous zero segment as long as it stays inside the zero page */
+        if (iovcnt > 0 && iov[iovcnt-1].iov_base == zero_page && iov[iovcnt-1].iov_len < ZERO_PAGE_SIZE){
+            size_t room = ZERO_PAGE_SIZE - iov[iovcnt-1].iov_len;
+            size_t chunk = (len < room) ? len : room;
+            iov[iovcnt-1].iov_len += chunk;
+            len -= chunk;
+            continue;
+        }
+        size_t chunk = (len < ZERO_PAGE_SIZE) ? len : ZERO_PAGE_SIZE;
+        iov[iovcnt].iov_base = (void *) zero_page;
+        iov[iovcnt].iov_len = chunk;
+        ++iovcnt;
+        len -= chunk;
+    }
+
+    return iovcnt;
+}
+
+/* appends to iov the segments of a tile_rows x tile_cols row-major tile
+ * the top-left rows x cols come straight from src (row stride ld, in floats),
+ * the rest is zero-padding from the shared zero page
+ * returns the new number of segments
+ */
+int tile_iov_build(struct iovec *iov, int iovcnt, const float *src, int ld, int rows, int cols, int tile_rows, int tile_cols){
+
+    for (int r = 0; r < rows; r++){
+        iovcnt = iov_append(iov, iovcnt, src + ld*r, sizeof(float)*cols);
+        iovcnt = iov_append_zeros(iov, iovcnt, sizeof(float)*(tile_cols - cols));
+    }
+    iovcnt = iov_append_zeros(iov, iovcnt, sizeof(float)*tile_cols*(tile_rows - rows));
+
+    return iovcnt;
+}
+
+/* returns the cached handle of channelDevice, opening it on first use */
+struct channel_handle *channel_get(const char *channelDevice){
+
+    for (int i = 0; i < num_cached_channels; i++){
+        if (strcmp(cached_channels[i]->device, channelDevice) == 0){
+            return cached_channels[i];
+        }
+    }
+
+    assert(num_cached_channels < MAX_CACHED_CHANNELS);
+    cached_channels[num_cached_channels] = channel_open(channelDevice);
+
+    return cached_channels[num_cached_channels++];
+}
+
+/* closes every handle opened by channel_get() */
+void channel_close_all(){
+
+    for (int i = 0; i < num_cached_channels; i++){
+        channel_close(cached_channels[i]);
+        cached_channels[i] = NULL;
+    }
+    num_cached_channels = 0;
+}
+
+/* transferSize of data pointed by the data ptr will be written to the device at addr
+ * returns total execution time of function 
+ */
+struct timespec write_to_channel(char *channelDevice, uint32_t addr, uint32_t transferSize, void* data){
+    return channel_write(channel_get(channelDevice), addr, transferSize, data);
+}
+
+/* transferSize of data at addr will be read from device to output ptr
+ * returns total execution time of function
+ */
+struct timespec read_from_channel(char *channelDevice, uint32_t addr, uint32_t transferSize, void *output){
+    return channel_read(channel_get(channelDevice), addr, transferSize, output);
+}
+
 /* verbose version of write_to_channel with detailed time profiling 
  * returns actual write time without the overhead
  * NOTE: reported total execution time will be greater than actual total exeuction time
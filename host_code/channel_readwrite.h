@@ -1,5 +1,55 @@
+#ifndef CHANNEL_READWRITE_H
+#define CHANNEL_READWRITE_H
+
 #include <stdint.h>
 #include <time.h>
+#include <sys/uio.h>
+
+#define ZERO_PAGE_SIZE 4096
+
+/* upper bound of iovec segments produced by tile_iov_build for one tile */
+#define TILE_IOV_MAX(tile_rows, tile_cols) (2*(tile_rows) + (4*(tile_rows)*(tile_cols))/ZERO_PAGE_SIZE + 2)
+
+/* persistent handle of an xdma H2C/C2H channel device
+ * the device is opened once and the aligned staging buffer is reused (grown to the largest transfer seen)
+ * transfers from/to buffers satisfying the engine alignment skip the staging buffer (zero-copy)
+ */
+struct channel_handle {
+    int fd;
+    char device[64];
+    char *buffer;
+    uint32_t buffer_size;
+    uint32_t align; // engine address alignment reported by IOCTL_XDMA_ALIGN_GET
+    int gather_writev; // 1: channel_writev gathers into the staging buffer instead of pwritev (see profile_tile_upload)
+    uint64_t zero_copy_bytes;
+    uint64_t bounced_bytes;
+};
+
+struct channel_handle *channel_open(const char *channelDevice);
+
+void channel_close(struct channel_handle *ch);
+
+struct timespec channel_write(struct channel_handle *ch, uint32_t addr, uint32_t transferSize, const void *data);
+
+struct timespec channel_read(struct channel_handle *ch, uint32_t addr, uint32_t transferSize, void *output);
+
+void *channel_staging(struct channel_handle *ch, uint32_t size);
+
+void *channel_alloc_buffer(struct channel_handle *ch, size_t size);
+
+void channel_free_buffer(void *buffer);
+
+int channel_is_aligned(const struct channel_handle *ch, uint32_t addr, const void *buffer);
+
+void channel_print_stats(const struct channel_handle *ch);
+
+struct timespec channel_writev(struct channel_handle *ch, uint32_t addr, const struct iovec *iov, int iovcnt);
+
+int tile_iov_build(struct iovec *iov, int iovcnt, const float *src, int ld, int rows, int cols, int tile_rows, int tile_cols);
+
+struct channel_handle *channel_get(const char *channelDevice);
+
+void channel_close_all();
 
 struct timespec write_to_channel(char *channelDevice, uint32_t addr, uint32_t transferSize, void* data);
 
@@ -8,3 +58,5 @@ struct timespec read_from_channel(char *channelDevice, uint32_t addr, uint32_t t
 struct timespec write_to_channel_verbose(char *channelDevice, uint32_t addr, uint32_t transferSize, void *data);
 
 struct timespec read_from_channel_verbose(char *channelDevice, uint32_t addr, uint32_t transferSize, void *output);
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+#include "cmd_queue.h"
+
+/* queue on the command region of dev, or on an emulated BRAM if dev is NULL */
+struct cmd_queue *cmd_queue_create(struct fpga_device *dev){
+
+    struct cmd_queue *q;
+    q = (struct cmd_queue *) calloc(1, sizeof(struct cmd_queue));
+    assert(q);
+
+    q->dev = dev;
+    if (dev == NULL){
+        q->emu_bram = (char *) calloc(1, FPGA_BRAM_SIZE);
+        assert(q->emu_bram);
+    }
+    q->header.magic = CMD_QUEUE_MAGIC;
+
+    return q;
+}
+
+void cmd_queue_destroy(struct cmd_queue *q){
+
+    if (q == NULL){
+        return;
+    }
+    free(q->emu_bram);
+    free(q);
+}
+
+/* writes operands to BRAM at offset (combined with the other writes of the batch on a device) */
+void cmd_queue_write(struct cmd_queue *q, uint32_t offset, uint32_t size, const void *data){
+
+    assert(offset + size <= FPGA_BRAM_SIZE);
+
+    if (q->dev == NULL){
+        memcpy(q->emu_bram + offset, data, size);
+        return;
+    }
+    fpga_device_stage(q->dev, q->dev->bram_addr + offset, size, data);
+}
+
+/* reads outputs of a finished batch from BRAM at offset */
+void cmd_queue_read(struct cmd_queue *q, uint32_t offset, uint32_t size, void *data){
+
+    assert(offset + size <= FPGA_BRAM_SIZE);
+
+    if (q->dev == NULL){
+        memcpy(data, q->emu_bram + offset, size);
+        return;
+    }
+    channel_read(q->dev->c2h[0], q->dev->bram_addr + offset, size, data);
+}
+
+/* appends one op to the batch, returns its index */
+int cmd_queue_push(struct cmd_queue *q, uint32_t op, uint32_t vector_offset, uint32_t matrix_offset, uint32_t output_offset){
+
+    assert(q->header.num_records < CMD_QUEUE_MAX_RECORDS);
+
+    struct cmd_record *r = &q->records[q->header.num_records];
+    r->op = op;
+    r->vector_offset = vector_offset;
+    r->matrix_offset = matrix_offset;
+    r->output_offset = output_offset;
+
+    return q->header.num_records++;
+}
+
+/* encodes the batch into the command region, rings the doorbell once and waits until all records ran
+ * aborts if the consumer stopped at a bad record
+ */
+void cmd_queue_kick(struct cmd_queue *q){
+
+    uint32_t num_records = q->header.num_records;
+    if (num_records == 0){
+        return;
+    }
+
+    q->header.done = 0;
+    cmd_queue_write(q, FPGA_CMD_QUEUE_OFFSET, sizeof(struct cmd_header), &q->header);
+    cmd_queue_write(q, FPGA_CMD_QUEUE_OFFSET + sizeof(struct cmd_header), sizeof(struct cmd_record) * num_records, q->records);
+
+    uint32_t done;
+    if (q->dev == NULL){
+        done = cmd_queue_consume(q->emu_bram, FPGA_BRAM_SIZE);
+    }
+    else{
+        uint32_t op_code = FPGA_OP_QUEUE;
+        struct timespec ts_kick = fpga_device_kick(q->dev, &op_code);
+        fpga_device_wait(q->dev, CMD_QUEUE_WAIT_OP, num_records * FPGA_TILE, FPGA_OP_QUEUE, &ts_kick);
+        cmd_queue_read(q, FPGA_CMD_QUEUE_OFFSET + offsetof(struct cmd_header, done), sizeof(done), &done);
+    }
+
+    if (done != num_records){
+        printf("ERROR: command queue stopped at record %u of %u\n", done & ~CMD_QUEUE_ERROR, num_records);
+        exit(1);
+    }
+
+    q->num_batches++;
+    q->num_ops += num_records;
+    q->header.num_records = 0;
+}
+
+/* offsets of a record are inside BRAM and clear of the command region */
+static int cmd_range_valid(uint32_t offset, uint32_t size, uint32_t bram_size){
+
+    return offset % sizeof(float) == 0 && offset + size <= bram_size &&
+           (offset + size <= FPGA_CMD_QUEUE_OFFSET || offset >= FPGA_CMD_QUEUE_OFFSET + FPGA_CMD_QUEUE_SIZE);
+}
+
+/* host emulation of the consumer of a queue build, on a BRAM image
+ * runs the records of the command region in order and stores the number run in done,
+ * stops with CMD_QUEUE_ERROR at the first bad record; returns done
+ */
+uint32_t cmd_queue_consume(char *bram, uint32_t bram_size){
+
+    struct cmd_header *header = (struct cmd_header *) (bram + FPGA_CMD_QUEUE_OFFSET);
+    const struct cmd_record *records = (const struct cmd_record *) (header + 1);
+    uint32_t vector_bytes = sizeof(float) * FPGA_TILE;
+    uint32_t matrix_bytes = sizeof(float) * FPGA_TILE * FPGA_TILE;
+
+    if (header->magic != CMD_QUEUE_MAGIC || header->num_records > CMD_QUEUE_MAX_RECORDS){
+        header->done = CMD_QUEUE_ERROR;
+        return header->done;
+    }
+
+    uint32_t n;
+    for (n = 0; n < header->num_records; n++){
+        const struct cmd_record *r = &records[n];
+        if (r->op != FPGA_OP_MATVEC || !cmd_range_valid(r->vector_offset, vector_bytes, bram_size) ||
+            !cmd_range_valid(r->matrix_offset, matrix_bytes, bram_size) || !cmd_range_valid(r->output_offset, vector_bytes, bram_size)){
+            header->done = n | CMD_QUEUE_ERROR;
+            return header->done;
+        }
+
+        /* the output may overwrite the vector operand, as in multi PE */
+        const float *vector = (const float *) (bram + r->vector_offset);
+        const float *matrix = (const float *) (bram + r->matrix_offset);
+        float out[FPGA_TILE];
+        for (int i = 0; i < FPGA_TILE; i++){
+            float sum = 0.0f;
+            for (int j = 0; j < FPGA_TILE; j++){
+                sum += matrix[FPGA_TILE * i + j] * vector[j];
+            }
+            out[i] = sum;
+        }
+        memcpy(bram + r->output_offset, out, vector_bytes);
+    }
+
+    header->done = n;
+    return header->done;
+}
+
+void cmd_queue_print_stats(const struct cmd_queue *q){
+
+    printf("command queue (%s): %llu batches, %llu ops, %.1f ops per doorbell\n",
+           (q->dev == NULL) ? "emulated" : q->dev->prefix,
+           (unsigned long long) q->num_batches, (unsigned long long) q->num_ops,
+           q->num_batches ? (double) q->num_ops / q->num_batches : 0.0);
+}
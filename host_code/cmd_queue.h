@@ -0,0 +1,61 @@
+#ifndef CMD_QUEUE_H
+#define CMD_QUEUE_H
+
+#include <stdint.h>
+
+#include "fpga_device.h"
+
+#define CMD_QUEUE_MAGIC 0x51434D44 // "DMCQ"
+#define CMD_QUEUE_MAX_RECORDS ((FPGA_CMD_QUEUE_SIZE - sizeof(struct cmd_header)) / sizeof(struct cmd_record))
+#define CMD_QUEUE_WAIT_OP 3 // op type of a whole batch for the wait policy (after the op types of fpga_offload.c)
+#define CMD_QUEUE_ERROR 0x80000000 // set in done by the consumer when it stopped at a bad record
+
+/* one queued op, offsets are bytes from the start of BRAM */
+struct cmd_record {
+    uint32_t op; // FPGA_OP_MATVEC
+    uint32_t vector_offset; // FPGA_TILE floats
+    uint32_t matrix_offset; // FPGA_TILE*FPGA_TILE floats, row-major
+    uint32_t output_offset; // FPGA_TILE floats
+};
+
+/* start of the command region, followed by num_records records */
+struct cmd_header {
+    uint32_t magic;
+    uint32_t num_records;
+    uint32_t done; // records executed by the consumer (| CMD_QUEUE_ERROR)
+    uint32_t reserved;
+};
+
+/* host-side builder of command batches
+ * records are encoded into the command region of BRAM and the whole batch is started by one doorbell write,
+ * so a sequence of ops costs one PCIe round trip instead of one per op;
+ * without a device the consumer is emulated on a host copy of BRAM
+ */
+struct cmd_queue {
+    struct fpga_device *dev; // NULL: emulated consumer
+    char *emu_bram; // BRAM image of the emulated consumer
+
+    struct cmd_header header;
+    struct cmd_record records[CMD_QUEUE_MAX_RECORDS];
+
+    uint64_t num_batches;
+    uint64_t num_ops;
+};
+
+struct cmd_queue *cmd_queue_create(struct fpga_device *dev);
+
+void cmd_queue_destroy(struct cmd_queue *q);
+
+void cmd_queue_write(struct cmd_queue *q, uint32_t offset, uint32_t size, const void *data);
+
+void cmd_queue_read(struct cmd_queue *q, uint32_t offset, uint32_t size, void *data);
+
+int cmd_queue_push(struct cmd_queue *q, uint32_t op, uint32_t vector_offset, uint32_t matrix_offset, uint32_t output_offset);
+
+void cmd_queue_kick(struct cmd_queue *q);
+
+uint32_t cmd_queue_consume(char *bram, uint32_t bram_size);
+
+void cmd_queue_print_stats(const struct cmd_queue *q);
+
+#endif
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "completion.h"
+
+#define MAP_SIZE 4096UL
+#define CHECKS_PER_CLOCK 64 // the timeout clock is read once every CHECKS_PER_CLOCK checks
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* creates a waiter polling the op code register at ip_addr through C2H DMA reads
+ * if userDevice (e.g. "/dev/xdma0_user") can be mapped and the word at reg_offset of the user BAR reads the same as
+ * the register does through DMA, WAIT_MODE_MMIO can be selected to poll it with plain loads
+ * timeout_ns of 0 waits forever
+ */
+struct completion_waiter *completion_create(struct channel_handle *c2h, uint32_t ip_addr, const char *userDevice, uint32_t reg_offset, uint64_t timeout_ns){
+
+    struct completion_waiter *w;
+    w = (struct completion_waiter *) calloc(1, sizeof(struct completion_waiter));
+    assert(w);
+
+    w->mode = WAIT_MODE_DMA;
+    w->timeout_ns = timeout_ns;
+    w->c2h = c2h;
+    w->ip_addr = ip_addr;
+    w->user_fd = -1;
+    w->map_base = MAP_FAILED;
+
+    if (userDevice == NULL){
+        return w;
+    }
+
+    w->user_fd = open(userDevice, O_RDWR | O_SYNC);
+    if (w->user_fd < 0){
+        printf("%s could not be opened, polling op code through DMA\n", userDevice);
+        return w;
+    }
+
+    /* map the page holding the register once (bridge_mmap maps it uncached) */
+    off_t page = reg_offset & ~(MAP_SIZE - 1);
+    w->map_base = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, w->user_fd, page);
+    if (w->map_base == MAP_FAILED){
+        printf("%s could not be mapped, polling op code through DMA\n", userDevice);
+        close(w->user_fd);
+        w->user_fd = -1;
+        return w;
+    }
+
+    /* nothing guarantees that the register sits at reg_offset of the BAR, check it against the AXI address */
+    volatile uint32_t *op_reg = (volatile uint32_t *) ((char *) w->map_base + (reg_offset - page));
+    uint32_t dma_value;
+    channel_read(c2h, ip_addr, 0x0004, &dma_value);
+    if (*op_reg != dma_value){
+        printf("%s at 0x%x reads 0x%x, the op code register at 0x%x reads 0x%x: polling op code through DMA\n",
+               userDevice, reg_offset, *op_reg, ip_addr, dma_value);
+        munmap(w->map_base, MAP_SIZE);
+        w->map_base = MAP_FAILED;
+        close(w->user_fd);
+        w->user_fd = -1;
+        return w;
+    }
+    w->op_reg = op_reg;
+
+    return w;
+}
+
+void completion_destroy(struct completion_waiter *w){
+
+    if (w == NULL){
+        return;
+    }
+    irq_dispatcher_destroy(w->dispatcher);
+    irq_source_close(w->irq);
+    if (w->map_base != MAP_FAILED){
+        munmap(w->map_base, MAP_SIZE);
+    }
+    if (w->user_fd >= 0){
+        close(w->user_fd);
+    }
+    free(w);
+}
+
+/* switches w to WAIT_MODE_IRQ with the user interrupt src (owned by w afterwards)
+ * with use_dispatcher, one poller thread blocks on src and wakes every thread waiting on w
+ */
+void completion_enable_irq(struct completion_waiter *w, struct irq_source *src, int use_dispatcher){
+
+    w->irq = src;
+    if (use_dispatcher){
+        w->dispatcher = irq_dispatcher_create(src);
+    }
+    w->mode = WAIT_MODE_IRQ;
+}
+
+/* selects how completion_wait waits, so that busy-polling and interrupts can be compared
+ * polling modes fall back to what completion_create could set up
+ */
+void completion_set_mode(struct completion_waiter *w, int mode){
+
+    if (mode == WAIT_MODE_IRQ && w->irq == NULL){
+        printf("No user interrupt source, keeping polling mode\n");
+        return;
+    }
+    if (mode == WAIT_MODE_MMIO && w->op_reg == NULL){
+        printf("The op code register is not mapped, keeping DMA polling\n");
+        mode = WAIT_MODE_DMA;
+    }
+    w->mode = mode;
+}
+
+/* must be called before the op code is written, so that an interrupt raised right after the kick is not missed */
+void completion_arm(struct completion_waiter *w){
+
+    if (w->dispatcher != NULL){
+        w->armed_generation = irq_dispatcher_generation(w->dispatcher);
+    }
+}
+
+/* reads the op code register once (user BAR if mapped, C2H DMA otherwise) */
+static uint32_t read_op_code(struct completion_waiter *w){
+
+    uint32_t op_code;
+
+    if (w->mode != WAIT_MODE_DMA && w->op_reg != NULL){
+        op_code = *w->op_reg;
+    }
+    else{
+        channel_read(w->c2h, w->ip_addr, 0x0004, &op_code);
+    }
+
+    return op_code;
+}
+
+/* blocks on the user interrupt until the op code register is no longer busy_code
+ * the register is checked after every interrupt, since a latched event may belong to an earlier op
+ */
+static int completion_wait_irq(struct completion_waiter *w, uint32_t busy_code, uint64_t deadline, uint64_t *checks){
+
+    while (1){
+        ++*checks;
+        if (read_op_code(w) != busy_code){
+            return 0;
+        }
+
+        uint64_t timeout_ns = 0;
+        if (deadline){
+            uint64_t now = now_ns();
+            if (now >= deadline){
+                return -1;
+            }
+            timeout_ns = deadline - now;
+        }
+
+        int rc;
+        if (w->dispatcher != NULL){
+            rc = irq_dispatcher_wait(w->dispatcher, w->armed_generation, timeout_ns);
+            w->armed_generation = irq_dispatcher_generation(w->dispatcher);
+        }
+        else{
+            rc = irq_source_wait(w->irq, timeout_ns, NULL);
+        }
+        if (rc == 0){
+            w->num_irqs++;
+        }
+    }
+}
+
+/* checks the op code register once, returns 1 if it is no longer busy_code */
+int completion_poll(struct completion_waiter *w, uint32_t busy_code){
+    return read_op_code(w) != busy_code;
+}
+
+/* waits without spinning: sleeps on the user interrupt if there is one, otherwise polls with sched_yield
+ * the number of register checks is added to *checks
+ * returns 0 when the op is done, -1 on timeout
+ */
+int completion_block(struct completion_waiter *w, uint32_t busy_code, uint64_t timeout_ns, uint64_t *checks){
+
+    uint64_t deadline = (timeout_ns > 0) ? now_ns() + timeout_ns : 0;
+
+    if (w->irq != NULL){
+        return completion_wait_irq(w, busy_code, deadline, checks);
+    }
+
+    while (1){
+        ++*checks;
+        if (read_op_code(w) != busy_code){
+            return 0;
+        }
+        if (deadline && now_ns() > deadline){
+            return -1;
+        }
+        sched_yield();
+    }
+}
+
+/* waits until the op code register is no longer busy_code
+ * polling modes spin on the register, WAIT_MODE_IRQ sleeps until the done interrupt
+ * returns 0 when the op is done, -1 on timeout
+ */
+int completion_wait(struct completion_waiter *w, uint32_t busy_code){
+
+    uint64_t checks = 0;
+    uint64_t deadline = (w->timeout_ns > 0) ? now_ns() + w->timeout_ns : 0;
+    int rc = 0;
+
+    if (w->mode == WAIT_MODE_IRQ){
+        rc = completion_wait_irq(w, busy_code, deadline, &checks);
+        if (rc != 0){
+            ++w->num_timeouts;
+        }
+    }
+
+    while (w->mode != WAIT_MODE_IRQ){
+        ++checks;
+        if (read_op_code(w) != busy_code){
+            break;
+        }
+        if (deadline && (checks % CHECKS_PER_CLOCK) == 0 && now_ns() > deadline){
+            ++w->num_timeouts;
+            rc = -1;
+            break;
+        }
+        cpu_relax();
+    }
+
+    w->num_waits++;
+    w->last_checks = checks;
+    w->total_checks += checks;
+    if (checks > w->max_checks){
+        w->max_checks = checks;
+    }
+
+    return rc;
+}
+
+void completion_print_stats(const struct completion_waiter *w){
+
+    double avg = (w->num_waits > 0) ? (double) w->total_checks / w->num_waits : 0.0;
+    const char *mode_name = (w->mode == WAIT_MODE_IRQ) ? "user interrupt" : (w->mode == WAIT_MODE_MMIO) ? "user BAR" : "C2H DMA";
+    printf("completion wait (%s): %llu ops, %.1f checks per op on average, max %llu checks, %llu interrupts, %llu timeouts\n",
+           mode_name, (unsigned long long) w->num_waits, avg, (unsigned long long) w->max_checks,
+           (unsigned long long) w->num_irqs, (unsigned long long) w->num_timeouts);
+}
@@ -0,0 +1,72 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <stdint.h>
+
+#include "channel_readwrite.h"
+#include "irq_events.h"
+
+#define WAIT_MODE_DMA 0 // read the op code register through the C2H channel
+#define WAIT_MODE_MMIO 1 // load the op code register from the mmap'd user BAR
+#define WAIT_MODE_IRQ 2 // block until the done-signal user interrupt, then confirm on the register
+
+/* completion-wait primitive for the op code handshake:
+ * HW keeps the op code register at busy_code while it computes and changes it when the op is done
+ */
+struct completion_waiter {
+    int mode;
+    uint64_t timeout_ns;
+
+    /* WAIT_MODE_DMA */
+    struct channel_handle *c2h;
+    uint32_t ip_addr;
+
+    /* WAIT_MODE_MMIO */
+    int user_fd;
+    void *map_base;
+    volatile uint32_t *op_reg;
+
+    /* WAIT_MODE_IRQ, either blocking in epoll_wait directly or through a shared poller thread */
+    struct irq_source *irq;
+    struct irq_dispatcher *dispatcher;
+    uint64_t armed_generation;
+
+    /* statistics: number of register checks per op */
+    uint64_t num_waits;
+    uint64_t num_timeouts;
+    uint64_t last_checks;
+    uint64_t total_checks;
+    uint64_t max_checks;
+    uint64_t num_irqs;
+};
+
+/* pause hint for spin-wait loops */
+static inline void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+struct completion_waiter *completion_create(struct channel_handle *c2h, uint32_t ip_addr, const char *userDevice, uint32_t reg_offset, uint64_t timeout_ns);
+
+void completion_destroy(struct completion_waiter *w);
+
+void completion_enable_irq(struct completion_waiter *w, struct irq_source *src, int use_dispatcher);
+
+void completion_set_mode(struct completion_waiter *w, int mode);
+
+void completion_arm(struct completion_waiter *w);
+
+int completion_wait(struct completion_waiter *w, uint32_t busy_code);
+
+int completion_poll(struct completion_waiter *w, uint32_t busy_code);
+
+int completion_block(struct completion_waiter *w, uint32_t busy_code, uint64_t timeout_ns, uint64_t *checks);
+
+void completion_print_stats(const struct completion_waiter *w);
+
+#endif
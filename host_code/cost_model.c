@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "cost_model.h"
+#include "ctrl_register_read.h"
+#include "utils.h"
+#include "cpu_backend.h"
+
+#define COST_MAGIC "FPGACOST"
+#define COST_FORMAT 3 // bumped whenever struct cost_params or the CPU code it was fitted to changes
+
+#define COST_CALIB_TRIALS 100 // trials per point of the calibration sweeps
+#define COST_CHECK_TRIALS 16 // ops timed to check a cached model against the device
+#define COST_MAX_DRIFT 2.0 // cached op time off by more than this factor: recalibrate
+#define COST_PROBE_OP 1 // op type of the probes for the wait policy (OP_MATVEC of fpga_offload.c)
+
+/* on-disk cache of a calibration */
+struct cost_header {
+    char magic[8];
+    uint32_t format;
+    uint32_t tile;
+    uint64_t fingerprint;
+    struct cost_params params;
+    uint64_t checksum; // FNV-1a of params
+};
+
+static uint64_t cost_fnv(uint64_t hash, const void *data, size_t size){
+
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t i = 0; i < size; i++){
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static double cost_seconds(const struct timespec *ts){
+    return ts->tv_sec + ts->tv_nsec * 1e-9;
+}
+
+/* least-squares fit of time = fixed + slope*x */
+static void cost_fit(const double *x, const double *t, int n, double *fixed, double *slope){
+
+    double sx = 0, st = 0, sxx = 0, sxt = 0;
+    for (int i = 0; i < n; i++){
+        sx += x[i];
+        st += t[i];
+        sxx += x[i] * x[i];
+        sxt += x[i] * t[i];
+    }
+    *slope = (n * sxt - sx * st) / (n * sxx - sx * sx);
+    if (*slope < 0){
+        *slope = 0;
+    }
+    *fixed = (st - *slope * sx) / n;
+    if (*fixed < 0){
+        *fixed = 0;
+    }
+}
+
+/* uploads the probe operands of a FPGA_TILE matvec: a fixed pattern, so that the same logic always gives the same output */
+static void cost_probe_upload(struct fpga_device *dev, float *buffer){
+
+    for (int i = 0; i < FPGA_TILE; i++){
+        buffer[i] = 0.25f * (i % 8 + 1);
+    }
+    for (int i = 0; i < FPGA_TILE * FPGA_TILE; i++){
+        buffer[FPGA_TILE + i] = 0.125f * (i % 13) - 0.5f;
+    }
+    fpga_device_write(dev, dev->bram_addr, sizeof(float) * FPGA_TILE * (FPGA_TILE + 1), buffer);
+}
+
+/* one op on the operands in BRAM, returns the time from the kick to the completion */
+static double cost_probe_op(struct fpga_device *dev){
+
+    struct timespec ts_start, ts_end;
+    uint32_t op_code = 0x5555;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+    struct timespec ts_kick = fpga_device_kick(dev, &op_code);
+    fpga_device_wait(dev, COST_PROBE_OP, FPGA_TILE, 0x5555, &ts_kick);
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    return cost_seconds(&ts_end);
+}
+
+/* average op time over num_trials ops, the probe operands are uploaded again between the timed ops
+ * (multi PE: the output overwrites the vector operand)
+ */
+static double cost_measure_op(struct fpga_device *dev, float *buffer, int num_trials){
+
+    double total = 0;
+    for (int i = 0; i < num_trials; i++){
+        cost_probe_upload(dev, buffer);
+        total += cost_probe_op(dev);
+    }
+    return total / num_trials;
+}
+
+/* identity of the card and of the logic programmed on it:
+ * xdma block identifiers, the enabled channels and the output of the probe op
+ */
+static uint64_t cost_fingerprint(struct fpga_device *dev, float *buffer){
+
+    char path[64];
+    snprintf(path, sizeof(path), "%s_control", dev->prefix);
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = cost_fnv(hash, dev->prefix, strlen(dev->prefix));
+    hash = cost_fnv(hash, &dev->num_h2c, sizeof(dev->num_h2c));
+    hash = cost_fnv(hash, &dev->num_c2h, sizeof(dev->num_c2h));
+    for (off_t reg = 0x0000; reg <= 0x3000; reg += 0x1000){ // H2C, C2H, IRQ and config block identifiers
+        uint32_t id = read_control_register(path, reg);
+        hash = cost_fnv(hash, &id, sizeof(id));
+    }
+
+    cost_probe_upload(dev, buffer);
+    cost_probe_op(dev);
+    channel_read(dev->c2h[0], dev->bram_addr, sizeof(float) * FPGA_TILE, buffer); // multi PE
+    hash = cost_fnv(hash, buffer, sizeof(float) * FPGA_TILE);
+
+    return hash;
+}
+
+/* transfer sweeps like profile_transferSize, op probes and CPU probes */
+static void cost_calibrate(struct cost_model *cm, float *buffer){
+
+    struct fpga_device *dev = cm->dev;
+    struct cost_params *p = &cm->params;
+    struct timespec ts, ts_avg;
+    double x[16], t_h2c[16], t_c2h[16];
+    int n = 0;
+
+    printf("Calibrating the cost model of %s...\n", dev->prefix);
+
+    for (uint32_t size = 0x0100; size <= dev->bram_size; size *= 2, n++){
+        timespec_init(&ts_avg);
+        for (int i = 0; i < COST_CALIB_TRIALS; i++){
+            ts = fpga_device_write(dev, dev->bram_addr, size, buffer);
+            timespec_add(&ts_avg, &ts);
+        }
+        timespec_div(&ts_avg, COST_CALIB_TRIALS);
+        t_h2c[n] = cost_seconds(&ts_avg);
+
+        timespec_init(&ts_avg);
+        for (int i = 0; i < COST_CALIB_TRIALS; i++){
+            ts = channel_read(dev->c2h[0], dev->bram_addr, size, buffer);
+            timespec_add(&ts_avg, &ts);
+        }
+        timespec_div(&ts_avg, COST_CALIB_TRIALS);
+        t_c2h[n] = cost_seconds(&ts_avg);
+        x[n] = size;
+    }
+    cost_fit(x, t_h2c, n, &p->h2c_fixed, &p->h2c_per_byte);
+    cost_fit(x, t_c2h, n, &p->c2h_fixed, &p->c2h_per_byte);
+
+    p->op_time = cost_measure_op(dev, buffer, COST_CALIB_TRIALS);
+
+    /* square CPU problems of growing size */
+    int edge = 4 * FPGA_TILE;
+    float *A = (float *) malloc(sizeof(float) * edge * edge * 3);
+    assert(A);
+    float *B = A + edge * edge;
+    float *C = B + edge * edge;
+    for (int i = 0; i < edge * edge; i++){
+        A[i] = (rand()%10000 + 1) * 0.001f;
+        B[i] = (rand()%10000 + 1) * 0.001f;
+    }
+    for (int op = 0; op < COST_NUM_OPS; op++){
+        n = 0;
+        for (int size = 16; size <= edge; size *= 2, n++){
+            int num_trials = (op == COST_OP_MATVEC) ? COST_CALIB_TRIALS : 4;
+            timespec_init(&ts_avg);
+            for (int i = 0; i < num_trials; i++){
+                ts = (op == COST_OP_MATVEC) ? cpu_gemv(NULL, A, B, C, size, size, CPU_SUM_FAST) : cpu_gemm(NULL, A, B, C, size, size, size);
+                timespec_add(&ts_avg, &ts);
+            }
+            timespec_div(&ts_avg, num_trials);
+            t_h2c[n] = cost_seconds(&ts_avg);
+            x[n] = (op == COST_OP_MATVEC) ? (double) size * size : (double) size * size * size;
+        }
+        cost_fit(x, t_h2c, n, &p->cpu_fixed[op], &p->cpu_per_mac[op]);
+    }
+    free(A);
+
+    cm->calibrated = 1;
+}
+
+/* reads the calibration cached at path, returns 0 if it is intact and was made on a device with the same fingerprint */
+static int cost_load(struct cost_model *cm, const char *path){
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL){
+        return -1;
+    }
+
+    struct cost_header header;
+    int ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+             memcmp(header.magic, COST_MAGIC, sizeof(header.magic)) == 0 && header.format == COST_FORMAT &&
+             header.tile == FPGA_TILE && header.fingerprint == cm->fingerprint &&
+             header.checksum == cost_fnv(0xcbf29ce484222325ULL, &header.params, sizeof(header.params));
+    fclose(fp);
+
+    if (!ok){
+        return -1;
+    }
+    cm->params = header.params;
+    return 0;
+}
+
+static int cost_save(const struct cost_model *cm, const char *path){
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL){
+        return -1;
+    }
+
+    struct cost_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COST_MAGIC, sizeof(header.magic));
+    header.format = COST_FORMAT;
+    header.tile = FPGA_TILE;
+    header.fingerprint = cm->fingerprint;
+    header.params = cm->params;
+    header.checksum = cost_fnv(0xcbf29ce484222325ULL, &header.params, sizeof(header.params));
+
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    if (fclose(fp) != 0 || !ok){
+        return -1;
+    }
+    return 0;
+}
+
+/* warm start: takes the calibration cached at path if it was made on this card with the same bitstream
+ * and its op time still matches the device, otherwise calibrates and saves the result to path
+ * the probes overwrite BRAM
+ */
+struct cost_model *cost_model_warm(struct fpga_device *dev, const char *path){
+
+    struct cost_model *cm;
+    cm = (struct cost_model *) calloc(1, sizeof(struct cost_model));
+    assert(cm);
+    cm->dev = dev;
+
+    float *buffer;
+    buffer = (float *) channel_alloc_buffer(dev->h2c[0], dev->bram_size);
+    memset(buffer, 0, dev->bram_size);
+
+    cm->fingerprint = cost_fingerprint(dev, buffer);
+
+    if (cost_load(cm, path) == 0){
+        double op_time = cost_measure_op(dev, buffer, COST_CHECK_TRIALS);
+        if (op_time < cm->params.op_time * COST_MAX_DRIFT && op_time * COST_MAX_DRIFT > cm->params.op_time){
+            channel_free_buffer(buffer);
+            return cm;
+        }
+        printf("%s: op time %.9f s differs from the cached %.9f s\n", dev->prefix, op_time, cm->params.op_time);
+    }
+
+    cost_calibrate(cm, buffer);
+    if (cost_save(cm, path) != 0){
+        printf("Warning: cost model could not be saved to %s\n", path);
+    }
+
+    channel_free_buffer(buffer);
+    return cm;
+}
+
+void cost_model_destroy(struct cost_model *cm){
+    free(cm);
+}
+
+static double cost_h2c(const struct cost_params *p, double bytes){
+    return p->h2c_fixed + bytes * p->h2c_per_byte;
+}
+
+static double cost_c2h(const struct cost_params *p, double bytes){
+    return p->c2h_fixed + bytes * p->c2h_per_byte;
+}
+
+/* predicted time of the FPGA path
+ * matvec (A: M*K): every tile goes out with its vector tile as one transfer, then one op and one readback
+ * matmul (A: M*K, B: K*N): B is prepacked, each tile of B is uploaded once and every row of A is one op
+ */
+double cost_model_fpga(const struct cost_model *cm, int op, int M, int K, int N){
+
+    const struct cost_params *p = &cm->params;
+    double T = FPGA_TILE;
+    double tiles_k = (K + FPGA_TILE - 1) / FPGA_TILE;
+
+    if (op == COST_OP_MATVEC){
+        double tiles = ((M + FPGA_TILE - 1) / FPGA_TILE) * tiles_k;
+        return tiles * (cost_h2c(p, 4 * (T + T * T)) + p->op_time + cost_c2h(p, 4 * T));
+    }
+
+    double tiles_b = tiles_k * ((N + FPGA_TILE - 1) / FPGA_TILE);
+    double prepack = (double) K * N * p->cpu_per_mac[COST_OP_MATVEC];
+    return prepack + tiles_b * (cost_h2c(p, 4 * T * T) + M * (cost_h2c(p, 4 * T) + p->op_time + cost_c2h(p, 4 * T)));
+}
+
+/* predicted time of the CPU path */
+double cost_model_cpu(const struct cost_model *cm, int op, int M, int K, int N){
+
+    const struct cost_params *p = &cm->params;
+    double macs = (double) M * K * ((op == COST_OP_MATVEC) ? 1 : N);
+
+    return p->cpu_fixed[op] + macs * p->cpu_per_mac[op];
+}
+
+/* returns COST_TARGET_FPGA or COST_TARGET_CPU, whichever the model says finishes the request first */
+int cost_model_choose(struct cost_model *cm, int op, int M, int K, int N){
+
+    assert(op >= 0 && op < COST_NUM_OPS);
+
+    if (cost_model_fpga(cm, op, M, K, N) < cost_model_cpu(cm, op, M, K, N)){
+        cm->num_fpga[op]++;
+        return COST_TARGET_FPGA;
+    }
+    cm->num_cpu[op]++;
+    return COST_TARGET_CPU;
+}
+
+void cost_model_print(const struct cost_model *cm){
+
+    const struct cost_params *p = &cm->params;
+    static const char *op_names[COST_NUM_OPS] = {"matvec", "matmul"};
+
+    printf("cost model of %s (%s, fingerprint %016llx):\n", cm->dev->prefix,
+           cm->calibrated ? "calibrated" : "cached", (unsigned long long) cm->fingerprint);
+    printf("  H2C: %.9f s + %.3f MB/s, C2H: %.9f s + %.3f MB/s, op: %.9f s\n",
+           p->h2c_fixed, (p->h2c_per_byte > 0) ? 1e-6 / p->h2c_per_byte : 0.0,
+           p->c2h_fixed, (p->c2h_per_byte > 0) ? 1e-6 / p->c2h_per_byte : 0.0, p->op_time);
+    for (int op = 0; op < COST_NUM_OPS; op++){
+        printf("  CPU %s: %.9f s + %.3f MMAC/s, routed %llu to CPU, %llu to FPGA\n", op_names[op],
+               p->cpu_fixed[op], (p->cpu_per_mac[op] > 0) ? 1e-6 / p->cpu_per_mac[op] : 0.0,
+               (unsigned long long) cm->num_cpu[op], (unsigned long long) cm->num_fpga[op]);
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef COST_MODEL_H
+#define COST_MODEL_H
+
+#include <stdint.h>
+
+#include "fpga_device.h"
+
+#define COST_OP_MATVEC 0
+#define COST_OP_MATMUL 1
+#define COST_NUM_OPS 2
+
+#define COST_TARGET_CPU 0
+#define COST_TARGET_FPGA 1
+
+/* fitted latency model, in seconds: fixed overhead + bytes/bandwidth + compute
+ * this part is cached on disk together with the fingerprint of the device it was calibrated on
+ */
+struct cost_params {
+    double h2c_fixed; // per transfer
+    double h2c_per_byte;
+    double c2h_fixed;
+    double c2h_per_byte;
+    double op_time; // kick, HW runtime and completion of one FPGA_TILE op
+    double cpu_fixed[COST_NUM_OPS]; // per call of the CPU code, for each COST_OP
+    double cpu_per_mac[COST_NUM_OPS]; // per multiply-add of the CPU code
+};
+
+/* decides per call whether the CPU or the FPGA finishes a request first */
+struct cost_model {
+    struct fpga_device *dev;
+    uint64_t fingerprint; // identity of the card and its bitstream
+    struct cost_params params;
+    int calibrated; // 1: calibrated in this run, 0: taken from the cache
+
+    uint64_t num_cpu[COST_NUM_OPS]; // requests routed to each side
+    uint64_t num_fpga[COST_NUM_OPS];
+};
+
+struct cost_model *cost_model_warm(struct fpga_device *dev, const char *path);
+
+void cost_model_destroy(struct cost_model *cm);
+
+double cost_model_fpga(const struct cost_model *cm, int op, int M, int K, int N);
+
+double cost_model_cpu(const struct cost_model *cm, int op, int M, int K, int N);
+
+int cost_model_choose(struct cost_model *cm, int op, int M, int K, int N);
+
+void cost_model_print(const struct cost_model *cm);
+
+#endif
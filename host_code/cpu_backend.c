@@ -0,0 +1,636 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <immintrin.h>
+
+#include "cpu_backend.h"
+#include "utils.h"
+
+/* cache blocking: a KC*NR panel of B stays in L1, the MC*KC panel of A in L2, the KC*NC block of B in L3 */
+#define GEMM_MC 96 // multiple of every MR
+#define GEMM_KC 256
+#define GEMM_NC 2048 // multiple of every NR
+#define GEMM_MAX_MR 6
+#define GEMM_MAX_NR 32
+#define GEMV_ROWS 32 // rows of A per task of a threaded cpu_gemv
+#define GEMV_PARALLEL_MIN (1 << 16) // numbers of A below which cpu_gemv stays on the calling thread
+
+/* C[MR*NR] (+)= A panel * B panel, a: kc*MR packed by columns, b: kc*NR packed by rows */
+typedef void (*gemm_kernel)(int kc, const float *a, const float *b, float *c, int ldc, int accumulate);
+
+struct gemm_isa {
+    int mr;
+    int nr;
+    gemm_kernel kernel;
+};
+
+/* one (NC, KC) block of B against all MC row panels of A */
+struct gemm_job {
+    const struct gemm_isa *isa;
+    const float *A;
+    const float *packed_B;
+    float *C;
+    int M;
+    int K; // leading dimension of A
+    int N; // leading dimension of C
+    int jc, nc; // columns of the block
+    int pc, kc; // depth of the block
+
+    pthread_mutex_t lock;
+    int next_panel;
+    int num_panels;
+};
+
+static void kernel_scalar(int kc, const float *a, const float *b, float *c, int ldc, int accumulate){
+
+    float acc[4][8] = {{0.0f}};
+    for (int k = 0; k < kc; k++){
+        for (int i = 0; i < 4; i++){
+            for (int j = 0; j < 8; j++){
+                acc[i][j] += a[4*k + i] * b[8*k + j];
+            }
+        }
+    }
+    for (int i = 0; i < 4; i++){
+        for (int j = 0; j < 8; j++){
+            c[ldc*i + j] = accumulate ? c[ldc*i + j] + acc[i][j] : acc[i][j];
+        }
+    }
+}
+
+/* 6x16 tile in 12 ymm accumulators, one broadcast of A and two FMAs per row and depth */
+__attribute__((target("avx2,fma")))
+static void kernel_avx2(int kc, const float *a, const float *b, float *c, int ldc, int accumulate){
+
+    __m256 acc[6][2];
+    for (int i = 0; i < 6; i++){
+        acc[i][0] = accumulate ? _mm256_loadu_ps(c + ldc*i) : _mm256_setzero_ps();
+        acc[i][1] = accumulate ? _mm256_loadu_ps(c + ldc*i + 8) : _mm256_setzero_ps();
+    }
+    for (int k = 0; k < kc; k++){
+        __m256 b0 = _mm256_loadu_ps(b + 16*k);
+        __m256 b1 = _mm256_loadu_ps(b + 16*k + 8);
+        for (int i = 0; i < 6; i++){
+            __m256 ai = _mm256_broadcast_ss(a + 6*k + i);
+            acc[i][0] = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+        }
+    }
+    for (int i = 0; i < 6; i++){
+        _mm256_storeu_ps(c + ldc*i, acc[i][0]);
+        _mm256_storeu_ps(c + ldc*i + 8, acc[i][1]);
+    }
+}
+
+/* 6x32 tile in 12 zmm accumulators */
+__attribute__((target("avx512f")))
+static void kernel_avx512(int kc, const float *a, const float *b, float *c, int ldc, int accumulate){
+
+    __m512 acc[6][2];
+    for (int i = 0; i < 6; i++){
+        acc[i][0] = accumulate ? _mm512_loadu_ps(c + ldc*i) : _mm512_setzero_ps();
+        acc[i][1] = accumulate ? _mm512_loadu_ps(c + ldc*i + 16) : _mm512_setzero_ps();
+    }
+    for (int k = 0; k < kc; k++){
+        __m512 b0 = _mm512_loadu_ps(b + 32*k);
+        __m512 b1 = _mm512_loadu_ps(b + 32*k + 16);
+        for (int i = 0; i < 6; i++){
+            __m512 ai = _mm512_set1_ps(a[6*k + i]);
+            acc[i][0] = _mm512_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_ps(ai, b1, acc[i][1]);
+        }
+    }
+    for (int i = 0; i < 6; i++){
+        _mm512_storeu_ps(c + ldc*i, acc[i][0]);
+        _mm512_storeu_ps(c + ldc*i + 16, acc[i][1]);
+    }
+}
+
+static const struct gemm_isa gemm_isas[] = {
+    {4, 8, kernel_scalar},
+    {6, 16, kernel_avx2},
+    {6, 32, kernel_avx512},
+};
+
+/* widest microkernel this CPU supports (CPUID), looked up once */
+int cpu_gemm_isa(void){
+
+    static int isa = -1;
+    if (isa < 0){
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")){
+            isa = CPU_ISA_AVX512;
+        }
+        else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+            isa = CPU_ISA_AVX2;
+        }
+        else{
+            isa = CPU_ISA_SCALAR;
+        }
+    }
+    return isa;
+}
+
+/* kc*nc block of B (leading dimension ldb) into NR-column panels, zero-padded to a multiple of NR */
+static void pack_B(const struct gemm_isa *isa, const float *B, int ldb, int kc, int nc, float *packed){
+
+    int nr = isa->nr;
+    for (int j = 0; j < nc; j += nr, packed += kc * nr){
+        int n = (nc - j < nr) ? nc - j : nr;
+        for (int k = 0; k < kc; k++){
+            const float *src = B + (size_t) ldb*k + j;
+            float *dst = packed + nr*k;
+            memcpy(dst, src, sizeof(float) * n);
+            memset(dst + n, 0, sizeof(float) * (nr - n));
+        }
+    }
+}
+
+/* mc*kc panel of A (leading dimension lda) into MR-row slivers stored by columns, zero-padded to a multiple of MR */
+static void pack_A(const struct gemm_isa *isa, const float *A, int lda, int mc, int kc, float *packed){
+
+    int mr = isa->mr;
+    for (int i = 0; i < mc; i += mr, packed += kc * mr){
+        int m = (mc - i < mr) ? mc - i : mr;
+        for (int k = 0; k < kc; k++){
+            for (int r = 0; r < mr; r++){
+                packed[mr*k + r] = (r < m) ? A[(size_t) lda*(i + r) + k] : 0.0f;
+            }
+        }
+    }
+}
+
+/* rows ic ~ ic+mc-1 of the job's block of C, from the packed panel of A and the packed block of B */
+static void gemm_macro(const struct gemm_job *job, const float *packed_A, int ic, int mc){
+
+    const struct gemm_isa *isa = job->isa;
+    int accumulate = job->pc > 0;
+    float tile[GEMM_MAX_MR * GEMM_MAX_NR];
+
+    for (int jr = 0; jr < job->nc; jr += isa->nr){
+        int nr = (job->nc - jr < isa->nr) ? job->nc - jr : isa->nr;
+        const float *b = job->packed_B + (size_t) jr * job->kc;
+
+        for (int ir = 0; ir < mc; ir += isa->mr){
+            int mr = (mc - ir < isa->mr) ? mc - ir : isa->mr;
+            const float *a = packed_A + (size_t) ir * job->kc;
+            float *c = job->C + (size_t) job->N*(ic + ir) + job->jc + jr;
+
+            if (mr == isa->mr && nr == isa->nr){
+                isa->kernel(job->kc, a, b, c, job->N, accumulate);
+                continue;
+            }
+            /* edge tile: computed in full, only the valid part is stored */
+            isa->kernel(job->kc, a, b, tile, isa->nr, 0);
+            for (int i = 0; i < mr; i++){
+                for (int j = 0; j < nr; j++){
+                    c[job->N*i + j] = accumulate ? c[job->N*i + j] + tile[isa->nr*i + j] : tile[isa->nr*i + j];
+                }
+            }
+        }
+    }
+}
+
+/* takes MC row panels of the job until none is left */
+static void gemm_job_run(struct gemm_job *job, float *packed_A){
+
+    while (1){
+        pthread_mutex_lock(&job->lock);
+        int panel = job->next_panel++;
+        pthread_mutex_unlock(&job->lock);
+        if (panel >= job->num_panels){
+            break;
+        }
+
+        int ic = panel * GEMM_MC;
+        int mc = (job->M - ic < GEMM_MC) ? job->M - ic : GEMM_MC;
+        pack_A(job->isa, job->A + (size_t) job->K*ic + job->pc, job->K, mc, job->kc, packed_A);
+        gemm_macro(job, packed_A, ic, mc);
+    }
+}
+
+static void *cpu_worker_main(void *arg){
+
+    struct cpu_worker *worker = (struct cpu_worker *) arg;
+    struct cpu_backend *cb = worker->cb;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&cb->lock);
+    while (1){
+        while (cb->generation == seen && !cb->quit){
+            pthread_cond_wait(&cb->start, &cb->lock);
+        }
+        if (cb->quit){
+            break;
+        }
+        seen = cb->generation;
+        cpu_task task = cb->task;
+        void *task_arg = cb->task_arg;
+        pthread_mutex_unlock(&cb->lock);
+
+        task(task_arg, cb, worker->index);
+
+        pthread_mutex_lock(&cb->lock);
+        if (--cb->num_busy == 0){
+            pthread_cond_signal(&cb->done);
+        }
+    }
+    pthread_mutex_unlock(&cb->lock);
+
+    return NULL;
+}
+
+/* runs task on all threads of the pool and returns when every thread is done */
+static void cpu_pool_run(struct cpu_backend *cb, cpu_task task, void *arg){
+
+    pthread_mutex_lock(&cb->lock);
+    cb->task = task;
+    cb->task_arg = arg;
+    cb->num_busy = cb->num_threads - 1;
+    cb->generation++;
+    pthread_cond_broadcast(&cb->start);
+    pthread_mutex_unlock(&cb->lock);
+
+    task(arg, cb, 0);
+
+    pthread_mutex_lock(&cb->lock);
+    while (cb->num_busy > 0){
+        pthread_cond_wait(&cb->done, &cb->lock);
+    }
+    pthread_mutex_unlock(&cb->lock);
+}
+
+static void gemm_task(void *arg, struct cpu_backend *cb, int thread){
+    gemm_job_run((struct gemm_job *) arg, cb->packed_A[thread]);
+}
+
+static float *gemm_alloc(size_t num){
+
+    void *p;
+    if (posix_memalign(&p, 64, sizeof(float) * num) != 0){
+        printf("ERROR: GEMM buffer could not be allocated\n");
+        exit(1);
+    }
+    return (float *) p;
+}
+
+/* thread pool of num_threads threads including the caller (0: one per online CPU)
+ * isa selects the microkernel, -1 for the widest one this CPU supports
+ */
+struct cpu_backend *cpu_backend_create(int num_threads, int isa){
+
+    if (num_threads <= 0){
+        num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_threads > CPU_MAX_THREADS){
+        num_threads = CPU_MAX_THREADS;
+    }
+
+    struct cpu_backend *cb;
+    cb = (struct cpu_backend *) calloc(1, sizeof(struct cpu_backend));
+    assert(cb);
+    cb->num_threads = num_threads;
+    cb->isa = (isa < 0) ? cpu_gemm_isa() : isa;
+    assert(cb->isa <= cpu_gemm_isa());
+
+    pthread_mutex_init(&cb->lock, NULL);
+    pthread_cond_init(&cb->start, NULL);
+    pthread_cond_init(&cb->done, NULL);
+
+    cb->packed_B = gemm_alloc((size_t) GEMM_KC * GEMM_NC);
+    for (int t = 0; t < num_threads; t++){
+        cb->packed_A[t] = gemm_alloc((size_t) GEMM_MC * GEMM_KC);
+        cb->workers[t].cb = cb;
+        cb->workers[t].index = t;
+    }
+    for (int t = 1; t < num_threads; t++){
+        if (pthread_create(&cb->threads[t], NULL, cpu_worker_main, &cb->workers[t]) != 0){
+            printf("ERROR: CPU backend thread could not be created\n");
+            exit(1);
+        }
+    }
+
+    return cb;
+}
+
+void cpu_backend_destroy(struct cpu_backend *cb){
+
+    if (cb == NULL){
+        return;
+    }
+
+    pthread_mutex_lock(&cb->lock);
+    cb->quit = 1;
+    pthread_cond_broadcast(&cb->start);
+    pthread_mutex_unlock(&cb->lock);
+    for (int t = 1; t < cb->num_threads; t++){
+        pthread_join(cb->threads[t], NULL);
+    }
+
+    for (int t = 0; t < cb->num_threads; t++){
+        free(cb->packed_A[t]);
+    }
+    free(cb->packed_B);
+    pthread_mutex_destroy(&cb->lock);
+    pthread_cond_destroy(&cb->start);
+    pthread_cond_destroy(&cb->done);
+    free(cb);
+}
+
+/* C = A*B (A: num_rowA*num_colA, B: num_colA*num_colB, all row-major)
+ * on the thread pool of cb, or on the calling thread alone with the widest microkernel if cb is NULL
+ * (e.g. from threads that already split the work, such as the CPU workers of hetero_run)
+ * returns total execution time
+ */
+struct timespec cpu_gemm(struct cpu_backend *cb, const float *in_matrix1, const float *in_matrix2, float *out_matrix, int num_rowA, int num_colA, int num_colB){
+
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    struct gemm_job job;
+    job.isa = &gemm_isas[(cb != NULL) ? cb->isa : cpu_gemm_isa()];
+    job.A = in_matrix1;
+    job.C = out_matrix;
+    job.M = num_rowA;
+    job.K = num_colA;
+    job.N = num_colB;
+    job.num_panels = (num_rowA + GEMM_MC - 1) / GEMM_MC;
+    pthread_mutex_init(&job.lock, NULL);
+
+    /* without a backend, the pack buffers of the calling thread are allocated by its first call and kept for its lifetime */
+    static __thread float *thread_packed_A = NULL;
+    static __thread float *thread_packed_B = NULL;
+    if (cb == NULL && thread_packed_A == NULL){
+        thread_packed_A = gemm_alloc((size_t) GEMM_MC * GEMM_KC);
+        thread_packed_B = gemm_alloc((size_t) GEMM_KC * GEMM_NC);
+    }
+
+    float *packed_A = (cb != NULL) ? cb->packed_A[0] : thread_packed_A;
+    float *packed_B = (cb != NULL) ? cb->packed_B : thread_packed_B;
+    job.packed_B = packed_B;
+
+    if (num_colA == 0){
+        memset(out_matrix, 0, sizeof(float) * num_rowA * num_colB);
+    }
+
+    for (job.jc = 0; job.jc < num_colB; job.jc += GEMM_NC){
+        job.nc = (num_colB - job.jc < GEMM_NC) ? num_colB - job.jc : GEMM_NC;
+
+        for (job.pc = 0; job.pc < num_colA; job.pc += GEMM_KC){
+            job.kc = (num_colA - job.pc < GEMM_KC) ? num_colA - job.pc : GEMM_KC;
+            pack_B(job.isa, in_matrix2 + (size_t) num_colB*job.pc + job.jc, num_colB, job.kc, job.nc, packed_B);
+            job.next_panel = 0;
+
+            /* a single row panel is not worth waking the pool */
+            if (cb == NULL || cb->num_threads == 1 || job.num_panels == 1){
+                gemm_job_run(&job, packed_A);
+                continue;
+            }
+
+            cpu_pool_run(cb, gemm_task, &job);
+        }
+    }
+
+    pthread_mutex_destroy(&job.lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    if (cb != NULL){
+        cb->num_calls++;
+        cb->flops += 2.0 * num_rowA * num_colA * num_colB;
+        timespec_add(&cb->busy_time, &ts_end);
+    }
+
+    return ts_end;
+}
+
+/* sum of n products, scalar: four accumulators, or one compensated accumulator */
+static float dot_scalar(const float *x, const float *y, int n, int sum_mode){
+
+    if (sum_mode == CPU_SUM_KAHAN){
+        float sum = 0.0f, c = 0.0f;
+        for (int i = 0; i < n; i++){
+            float v = x[i] * y[i] - c;
+            float t = sum + v;
+            c = (t - sum) - v;
+            sum = t;
+        }
+        return sum;
+    }
+
+    float acc[4] = {0.0f};
+    int i;
+    for (i = 0; i + 4 <= n; i += 4){
+        for (int l = 0; l < 4; l++){
+            acc[l] += x[i + l] * y[i + l];
+        }
+    }
+    for (; i < n; i++){
+        acc[0] += x[i] * y[i];
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+/* adds the lanes of sum (and subtracts their compensations) with a compensated scalar sum */
+static float dot_reduce(const float *sum, const float *comp, int num_lanes){
+
+    float total = 0.0f, c = 0.0f;
+    for (int l = 0; l < num_lanes; l++){
+        float v = (sum[l] - comp[l]) - c;
+        float t = total + v;
+        c = (t - total) - v;
+        total = t;
+    }
+    return total;
+}
+
+/* sum of n products, AVX2: four independent 8-lane FMA chains, or two 8-lane compensated accumulators */
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *x, const float *y, int n, int sum_mode){
+
+    float sum[32], comp[32] = {0.0f};
+    int i = 0;
+
+    if (sum_mode == CPU_SUM_KAHAN){
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        __m256 c0 = _mm256_setzero_ps(), c1 = _mm256_setzero_ps();
+        for (; i + 16 <= n; i += 16){
+            __m256 v0 = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)), c0);
+            __m256 v1 = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8)), c1);
+            __m256 t0 = _mm256_add_ps(s0, v0);
+            __m256 t1 = _mm256_add_ps(s1, v1);
+            c0 = _mm256_sub_ps(_mm256_sub_ps(t0, s0), v0);
+            c1 = _mm256_sub_ps(_mm256_sub_ps(t1, s1), v1);
+            s0 = t0;
+            s1 = t1;
+        }
+        _mm256_storeu_ps(sum, s0);
+        _mm256_storeu_ps(sum + 8, s1);
+        _mm256_storeu_ps(comp, c0);
+        _mm256_storeu_ps(comp + 8, c1);
+        sum[16] = dot_scalar(x + i, y + i, n - i, CPU_SUM_KAHAN);
+        return dot_reduce(sum, comp, 17);
+    }
+
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    for (; i + 32 <= n; i += 32){
+        a0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), a0);
+        a1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), a1);
+        a2 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 16), _mm256_loadu_ps(y + i + 16), a2);
+        a3 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 24), _mm256_loadu_ps(y + i + 24), a3);
+    }
+    for (; i + 8 <= n; i += 8){
+        a0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), a0);
+    }
+    _mm256_storeu_ps(sum, _mm256_add_ps(_mm256_add_ps(a0, a1), _mm256_add_ps(a2, a3)));
+    float total = dot_scalar(x + i, y + i, n - i, CPU_SUM_FAST);
+    for (int l = 0; l < 8; l++){
+        total += sum[l];
+    }
+    return total;
+}
+
+/* four rows of A against x at once, so that every load of x serves four FMA chains */
+__attribute__((target("avx2,fma")))
+static void gemv4_avx2(const float *A, int lda, const float *x, int n, float *y){
+
+    const float *r0 = A, *r1 = A + lda, *r2 = A + 2*lda, *r3 = A + 3*lda;
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    int i;
+    for (i = 0; i + 8 <= n; i += 8){
+        __m256 xv = _mm256_loadu_ps(x + i);
+        a0 = _mm256_fmadd_ps(_mm256_loadu_ps(r0 + i), xv, a0);
+        a1 = _mm256_fmadd_ps(_mm256_loadu_ps(r1 + i), xv, a1);
+        a2 = _mm256_fmadd_ps(_mm256_loadu_ps(r2 + i), xv, a2);
+        a3 = _mm256_fmadd_ps(_mm256_loadu_ps(r3 + i), xv, a3);
+    }
+
+    /* horizontal sums of the four accumulators in one go */
+    __m256 s01 = _mm256_hadd_ps(a0, a1);
+    __m256 s23 = _mm256_hadd_ps(a2, a3);
+    __m256 s = _mm256_hadd_ps(s01, s23);
+    __m128 sums = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+    _mm_storeu_ps(y, sums);
+
+    for (; i < n; i++){
+        y[0] += r0[i] * x[i];
+        y[1] += r1[i] * x[i];
+        y[2] += r2[i] * x[i];
+        y[3] += r3[i] * x[i];
+    }
+}
+
+static int cpu_simd(void){
+    return cpu_gemm_isa() != CPU_ISA_SCALAR;
+}
+
+/* inner product of two vectors with the widest kernel of this CPU */
+float cpu_dot(const float *in_vector1, const float *in_vector2, int size, int sum_mode){
+
+    if (cpu_simd()){
+        return dot_avx2(in_vector1, in_vector2, size, sum_mode);
+    }
+    return dot_scalar(in_vector1, in_vector2, size, sum_mode);
+}
+
+/* vector innerproduct, *out = in_vector1 . in_vector2
+ * returns total execution time
+ */
+struct timespec cpu_fast_innerproduct(const float *in_vector1, const float *in_vector2, float *out, int size, int sum_mode){
+
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    *out = cpu_dot(in_vector1, in_vector2, size, sum_mode);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    return ts_end;
+}
+
+/* rows row_begin ~ row_end-1 of y = A*x */
+static void gemv_rows(const float *A, const float *x, float *y, int num_col, int row_begin, int row_end, int sum_mode){
+
+    int row = row_begin;
+    if (sum_mode == CPU_SUM_FAST && cpu_simd()){
+        for (; row + 4 <= row_end; row += 4){
+            gemv4_avx2(A + (size_t) num_col*row, num_col, x, num_col, y + row);
+        }
+    }
+    for (; row < row_end; row++){
+        y[row] = cpu_dot(A + (size_t) num_col*row, x, num_col, sum_mode);
+    }
+}
+
+struct gemv_job {
+    const float *A;
+    const float *x;
+    float *y;
+    int num_row;
+    int num_col;
+    int sum_mode;
+
+    pthread_mutex_t lock;
+    int next_row;
+};
+
+static void gemv_task(void *arg, struct cpu_backend *cb, int thread){
+
+    (void) cb;
+    (void) thread;
+
+    struct gemv_job *job = (struct gemv_job *) arg;
+    while (1){
+        pthread_mutex_lock(&job->lock);
+        int row = job->next_row;
+        job->next_row += GEMV_ROWS;
+        pthread_mutex_unlock(&job->lock);
+        if (row >= job->num_row){
+            break;
+        }
+        int row_end = (row + GEMV_ROWS < job->num_row) ? row + GEMV_ROWS : job->num_row;
+        gemv_rows(job->A, job->x, job->y, job->num_col, row, row_end, job->sum_mode);
+    }
+}
+
+/* y = A*x (A: num_row*num_col, row-major)
+ * rows are read once, four at a time against the same loads of x; on the thread pool of cb for large A,
+ * on the calling thread if cb is NULL
+ * returns total execution time
+ */
+struct timespec cpu_gemv(struct cpu_backend *cb, const float *in_matrix, const float *in_vector, float *out_vector, int num_row, int num_col, int sum_mode){
+
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    if (cb == NULL || cb->num_threads == 1 || (size_t) num_row * num_col < GEMV_PARALLEL_MIN){
+        gemv_rows(in_matrix, in_vector, out_vector, num_col, 0, num_row, sum_mode);
+    }
+    else{
+        struct gemv_job job = {in_matrix, in_vector, out_vector, num_row, num_col, sum_mode, PTHREAD_MUTEX_INITIALIZER, 0};
+        cpu_pool_run(cb, gemv_task, &job);
+        pthread_mutex_destroy(&job.lock);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    if (cb != NULL){
+        cb->num_gemv++;
+    }
+
+    return ts_end;
+}
+
+void cpu_backend_print_stats(const struct cpu_backend *cb){
+
+    static const char *isa_names[] = {"scalar", "AVX2", "AVX-512"};
+    double seconds = cb->busy_time.tv_sec + cb->busy_time.tv_nsec / 1e9;
+
+    printf("CPU backend: %d threads, %s microkernel, %llu GEMMs, %.3f GFLOP/s, %llu GEMVs\n", cb->num_threads, isa_names[cb->isa],
+           (unsigned long long) cb->num_calls, (seconds > 0) ? cb->flops / seconds / 1e9 : 0.0, (unsigned long long) cb->num_gemv);
+}
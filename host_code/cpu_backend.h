@@ -0,0 +1,73 @@
+#ifndef CPU_BACKEND_H
+#define CPU_BACKEND_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#define CPU_MAX_THREADS 16
+
+/* microkernels of cpu_gemm */
+#define CPU_ISA_SCALAR 0
+#define CPU_ISA_AVX2 1 // AVX2 + FMA
+#define CPU_ISA_AVX512 2
+
+/* summation of cpu_dot and cpu_gemv */
+#define CPU_SUM_FAST 0 // independent SIMD accumulators
+#define CPU_SUM_KAHAN 1 // compensated per accumulator, for use as a verification reference
+
+struct cpu_backend;
+
+/* work of one pool call, run by every thread of the pool (thread 0 is the caller) */
+typedef void (*cpu_task)(void *arg, struct cpu_backend *cb, int thread);
+
+struct cpu_worker {
+    struct cpu_backend *cb;
+    int index; // packed_A panel of the thread
+};
+
+/* CPU backend (GEMM, GEMV, inner product) with a persistent thread pool
+ * GEMM: C = A*B is computed in NC column blocks and KC depth blocks of B (packed once per block and shared),
+ * and MC row panels of A that the threads take in turn, each packing its panel for the register-blocked microkernel
+ */
+struct cpu_backend {
+    int num_threads; // including the calling thread
+    int isa;
+    pthread_t threads[CPU_MAX_THREADS];
+    struct cpu_worker workers[CPU_MAX_THREADS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t start; // a new job for the workers
+    pthread_cond_t done; // a worker finished the job
+    uint64_t generation; // number of jobs started
+    int num_busy; // workers still on the current job
+    int quit;
+    cpu_task task;
+    void *task_arg;
+
+    float *packed_A[CPU_MAX_THREADS]; // MC*KC panel of each thread
+    float *packed_B; // KC*NC block shared by all threads
+
+    uint64_t num_calls; // GEMMs
+    double flops;
+    struct timespec busy_time;
+    uint64_t num_gemv;
+};
+
+struct cpu_backend *cpu_backend_create(int num_threads, int isa);
+
+void cpu_backend_destroy(struct cpu_backend *cb);
+
+int cpu_gemm_isa(void);
+
+struct timespec cpu_gemm(struct cpu_backend *cb, const float *in_matrix1, const float *in_matrix2, float *out_matrix, int num_rowA, int num_colA, int num_colB);
+
+float cpu_dot(const float *in_vector1, const float *in_vector2, int size, int sum_mode);
+
+struct timespec cpu_fast_innerproduct(const float *in_vector1, const float *in_vector2, float *out, int size, int sum_mode);
+
+struct timespec cpu_gemv(struct cpu_backend *cb, const float *in_matrix, const float *in_vector, float *out_vector, int num_row, int num_col, int sum_mode);
+
+void cpu_backend_print_stats(const struct cpu_backend *cb);
+
+#endif
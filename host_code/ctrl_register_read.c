@@ -43,7 +43,7 @@
  * 
  * if a channel is enabled, then the first three hexa digits of control register are set as "1fc"
  */
-int check_channels(off_t target_addr){
+int check_channels(const char *controlDevice, off_t target_addr){
 
     /* local variables */
     int fd; // file descriptor
@@ -55,10 +55,10 @@ int check_channels(off_t target_addr){
     int num_ch = 0; // number of channels
 
     /* Open xdma control device */
-    if ((fd = open("/dev/xdma0_control", O_RDWR | O_SYNC)) == -1){
+    if ((fd = open(controlDevice, O_RDWR | O_SYNC)) == -1){
         FATAL;
     }
-    printf("xdma control device opened.\n"); 
+    printf("xdma control device %s opened.\n", controlDevice); 
     fflush(stdout);
 
     /* map one page */
@@ -93,10 +93,35 @@ int check_channels(off_t target_addr){
     return num_ch;
 }
 
-int check_h2c_channels(){
-    return check_channels(H2C_REG);
+/* reads one 32-bit xdma control register without printing, e.g. the block identifiers for a device fingerprint */
+uint32_t read_control_register(const char *controlDevice, off_t target_addr){
+
+    int fd;
+    void *map_base;
+    uint32_t read_result;
+
+    if ((fd = open(controlDevice, O_RDWR | O_SYNC)) == -1){
+        FATAL;
+    }
+    map_base = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map_base == (void *) -1){
+        FATAL;
+    }
+
+    read_result = ltohl(*((uint32_t *) (map_base + (target_addr & MAP_MASK))));
+
+    if (munmap(map_base, MAP_SIZE) == -1){
+        FATAL;
+    }
+    close(fd);
+
+    return read_result;
+}
+
+int check_h2c_channels(const char *controlDevice){
+    return check_channels(controlDevice, H2C_REG);
 }
 
-int check_c2h_channels(){
-    return check_channels(C2H_REG);
+int check_c2h_channels(const char *controlDevice){
+    return check_channels(controlDevice, C2H_REG);
 }
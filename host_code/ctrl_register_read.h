@@ -1,7 +1,10 @@
+#include <stdint.h>
 #include <sys/types.h>
 
-int check_channels(off_t target_addr);
+int check_channels(const char *controlDevice, off_t target_addr);
 
-int check_h2c_channels();
+uint32_t read_control_register(const char *controlDevice, off_t target_addr);
 
-int check_c2h_channels();
+int check_h2c_channels(const char *controlDevice);
+
+int check_c2h_channels(const char *controlDevice);
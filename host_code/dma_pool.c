@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "dma_pool.h"
+
+#define POOL_MIN_SHIFT 12 // 4KB
+#define POOL_NUM_CLASSES 15 // 4KB ~ 64MB
+#define POOL_HUGE_SHIFT 21 // 2MB
+#define POOL_MAX_CACHED 8 // free buffers kept per class
+
+struct dma_block {
+    void *addr;
+    void *map_base;
+    size_t map_size;
+    int cls;
+    struct dma_block *next;
+};
+
+struct dma_class_stats {
+    unsigned long hits;
+    unsigned long misses;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dma_block *free_blocks[POOL_NUM_CLASSES];
+static int num_free_blocks[POOL_NUM_CLASSES];
+static struct dma_block *used_blocks;
+static struct dma_class_stats class_stats[POOL_NUM_CLASSES];
+static unsigned long num_hugetlb, num_thp, num_locked, num_oversized;
+
+static int size_class(size_t size){
+
+    int cls = 0;
+    while (((size_t) 1 << (POOL_MIN_SHIFT + cls)) < size){
+        ++cls;
+    }
+    return cls;
+}
+
+/* maps a new buffer of class cls, pre-faulted and locked in memory */
+static struct dma_block *map_block(int cls){
+
+    size_t size = (size_t) 1 << (POOL_MIN_SHIFT + cls);
+    struct dma_block *block;
+    block = (struct dma_block *) malloc(sizeof(struct dma_block));
+    assert(block);
+    block->cls = cls;
+
+    void *addr = MAP_FAILED;
+    if (POOL_MIN_SHIFT + cls >= POOL_HUGE_SHIFT){
+        /* explicit hugepages, only available if the administrator reserved them */
+        addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (addr != MAP_FAILED){
+            ++num_hugetlb;
+            block->addr = addr;
+            block->map_base = addr;
+            block->map_size = size;
+        }
+        else{
+            /* transparent hugepages: over-map to get a 2MB aligned range */
+            size_t huge = (size_t) 1 << POOL_HUGE_SHIFT;
+            char *base = (char *) mmap(0, size + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            assert(base != MAP_FAILED);
+            char *aligned = (char *) (((uintptr_t) base + huge - 1) & ~(uintptr_t) (huge - 1));
+            madvise(aligned, size, MADV_HUGEPAGE);
+            ++num_thp;
+            block->addr = aligned;
+            block->map_base = base;
+            block->map_size = size + huge;
+        }
+    }
+    else{
+        addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        assert(addr != MAP_FAILED);
+        block->addr = addr;
+        block->map_base = addr;
+        block->map_size = size;
+    }
+
+    /* pre-fault (MAP_POPULATE does not cover the THP path) and pin */
+    memset(block->addr, 0, size);
+    if (mlock(block->addr, size) == 0){
+        ++num_locked;
+    }
+
+    return block;
+}
+
+static void unmap_block(struct dma_block *block){
+    munmap(block->map_base, block->map_size);
+    free(block);
+}
+
+/* returns a page-aligned buffer of at least size bytes, recycled from the pool when possible */
+void *dma_pool_alloc(size_t size){
+
+    int cls = size_class(size);
+    struct dma_block *block;
+
+    pthread_mutex_lock(&pool_lock);
+
+    if (cls >= POOL_NUM_CLASSES){
+        /* larger than the largest class: map it on its own, never cached */
+        ++num_oversized;
+        pthread_mutex_unlock(&pool_lock);
+        block = (struct dma_block *) malloc(sizeof(struct dma_block));
+        assert(block);
+        size_t map_size = (size + 4095) & ~(size_t) 4095;
+        block->addr = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        assert(block->addr != MAP_FAILED);
+        block->map_base = block->addr;
+        block->map_size = map_size;
+        block->cls = -1;
+        pthread_mutex_lock(&pool_lock);
+    }
+    else if (free_blocks[cls] != NULL){
+        block = free_blocks[cls];
+        free_blocks[cls] = block->next;
+        --num_free_blocks[cls];
+        ++class_stats[cls].hits;
+    }
+    else{
+        ++class_stats[cls].misses;
+        block = map_block(cls);
+    }
+
+    block->next = used_blocks;
+    used_blocks = block;
+
+    pthread_mutex_unlock(&pool_lock);
+
+    return block->addr;
+}
+
+/* returns buffer to the pool
+ * returns 0 if buffer was not allocated by dma_pool_alloc (nothing is done in that case)
+ */
+int dma_pool_free(void *buffer){
+
+    if (buffer == NULL){
+        return 1;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+
+    struct dma_block **link = &used_blocks;
+    while (*link != NULL && (*link)->addr != buffer){
+        link = &(*link)->next;
+    }
+    struct dma_block *block = *link;
+    if (block == NULL){
+        pthread_mutex_unlock(&pool_lock);
+        return 0;
+    }
+    *link = block->next;
+
+    if (block->cls >= 0 && num_free_blocks[block->cls] < POOL_MAX_CACHED){
+        block->next = free_blocks[block->cls];
+        free_blocks[block->cls] = block;
+        ++num_free_blocks[block->cls];
+        block = NULL;
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+
+    if (block != NULL){
+        unmap_block(block);
+    }
+
+    return 1;
+}
+
+/* unmaps every cached buffer (buffers still in use are kept) */
+void dma_pool_release(){
+
+    pthread_mutex_lock(&pool_lock);
+    for (int cls = 0; cls < POOL_NUM_CLASSES; cls++){
+        while (free_blocks[cls] != NULL){
+            struct dma_block *block = free_blocks[cls];
+            free_blocks[cls] = block->next;
+            unmap_block(block);
+        }
+        num_free_blocks[cls] = 0;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void dma_pool_print_stats(){
+
+    unsigned long hits = 0, misses = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    printf("DMA buffer pool:\n");
+    for (int cls = 0; cls < POOL_NUM_CLASSES; cls++){
+        unsigned long total = class_stats[cls].hits + class_stats[cls].misses;
+        if (total == 0){
+            continue;
+        }
+        printf("  %8zu KB class: %8lu hits, %4lu misses, hit rate %6.2f%%\n", ((size_t) 1 << (POOL_MIN_SHIFT + cls)) >> 10,
+               class_stats[cls].hits, class_stats[cls].misses, 100.0 * class_stats[cls].hits / total);
+        hits += class_stats[cls].hits;
+        misses += class_stats[cls].misses;
+    }
+    if (hits + misses > 0){
+        printf("  total hit rate %6.2f%% (%lu hugetlb, %lu THP, %lu locked, %lu oversized mappings)\n",
+               100.0 * hits / (hits + misses), num_hugetlb, num_thp, num_locked, num_oversized);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
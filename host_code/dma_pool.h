@@ -0,0 +1,20 @@
+#ifndef DMA_POOL_H
+#define DMA_POOL_H
+
+#include <stddef.h>
+
+/* size-class pool of page-aligned DMA buffers
+ * classes are powers of two from 4KB, buffers of 2MB and more are backed by hugepages (MAP_HUGETLB,
+ * or transparent hugepages as fallback), so that the driver can merge more pages per descriptor
+ * buffers are pre-faulted and mlock'ed when they are first mapped, and recycled afterwards
+ */
+
+void *dma_pool_alloc(size_t size);
+
+int dma_pool_free(void *buffer);
+
+void dma_pool_release();
+
+void dma_pool_print_stats();
+
+#endif
@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <immintrin.h>
+
+#include "formats.h"
+
+#define FORMAT_SIMD_NONE 0
+#define FORMAT_SIMD_F16C 1 // AVX2 + F16C
+#define FORMAT_SIMD_AVX512 2 // AVX-512F (with F16C)
+
+/* widest conversion kernels this CPU supports (CPUID), looked up once */
+static int format_simd(void){
+
+    static int simd = -1;
+    if (simd < 0){
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("f16c")){
+            simd = FORMAT_SIMD_AVX512;
+        }
+        else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")){
+            simd = FORMAT_SIMD_F16C;
+        }
+        else{
+            simd = FORMAT_SIMD_NONE;
+        }
+    }
+    return simd;
+}
+
+const char *format_name(int format){
+
+    static const char *names[FORMAT_NUM] = {"fp32", "fp16", "bf16", "int8"};
+    assert(format >= 0 && format < FORMAT_NUM);
+    return names[format];
+}
+
+/* bytes of num numbers packed as one block of format */
+size_t format_bytes(int format, int num){
+
+    switch (format){
+        case FORMAT_FP16:
+        case FORMAT_BF16:
+            return sizeof(uint16_t) * num;
+        case FORMAT_INT8:
+            return sizeof(float) + num;
+        default:
+            return sizeof(float) * num;
+    }
+}
+
+/* format of the outputs of an op on operands of format: int8 products are returned as fp16 */
+int format_output(int format){
+    return (format == FORMAT_INT8) ? FORMAT_FP16 : format;
+}
+
+/* scalar conversions, also the tails of the SIMD kernels */
+
+static uint16_t fp16_from_float(float f){
+
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exp = (int32_t) ((x >> 23) & 0xFF) - 127 + 15;
+    uint32_t mant = x & 0x7FFFFF;
+
+    if (((x >> 23) & 0xFF) == 0xFF){ // inf, nan
+        return sign | 0x7C00 | (mant ? 0x200 : 0);
+    }
+    if (exp >= 31){
+        return sign | 0x7C00;
+    }
+    if (exp <= 0){ // subnormal or zero
+        if (exp < -10){
+            return sign;
+        }
+        mant |= 0x800000;
+        uint32_t shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rest = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if (rest > mid || (rest == mid && (half & 1))){
+            half++;
+        }
+        return sign | half;
+    }
+    uint32_t half = sign | (exp << 10) | (mant >> 13);
+    uint32_t rest = mant & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))){
+        half++; // may carry into the exponent, which rounds up to the next binade or to inf
+    }
+    return half;
+}
+
+static float fp16_to_float(uint16_t h){
+
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1F;
+    uint32_t mant = h & 0x3FF;
+    uint32_t x;
+
+    if (exp == 0x1F){
+        x = sign | 0x7F800000 | (mant << 13);
+    }
+    else if (exp != 0){
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    else if (mant == 0){
+        x = sign;
+    }
+    else{ // subnormal: normalize
+        int e = -1;
+        do {
+            mant <<= 1;
+            e++;
+        } while ((mant & 0x400) == 0);
+        x = sign | ((127 - 15 - e) << 23) | ((mant & 0x3FF) << 13);
+    }
+
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+/* round to nearest even on the upper 16 bits, NaN stays NaN */
+static uint16_t bf16_from_float(float f){
+
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7FFFFFFF) > 0x7F800000){
+        return (x >> 16) | 0x40;
+    }
+    x += 0x7FFF + ((x >> 16) & 1);
+    return x >> 16;
+}
+
+static float bf16_to_float(uint16_t b){
+
+    uint32_t x = (uint32_t) b << 16;
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static int8_t int8_from_float(float f, float inv_scale){
+
+    float q = nearbyintf(f * inv_scale);
+    return (int8_t) ((q > 127.0f) ? 127.0f : (q < -127.0f) ? -127.0f : q);
+}
+
+/* SIMD kernels, each returns the number of numbers it converted, the caller converts the rest */
+
+__attribute__((target("avx2,f16c")))
+static int pack_fp16_f16c(const float *src, int num, uint16_t *dst){
+
+    int i;
+    for (i = 0; i + 8 <= num; i += 8){
+        _mm_storeu_si128((__m128i *) (dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    return i;
+}
+
+__attribute__((target("avx2,f16c")))
+static int unpack_fp16_f16c(const uint16_t *src, int num, float *dst){
+
+    int i;
+    for (i = 0; i + 8 <= num; i += 8){
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (src + i))));
+    }
+    return i;
+}
+
+__attribute__((target("avx512f")))
+static int pack_fp16_avx512(const float *src, int num, uint16_t *dst){
+
+    int i;
+    for (i = 0; i + 16 <= num; i += 16){
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    return i;
+}
+
+__attribute__((target("avx512f")))
+static int unpack_fp16_avx512(const uint16_t *src, int num, float *dst){
+
+    int i;
+    for (i = 0; i + 16 <= num; i += 16){
+        _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *) (src + i))));
+    }
+    return i;
+}
+
+/* bf16 rounding in integer lanes (no AVX512-BF16 needed) */
+__attribute__((target("avx512f")))
+static int pack_bf16_avx512(const float *src, int num, uint16_t *dst){
+
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i bias = _mm512_set1_epi32(0x7FFF);
+    const __m512i quiet = _mm512_set1_epi32(0x40);
+    int i;
+    for (i = 0; i + 16 <= num; i += 16){
+        __m512 v = _mm512_loadu_ps(src + i);
+        __m512i x = _mm512_castps_si512(v);
+        __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(x, 16), one);
+        __m512i rounded = _mm512_srli_epi32(_mm512_add_epi32(x, _mm512_add_epi32(bias, lsb)), 16);
+        __mmask16 nan = _mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q);
+        rounded = _mm512_mask_or_epi32(rounded, nan, _mm512_srli_epi32(x, 16), quiet);
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm512_cvtepi32_epi16(rounded));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int unpack_bf16_avx2(const uint16_t *src, int num, float *dst){
+
+    int i;
+    for (i = 0; i + 8 <= num; i += 8){
+        __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(x, 16)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static float maxabs_avx2(const float *src, int num){
+
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 m = _mm256_setzero_ps();
+    float lanes[8];
+    int i;
+    for (i = 0; i + 8 <= num; i += 8){
+        m = _mm256_max_ps(m, _mm256_andnot_ps(sign, _mm256_loadu_ps(src + i)));
+    }
+    _mm256_storeu_ps(lanes, m);
+    float result = 0.0f;
+    for (int l = 0; l < 8; l++){
+        result = (lanes[l] > result) ? lanes[l] : result;
+    }
+    for (; i < num; i++){
+        result = (fabsf(src[i]) > result) ? fabsf(src[i]) : result;
+    }
+    return result;
+}
+
+__attribute__((target("avx512f")))
+static int pack_int8_avx512(const float *src, int num, float inv_scale, int8_t *dst){
+
+    const __m512 inv = _mm512_set1_ps(inv_scale);
+    const __m512i hi = _mm512_set1_epi32(127);
+    const __m512i lo = _mm512_set1_epi32(-127);
+    int i;
+    for (i = 0; i + 16 <= num; i += 16){
+        __m512i q = _mm512_cvt_roundps_epi32(_mm512_mul_ps(_mm512_loadu_ps(src + i), inv), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        q = _mm512_max_epi32(_mm512_min_epi32(q, hi), lo);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm512_cvtepi32_epi8(q));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int unpack_int8_avx2(const int8_t *src, int num, float scale, float *dst){
+
+    const __m256 s = _mm256_set1_ps(scale);
+    int i;
+    for (i = 0; i + 8 <= num; i += 8){
+        __m256i x = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) (src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), s));
+    }
+    return i;
+}
+
+/* packs num numbers of src as one block of format into dst (format_bytes(format, num) bytes) */
+void format_pack(int format, const float *src, int num, void *dst){
+
+    int simd = format_simd();
+    int i = 0;
+
+    if (format == FORMAT_FP16){
+        uint16_t *out = (uint16_t *) dst;
+        if (simd == FORMAT_SIMD_AVX512){
+            i = pack_fp16_avx512(src, num, out);
+        }
+        else if (simd == FORMAT_SIMD_F16C){
+            i = pack_fp16_f16c(src, num, out);
+        }
+        for (; i < num; i++){
+            out[i] = fp16_from_float(src[i]);
+        }
+    }
+    else if (format == FORMAT_BF16){
+        uint16_t *out = (uint16_t *) dst;
+        if (simd == FORMAT_SIMD_AVX512){
+            i = pack_bf16_avx512(src, num, out);
+        }
+        for (; i < num; i++){
+            out[i] = bf16_from_float(src[i]);
+        }
+    }
+    else if (format == FORMAT_INT8){
+        float maxabs = (simd != FORMAT_SIMD_NONE) ? maxabs_avx2(src, num) : 0.0f;
+        if (simd == FORMAT_SIMD_NONE){
+            for (int k = 0; k < num; k++){
+                maxabs = (fabsf(src[k]) > maxabs) ? fabsf(src[k]) : maxabs;
+            }
+        }
+        float scale = (maxabs > 0.0f) ? maxabs / 127.0f : 1.0f;
+        float inv_scale = 1.0f / scale;
+        int8_t *out = (int8_t *) ((char *) dst + sizeof(float));
+        memcpy(dst, &scale, sizeof(float));
+        if (simd == FORMAT_SIMD_AVX512){
+            i = pack_int8_avx512(src, num, inv_scale, out);
+        }
+        for (; i < num; i++){
+            out[i] = int8_from_float(src[i], inv_scale);
+        }
+    }
+    else{
+        memcpy(dst, src, sizeof(float) * num);
+    }
+}
+
+/* widens one block of num numbers of format in src to fp32 */
+void format_unpack(int format, const void *src, int num, float *dst){
+
+    int simd = format_simd();
+    int i = 0;
+
+    if (format == FORMAT_FP16){
+        const uint16_t *in = (const uint16_t *) src;
+        if (simd == FORMAT_SIMD_AVX512){
+            i = unpack_fp16_avx512(in, num, dst);
+        }
+        else if (simd == FORMAT_SIMD_F16C){
+            i = unpack_fp16_f16c(in, num, dst);
+        }
+        for (; i < num; i++){
+            dst[i] = fp16_to_float(in[i]);
+        }
+    }
+    else if (format == FORMAT_BF16){
+        const uint16_t *in = (const uint16_t *) src;
+        if (simd != FORMAT_SIMD_NONE){
+            i = unpack_bf16_avx2(in, num, dst);
+        }
+        for (; i < num; i++){
+            dst[i] = bf16_to_float(in[i]);
+        }
+    }
+    else if (format == FORMAT_INT8){
+        float scale;
+        memcpy(&scale, src, sizeof(float));
+        const int8_t *in = (const int8_t *) ((const char *) src + sizeof(float));
+        if (simd != FORMAT_SIMD_NONE){
+            i = unpack_int8_avx2(in, num, scale, dst);
+        }
+        for (; i < num; i++){
+            dst[i] = in[i] * scale;
+        }
+    }
+    else{
+        memcpy(dst, src, sizeof(float) * num);
+    }
+}
+
+void format_stats_print(int format, const struct format_stats *st){
+
+    if (st->num_ops == 0){
+        return;
+    }
+
+    double pack = st->pack_time.tv_sec + st->pack_time.tv_nsec / 1e9;
+    double unpack = st->unpack_time.tv_sec + st->unpack_time.tv_nsec / 1e9;
+
+    printf("%s: %llu ops, %llu bytes moved for %llu fp32 bytes (%.2fx less traffic), pack %.9f s, unpack %.9f s\n",
+           format_name(format), (unsigned long long) st->num_ops, (unsigned long long) st->moved_bytes,
+           (unsigned long long) st->fp32_bytes, (st->moved_bytes > 0) ? (double) st->fp32_bytes / st->moved_bytes : 0.0, pack, unpack);
+}
+
+/* software model of the device op on packed operands (tile*tile matrix block, tile vector block):
+ * operands are widened to fp32, products are accumulated in fp32 as in the fp32 HW logic,
+ * and the tile outputs are rounded to format_output(format)
+ */
+void format_model_matvec(int format, const void *matrix, const void *vector, void *out, int tile){
+
+    float *m = (float *) malloc(sizeof(float) * tile * (tile + 2));
+    assert(m);
+    float *v = m + tile * tile;
+    float *o = v + tile;
+
+    format_unpack(format, matrix, tile * tile, m);
+    format_unpack(format, vector, tile, v);
+    for (int i = 0; i < tile; i++){
+        float sum = 0.0f;
+        for (int j = 0; j < tile; j++){
+            sum += m[tile * i + j] * v[j];
+        }
+        o[i] = sum;
+    }
+    format_pack(format_output(format), o, tile, out);
+
+    free(m);
+}
@@ -0,0 +1,38 @@
+#ifndef FORMATS_H
+#define FORMATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* transfer formats of operands and outputs */
+#define FORMAT_FP32 0
+#define FORMAT_FP16 1
+#define FORMAT_BF16 2
+#define FORMAT_INT8 3 // one fp32 scale per packed block, then round(x/scale) in [-127, 127]
+#define FORMAT_NUM 4
+
+/* traffic and host conversion cost of the calls made with one format */
+struct format_stats {
+    uint64_t num_ops;
+    uint64_t fp32_bytes; // bytes the same ops move as fp32
+    uint64_t moved_bytes; // bytes moved packed
+    struct timespec pack_time;
+    struct timespec unpack_time;
+};
+
+const char *format_name(int format);
+
+size_t format_bytes(int format, int num);
+
+int format_output(int format);
+
+void format_pack(int format, const float *src, int num, void *dst);
+
+void format_unpack(int format, const void *src, int num, float *dst);
+
+void format_stats_print(int format, const struct format_stats *st);
+
+void format_model_matvec(int format, const void *matrix, const void *vector, void *out, int tile);
+
+#endif
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "fpga_device.h"
+#include "ctrl_register_read.h"
+
+/* opens every card /dev/xdmaN (N < max_devices) whose control device exists
+ * returns the number of devices stored in devices
+ */
+int fpga_device_discover(struct fpga_device **devices, int max_devices){
+
+    int num_devices = 0;
+    char path[64];
+
+    for (int i = 0; i < max_devices; i++){
+        snprintf(path, sizeof(path), "/dev/xdma%d_control", i);
+        if (access(path, F_OK) != 0){
+            continue;
+        }
+        devices[num_devices++] = fpga_device_open(i);
+    }
+
+    return num_devices;
+}
+
+/* opens card /dev/xdma<index>: finds the enabled channels and opens all of them once */
+struct fpga_device *fpga_device_open(int index){
+
+    struct fpga_device *dev;
+    dev = (struct fpga_device *) calloc(1, sizeof(struct fpga_device));
+    assert(dev);
+
+    char path[64];
+    dev->index = index;
+    snprintf(dev->prefix, sizeof(dev->prefix), "/dev/xdma%d", index);
+
+    /* Check the number of enabled channels by reading xmda control register values */
+    snprintf(path, sizeof(path), "%s_control", dev->prefix);
+    dev->num_h2c = check_h2c_channels(path);
+    dev->num_c2h = check_c2h_channels(path);
+    printf("%s: %d H2C channels, %d C2H channels\n", dev->prefix, dev->num_h2c, dev->num_c2h);
+    if (dev->num_h2c == 0 || dev->num_c2h == 0){
+        printf("ERROR: No PCIe DMA H2C or C2H channels were identified on %s\n", dev->prefix);
+        exit(1);
+    }
+
+    for (int i = 0; i < dev->num_h2c; i++){
+        snprintf(path, sizeof(path), "%s_h2c_%d", dev->prefix, i);
+        dev->h2c[i] = channel_open(path);
+    }
+    for (int i = 0; i < dev->num_c2h; i++){
+        snprintf(path, sizeof(path), "%s_c2h_%d", dev->prefix, i);
+        dev->c2h[i] = channel_open(path);
+    }
+
+    dev->bram_addr = FPGA_BRAM_ADDR;
+    dev->bram_size = FPGA_BRAM_SIZE;
+    dev->ip_addr = FPGA_IP_ADDR;
+
+    dev->wc = wc_create(dev->h2c[0], dev->bram_size, dev->ip_addr);
+    dev->stripe = stripe_create(dev->h2c, dev->num_h2c, dev->c2h, dev->num_c2h);
+
+    snprintf(path, sizeof(path), "%s_user", dev->prefix);
+    dev->waiter = completion_create(dev->c2h[0], dev->ip_addr, path, FPGA_IP_BAR_OFFSET, FPGA_OP_TIMEOUT_NS);
+    dev->policy = NULL;
+
+    dev->resident = residency_create(FPGA_NUM_MATRIX_SLOTS, dev->bram_addr + FPGA_MATRIX_SLOT_OFFSET, FPGA_MATRIX_SLOT_SIZE);
+
+    dev->packed_formats = 0;
+
+    return dev;
+}
+
+void fpga_device_close(struct fpga_device *dev){
+
+    if (dev == NULL){
+        return;
+    }
+    wc_destroy(dev->wc);
+    stripe_destroy(dev->stripe);
+    wait_policy_destroy(dev->policy);
+    residency_destroy(dev->resident);
+    completion_destroy(dev->waiter);
+    for (int i = 0; i < dev->num_h2c; i++){
+        channel_close(dev->h2c[i]);
+    }
+    for (int i = 0; i < dev->num_c2h; i++){
+        channel_close(dev->c2h[i]);
+    }
+    free(dev);
+}
+
+/* selects how op completion is detected
+ * wait_mode: "dma" (default), "mmio", "irq" or "irq-thread"; wait_policy: "latency", "cpu" or NULL (always spin)
+ */
+void fpga_device_set_wait(struct fpga_device *dev, const char *wait_mode, const char *wait_policy){
+
+    char path[64];
+
+    if (wait_mode != NULL && strncmp(wait_mode, "irq", 3) == 0){
+        snprintf(path, sizeof(path), "%s_events_0", dev->prefix);
+        struct irq_source *irq = irq_source_open(path);
+        if (irq == NULL){
+            printf("ERROR: %s could not be opened\n", path);
+            exit(1);
+        }
+        completion_enable_irq(dev->waiter, irq, strcmp(wait_mode, "irq-thread") == 0);
+    }
+    else if (wait_mode != NULL && strcmp(wait_mode, "mmio") == 0){
+        completion_set_mode(dev->waiter, WAIT_MODE_MMIO);
+    }
+
+    if (wait_policy != NULL && strcmp(wait_policy, "latency") == 0){
+        dev->policy = wait_policy_create(dev->waiter, WAIT_POLICY_LATENCY, FPGA_OP_TIMEOUT_NS);
+    }
+    else if (wait_policy != NULL && strcmp(wait_policy, "cpu") == 0){
+        dev->policy = wait_policy_create(dev->waiter, WAIT_POLICY_CPU, FPGA_OP_TIMEOUT_NS);
+    }
+}
+
+/* BRAM writes through the device: each one drops the residency of the matrix tiles it overwrites,
+ * so that no op computes on a stale tile; only the upload of a tile claimed by residency_acquire bypasses them
+ */
+struct timespec fpga_device_write(struct fpga_device *dev, uint32_t addr, uint32_t transferSize, const void *data){
+
+    residency_invalidate_range(dev->resident, addr, transferSize);
+    return channel_write(dev->h2c[0], addr, transferSize, data);
+}
+
+struct timespec fpga_device_writev(struct fpga_device *dev, uint32_t addr, const struct iovec *iov, int iovcnt){
+
+    uint32_t transferSize = 0;
+    for (int i = 0; i < iovcnt; i++){
+        transferSize += iov[i].iov_len;
+    }
+    residency_invalidate_range(dev->resident, addr, transferSize);
+    return channel_writev(dev->h2c[0], addr, iov, iovcnt);
+}
+
+/* combined with the other pending writes, sent at the latest by the next kick */
+void fpga_device_stage(struct fpga_device *dev, uint32_t addr, uint32_t transferSize, const void *data){
+
+    residency_invalidate_range(dev->resident, addr, transferSize);
+    wc_write(dev->wc, addr, transferSize, data);
+}
+
+struct timespec fpga_device_stripe_write(struct fpga_device *dev, uint32_t addr, uint32_t transferSize, const void *data){
+
+    residency_invalidate_range(dev->resident, addr, transferSize);
+    return stripe_write(dev->stripe, addr, transferSize, data);
+}
+
+/* sends the op code to the compute unit, returns the time of the kick */
+struct timespec fpga_device_kick(struct fpga_device *dev, uint32_t *op_code){
+
+    struct timespec ts_kick;
+
+    completion_arm(dev->waiter);
+    wc_write(dev->wc, dev->ip_addr, 0x0004, op_code);
+    clock_gettime(CLOCK_MONOTONIC, &ts_kick);
+
+    return ts_kick;
+}
+
+/* waits until HW changes the op code from busy_code, aborts if HW hangs */
+void fpga_device_wait(struct fpga_device *dev, int op_type, uint32_t size, uint32_t busy_code, const struct timespec *ts_kick){
+
+    int rc;
+    if (dev->policy != NULL){
+        rc = wait_policy_wait(dev->policy, op_type, size, busy_code, ts_kick);
+    }
+    else{
+        rc = completion_wait(dev->waiter, busy_code);
+    }
+
+    if (rc != 0){
+        printf("ERROR: HW of %s did not finish the operation within %llu ns\n", dev->prefix, FPGA_OP_TIMEOUT_NS);
+        exit(1);
+    }
+}
+
+static void stage_stats_print(const char *name, const struct stage_stats *st){
+
+    if (st->num_ops == 0){
+        return;
+    }
+
+    double h2c = st->h2c.tv_sec + st->h2c.tv_nsec / 1e9;
+    double compute = st->compute.tv_sec + st->compute.tv_nsec / 1e9;
+    double c2h = st->c2h.tv_sec + st->c2h.tv_nsec / 1e9;
+    double wall = st->wall.tv_sec + st->wall.tv_nsec / 1e9;
+
+    printf("%s: %llu ops (%.0f ops/s), H2C %.9f s, compute %.9f s, C2H %.9f s, wall %.9f s\n",
+           name, (unsigned long long) st->num_ops, (wall > 0) ? st->num_ops / wall : 0.0, h2c, compute, c2h, wall);
+}
+
+void fpga_device_print_stats(const struct fpga_device *dev){
+
+    printf("Statistics of %s:\n", dev->prefix);
+    for (int i = 0; i < dev->num_h2c; i++){
+        channel_print_stats(dev->h2c[i]);
+    }
+    for (int i = 0; i < dev->num_c2h; i++){
+        channel_print_stats(dev->c2h[i]);
+    }
+    wc_print_stats(dev->wc);
+    stripe_print_stats(dev->stripe);
+    completion_print_stats(dev->waiter);
+    residency_print_stats(dev->resident);
+    stage_stats_print("matmul rows", &dev->matmul_stats);
+    stage_stats_print("matvec batch", &dev->batch_stats);
+    if (dev->policy != NULL){
+        wait_policy_print_stats(dev->policy);
+    }
+}
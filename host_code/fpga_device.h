@@ -0,0 +1,92 @@
+#ifndef FPGA_DEVICE_H
+#define FPGA_DEVICE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "channel_readwrite.h"
+#include "write_combine.h"
+#include "stripe.h"
+#include "completion.h"
+#include "wait_policy.h"
+#include "residency.h"
+
+#define MAX_DEVICES 8 // cards searched by fpga_device_discover: /dev/xdma0 ~ /dev/xdma7
+
+/* address map of the HW logic, same on every card */
+#define FPGA_BRAM_ADDR 0x40000000
+#define FPGA_BRAM_SIZE 0x8000 // 32KB BRAM window
+#define FPGA_IP_ADDR 0x43C00000
+#define FPGA_IP_BAR_OFFSET 0x0000 // assumed offset of the op code register in the user BAR, checked against FPGA_IP_ADDR before MMIO polling
+#define FPGA_TILE 64 // vector length and matrix edge of one op (SIZE of fpga_offload.c)
+#define FPGA_OP_TIMEOUT_NS 1000000000ULL // an op not finished after 1 second is treated as a HW hang
+#define FPGA_MATRIX_SLOT_OFFSET 0x0100 // matrix operand follows the 64-float vector operand
+#define FPGA_MATRIX_SLOT_SIZE 0x4000 // one 64*64 float tile
+#define FPGA_NUM_MATRIX_SLOTS 1 // the HW logic computes on a single matrix operand slot
+#define FPGA_CMD_QUEUE_OFFSET 0x4200 // command records of a queue build, after the matrix slot
+#define FPGA_CMD_QUEUE_SIZE 0x0400
+#define FPGA_CMD_DATA_OFFSET 0x4600 // operands and outputs of queued ops, up to the end of BRAM
+#define FPGA_OP_MATVEC 0x5555 // op code of one matrix-vector op
+#define FPGA_OP_QUEUE 0x5A5A // doorbell op code of a queue build: run all queued records
+#define FPGA_OP_MATVEC_PACKED 0x5600 // op code of a format build plus the transfer format (formats.h) of its operands
+
+/* per-stage timing of row ops against the matrix operand in BRAM */
+struct stage_stats {
+    uint64_t num_ops;
+    struct timespec h2c;
+    struct timespec compute;
+    struct timespec c2h;
+    struct timespec wall;
+};
+
+/* device context of one card, discovered at startup
+ * holds the open channel handles (with their engine alignment), the channel counts,
+ * the BRAM window and the compute-unit address, so that no path string is opened on the hot path
+ */
+struct fpga_device {
+    int index; // N of /dev/xdmaN
+    char prefix[32]; // "/dev/xdmaN"
+
+    int num_h2c;
+    int num_c2h;
+    struct channel_handle *h2c[MAX_CHANNELS];
+    struct channel_handle *c2h[MAX_CHANNELS];
+
+    uint32_t bram_addr;
+    uint32_t bram_size;
+    uint32_t ip_addr;
+
+    struct write_combiner *wc; // on h2c[0], flushed by the op code write
+    struct stripe_engine *stripe; // over all enabled channels
+    struct completion_waiter *waiter;
+    struct wait_policy *policy; // NULL to always use waiter directly
+    struct residency_manager *resident; // matrix tiles currently held in BRAM
+    int packed_formats; // the bitstream is a format build taking FPGA_OP_MATVEC_PACKED (opt-in: FPGA_FORMATS=1)
+
+    struct stage_stats matmul_stats; // rows of fpga_matmul and the tiled matmuls
+    struct stage_stats batch_stats; // vectors of fpga_matvec_batched
+};
+
+int fpga_device_discover(struct fpga_device **devices, int max_devices);
+
+struct fpga_device *fpga_device_open(int index);
+
+void fpga_device_close(struct fpga_device *dev);
+
+void fpga_device_set_wait(struct fpga_device *dev, const char *wait_mode, const char *wait_policy);
+
+struct timespec fpga_device_write(struct fpga_device *dev, uint32_t addr, uint32_t transferSize, const void *data);
+
+struct timespec fpga_device_writev(struct fpga_device *dev, uint32_t addr, const struct iovec *iov, int iovcnt);
+
+void fpga_device_stage(struct fpga_device *dev, uint32_t addr, uint32_t transferSize, const void *data);
+
+struct timespec fpga_device_stripe_write(struct fpga_device *dev, uint32_t addr, uint32_t transferSize, const void *data);
+
+struct timespec fpga_device_kick(struct fpga_device *dev, uint32_t *op_code);
+
+void fpga_device_wait(struct fpga_device *dev, int op_type, uint32_t size, uint32_t busy_code, const struct timespec *ts_kick);
+
+void fpga_device_print_stats(const struct fpga_device *dev);
+
+#endif
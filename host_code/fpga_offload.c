@@ -4,31 +4,56 @@
 #include <sys/time.h>
 #include <time.h>
 #include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "device_check.h"
-#include "ctrl_register_read.h"
-#include "channel_readwrite.h"
+#include "fpga_device.h"
+#include "aio_queue.h"
+#include "dma_pool.h"
+#include "matrix.h"
+#include "plan.h"
+#include "hetero.h"
+#include "cost_model.h"
+#include "cmd_queue.h"
+#include "cpu_backend.h"
+#include "formats.h"
+#include "tile_mask.h"
+#include "sparse.h"
 #include "utils.h"
 
-#define BRAM_ADDR 0x40000000
-#define IP_ADDR 0x43C00000
 #define SIZE 64 // if SIZE is changed, HW logic should be changed as well (L_RAM_SIZE, num_operation, etc.)
 #define NUM_TRIALS 10000 // number of times trials to measure the average performance in profile_transferSize()
 #define NUM_REPEAT 100 // number of times each test will be repeated
+#define AIO_DEPTH 8 // number of transfers in flight in profile_async_transfer()
+#define NUM_BATCH 1024 // number of vectors per fpga_matvec_batched call in the batched test
+#define QUEUE_BATCH ((FPGA_BRAM_SIZE - FPGA_CMD_DATA_OFFSET) / (0x0004*SIZE*2)) // rows per doorbell in fpga_matmul_queued: one input and one output each
 #define DIFF_THRESHOLD 0.01 // Threshold of difference between output of FPGA and CPU(ref.)
 
+/* op types for the runtime prediction of the wait policy */
+#define OP_INNERPRODUCT 0
+#define OP_MATVEC 1
+#define OP_MATMUL_ROW 2
+
+/* kinds of work of the CPU+FPGA scheduler */
+#define HETERO_MATVEC 0
+#define HETERO_MATMUL 1
+
 /* tests the correctness of read and write operation on BRAM
  * "test_size" determines the number of floating-point numbers to be sent back-and-forth
  */
-void bram_readwrite_test(uint32_t test_size){
+void bram_readwrite_test(struct fpga_device *dev, uint32_t test_size){
 
     printf("Performing BRAM read/write test...\n");
 
     /* memory allocation */
     float *input;
     float *output;
-    input = (float *) malloc(sizeof(float) * test_size);
-    output = (float *) malloc(sizeof(float) * test_size);
+    input = (float *) channel_alloc_buffer(dev->h2c[0], sizeof(float) * test_size);
+    output = (float *) channel_alloc_buffer(dev->c2h[0], sizeof(float) * test_size);
 
     /* Random Initialization */
     for (int i = 0; i < (int) test_size; i++){
@@ -36,9 +61,9 @@ void bram_readwrite_test(uint32_t test_size){
     }
 
     /* Write Data to BRAM */    
-    write_to_channel("/dev/xdma0_h2c_0", BRAM_ADDR, (0x0004 * test_size), input);
+    fpga_device_write(dev, dev->bram_addr, (0x0004 * test_size), input);
     /* Read Data from BRAM */
-    read_from_channel("/dev/xdma0_c2h_0", BRAM_ADDR, (0x0004 * test_size), output);
+    channel_read(dev->c2h[0], dev->bram_addr, (0x0004 * test_size), output);
 
     /* Verify that input and output are identical */
     int test_success = 1;
@@ -53,22 +78,22 @@ void bram_readwrite_test(uint32_t test_size){
     }
 
     /* cleanup */
-    free(input);
-    free(output);
+    channel_free_buffer(input);
+    channel_free_buffer(output);
 }
 
 /* profiles the execution time of data transfer based on single transfer size
  * averages execution time of NUM_TRIALS trials for each transfer size from 1KB to 32KB
  */
-void profile_transferSize(){
+void profile_transferSize(struct fpga_device *dev){
 
     printf("Profiling data transfer time...\n");
 
     /* Memory Allocation */
     float *input_32KB;
     float *output_32KB;
-    input_32KB = (float *) malloc((size_t) 0x8000);
-    output_32KB = (float *) malloc((size_t) 0x8000);
+    input_32KB = (float *) channel_alloc_buffer(dev->h2c[0], (size_t) 0x8000);
+    output_32KB = (float *) channel_alloc_buffer(dev->c2h[0], (size_t) 0x8000);
 
     struct timespec ts_fpga, ts_fpga_avg;
 
@@ -83,7 +108,7 @@ void profile_transferSize(){
     for (uint32_t j = 0x0400; j < 0x10000; j *=2){ // 1KB to 32KB
         timespec_init(&ts_fpga_avg);
         for (int p=0; p < NUM_TRIALS; p++){
-            ts_fpga = write_to_channel("/dev/xdma0_h2c_0", BRAM_ADDR, j, input_32KB);
+            ts_fpga = fpga_device_write(dev, dev->bram_addr, j, input_32KB);
             timespec_add(&ts_fpga_avg, &ts_fpga);
         }
         timespec_div(&ts_fpga_avg, NUM_TRIALS);
@@ -94,7 +119,7 @@ void profile_transferSize(){
     for (uint32_t k = 0x0400; k < 0x10000; k *=2){
         timespec_init(&ts_fpga_avg);
         for (int p=0; p < NUM_TRIALS; p++){
-            ts_fpga = read_from_channel("/dev/xdma0_c2h_0", BRAM_ADDR, k, output_32KB);
+            ts_fpga = channel_read(dev->c2h[0], dev->bram_addr, k, output_32KB);
             timespec_add(&ts_fpga_avg, &ts_fpga);
         }
         timespec_div(&ts_fpga_avg, NUM_TRIALS);
@@ -102,14 +127,328 @@ void profile_transferSize(){
     }
 
     /* cleanup */
-    free(input_32KB);
-    free(output_32KB);
+    channel_free_buffer(input_32KB);
+    channel_free_buffer(output_32KB);
+}
+
+/* profiles the transfer throughput with up to AIO_DEPTH H2C and AIO_DEPTH C2H transfers in flight
+ * every transfer is 32KB, NUM_TRIALS transfers per direction
+ */
+void profile_async_transfer(struct fpga_device *dev){
+
+    printf("Profiling asynchronous data transfer...\n");
+
+    float *input_32KB;
+    float *output_32KB;
+    input_32KB = (float *) channel_alloc_buffer(dev->h2c[0], (size_t) 0x8000);
+    output_32KB = (float *) channel_alloc_buffer(dev->c2h[0], (size_t) 0x8000);
+
+    for (int i = 0; i < 8192; i++){
+        input_32KB[i] = (rand()%10000 + 1) * 0.001f;
+    }
+
+    /* the writes are submitted on the fd, outside the write path of the device */
+    residency_invalidate_range(dev->resident, dev->bram_addr, 0x8000);
+    struct aio_queue *q = aio_queue_create(2*AIO_DEPTH, AIO_BACKEND_AUTO);
+    struct aio_completion completions[2*AIO_DEPTH];
+    struct timespec ts_start, ts_end;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    int num_write = 0, num_read = 0, num_done = 0;
+    while (num_done < 2*NUM_TRIALS){
+        /* keep both directions busy */
+        while (num_write < NUM_TRIALS && q->inflight < 2*AIO_DEPTH &&
+               aio_submit_write(q, dev->h2c[0]->fd, input_32KB, 0x8000, dev->bram_addr, NULL) == 0){
+            ++num_write;
+        }
+        while (num_read < NUM_TRIALS && q->inflight < 2*AIO_DEPTH &&
+               aio_submit_read(q, dev->c2h[0]->fd, output_32KB, 0x8000, dev->bram_addr, NULL) == 0){
+            ++num_read;
+        }
+
+        int n = aio_harvest(q, completions, 2*AIO_DEPTH, 1);
+        for (int i = 0; i < n; i++){
+            if (completions[i].result != 0x8000){
+                printf("Error: asynchronous transfer returned %lld\n", (long long) completions[i].result);
+                exit(1);
+            }
+        }
+        num_done += n;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    double seconds = ts_end.tv_sec + ts_end.tv_nsec / 1e9;
+    printf("%d x 32KB WRITE + %d x 32KB READ (%s, depth %d): %ld.%09ld seconds, %.1f MB/s\n", NUM_TRIALS, NUM_TRIALS,
+           aio_backend_name(q), AIO_DEPTH, ts_end.tv_sec, ts_end.tv_nsec, 2.0 * NUM_TRIALS * 0x8000 / seconds / 1e6);
+    aio_print_stats(q);
+
+    /* cleanup */
+    aio_queue_destroy(q);
+    channel_free_buffer(input_32KB);
+    channel_free_buffer(output_32KB);
+}
+
+/* profiles the upload of a strided tile of a large matrix with channel_writev: pwritev (one DMA per row segment
+ * in the driver, no host copy) against one gather copy into the staging buffer and a single DMA
+ * for a full tile and an edge tile padded from the zero page; the faster method is kept for h2c[0]
+ */
+void profile_tile_upload(struct fpga_device *dev){
+
+    printf("Profiling strided tile upload...\n");
+
+    struct channel_handle *ch = dev->h2c[0];
+    int ld = 784;
+    float *matrix = (float *) dma_pool_alloc(sizeof(float) * SIZE * ld);
+    for (int i = 0; i < SIZE * ld; i++){
+        matrix[i] = (rand()%10000 + 1) * 0.001f;
+    }
+
+    struct iovec iov[TILE_IOV_MAX(SIZE, SIZE)];
+    const int tile_rows[2] = {SIZE, 48}, tile_cols[2] = {SIZE, 40};
+    struct timespec ts_mode[2], ts;
+
+
+    for (int mode = 0; mode < 2; mode++){ // 0: pwritev, 1: gather
+        ch->gather_writev = mode;
+        timespec_init(&ts_mode[mode]);
+        for (int t = 0; t < 2; t++){
+            int iovcnt = tile_iov_build(iov, 0, matrix, ld, tile_rows[t], tile_cols[t], SIZE, SIZE);
+            struct timespec ts_avg;
+            timespec_init(&ts_avg);
+            for (int i = 0; i < NUM_TRIALS; i++){
+                ts = fpga_device_writev(dev, dev->bram_addr + FPGA_MATRIX_SLOT_OFFSET, iov, iovcnt);
+                timespec_add(&ts_avg, &ts);
+            }
+            timespec_add(&ts_mode[mode], &ts_avg);
+            timespec_div(&ts_avg, NUM_TRIALS);
+            printf("%dx%d tile, %d segments (%s): %ld.%09ld seconds\n", tile_rows[t], tile_cols[t], iovcnt,
+                   mode ? "gather + pwrite" : "pwritev", ts_avg.tv_sec, ts_avg.tv_nsec);
+        }
+    }
+
+    ch->gather_writev = (ts_mode[1].tv_sec < ts_mode[0].tv_sec ||
+                         (ts_mode[1].tv_sec == ts_mode[0].tv_sec && ts_mode[1].tv_nsec < ts_mode[0].tv_nsec));
+    printf("Strided tiles are uploaded with %s\n", ch->gather_writev ? "one gather copy and pwrite" : "pwritev");
+
+    dma_pool_free(matrix);
+}
+
+/* tests the asynchronous submission code on a temporary file, so that it runs without HW
+ * AIO_DEPTH*4 blocks of 4KB are written and read back with up to AIO_DEPTH transfers in flight:
+ * every request must complete exactly once with its own user_data and size, and each block must read back
+ * the pattern written to its offset (a completion handed to the wrong request or slot shows up as a mismatch)
+ */
+void aio_readback_test(int backend){
+
+    int num_blocks = 4*AIO_DEPTH;
+    uint32_t block_size = 0x1000;
+
+    FILE *file = tmpfile();
+    assert(file);
+    int fd = fileno(file);
+
+    uint32_t *input = (uint32_t *) dma_pool_alloc((size_t) block_size * num_blocks);
+    uint32_t *output = (uint32_t *) dma_pool_alloc((size_t) block_size * num_blocks);
+    int *done = (int *) calloc(num_blocks, sizeof(int));
+    assert(input && output && done);
+
+    for (int b = 0; b < num_blocks; b++){
+        for (uint32_t w = 0; w < block_size / 4; w++){
+            input[(block_size / 4) * b + w] = ((uint32_t) b << 16) | w;
+        }
+    }
+    memset(output, 0xff, (size_t) block_size * num_blocks);
+
+    struct aio_queue *q = aio_queue_create(AIO_DEPTH, backend);
+    struct aio_completion completions[AIO_DEPTH];
+    int test_success = 1;
+
+    /* pass 0 writes the blocks, pass 1 reads them back, blocks submitted in reverse order to mix the offsets */
+    for (int pass = 0; pass < 2; pass++){
+        int num_submitted = 0, num_done = 0;
+        memset(done, 0, num_blocks * sizeof(int));
+
+        while (num_done < num_blocks){
+            while (num_submitted < num_blocks && q->inflight < AIO_DEPTH){
+                int b = num_blocks - 1 - num_submitted;
+                int rc = (pass == 0) ? aio_submit_write(q, fd, (char *) input + (size_t) block_size * b, block_size, (int64_t) block_size * b, &done[b])
+                                     : aio_submit_read(q, fd, (char *) output + (size_t) block_size * b, block_size, (int64_t) block_size * b, &done[b]);
+                if (rc != 0){
+                    break;
+                }
+                ++num_submitted;
+            }
+
+            int n = aio_harvest(q, completions, AIO_DEPTH, 1);
+            if (n <= 0){
+                printf("Error: %s harvested %d completions with %u transfers in flight\n", aio_backend_name(q), n, q->inflight);
+                exit(1);
+            }
+            for (int i = 0; i < n; i++){
+                int *flag = (int *) completions[i].user_data;
+                if (flag < done || flag >= done + num_blocks || *flag != 0 || completions[i].result != block_size){
+                    printf("Error: unexpected %s completion (user_data %p, result %lld)\n", pass ? "read" : "write",
+                           completions[i].user_data, (long long) completions[i].result);
+                    test_success = 0;
+                    continue;
+                }
+                *flag = 1;
+            }
+            num_done += n;
+        }
+    }
+
+    if (q->inflight != 0 || q->num_completed != q->num_submitted || q->num_completed != (uint64_t) 2*num_blocks){
+        printf("Error: %s completed %llu of %llu transfers (%u still in flight)\n", aio_backend_name(q),
+               (unsigned long long) q->num_completed, (unsigned long long) q->num_submitted, q->inflight);
+        test_success = 0;
+    }
+    for (int b = 0; b < num_blocks && test_success; b++){
+        if (memcmp((char *) input + (size_t) block_size * b, (char *) output + (size_t) block_size * b, block_size) != 0){
+            printf("Error: block %d read back by %s does not match the written block\n", b, aio_backend_name(q));
+            test_success = 0;
+        }
+    }
+    if (test_success){
+        printf("%d x 4KB blocks written and read back through %s (depth %d)! Asynchronous Read/Write Test Passed!\n",
+               num_blocks, aio_backend_name(q), AIO_DEPTH);
+    }
+    else{
+        exit(1);
+    }
+
+    /* cleanup */
+    aio_queue_destroy(q);
+    dma_pool_free(input);
+    dma_pool_free(output);
+    free(done);
+    fclose(file);
+}
+
+/* raises one interrupt on the eventfd standing in for an events device, after a short delay */
+static void *irq_events_raise(void *arg){
+
+    int fd = *(int *) arg;
+    uint64_t one = 1;
+
+    usleep(1000);
+    if (write(fd, &one, sizeof(one)) != sizeof(one)){
+        printf("Error: eventfd write failed\n");
+        exit(1);
+    }
+    return NULL;
+}
+
+/* tests the interrupt wait paths on an eventfd in place of /dev/xdmaN_events_M, so that it runs without HW:
+ * irq_source_wait must time out without an event and return the latched value of one,
+ * the dispatcher must wake a waiter for every interrupt raised after its generation and time out otherwise
+ */
+void irq_events_test(){
+
+    int num_rounds = 32;
+    int fd = eventfd(0, 0);
+    assert(fd >= 0);
+    struct irq_source *src = irq_source_from_fd(fd, 8);
+    int test_success = 1;
+
+    /* direct epoll wait */
+    uint32_t events = 0;
+    uint64_t value = 5;
+    if (irq_source_wait(src, 1000000, &events) != -1){
+        printf("Error: irq_source_wait returned without an interrupt\n");
+        test_success = 0;
+    }
+    if (write(fd, &value, sizeof(value)) != sizeof(value) || irq_source_wait(src, 1000000000ULL, &events) != 0 || events != 5){
+        printf("Error: irq_source_wait missed a latched interrupt (events %u)\n", events);
+        test_success = 0;
+    }
+
+    /* shared poller thread, the interrupt is raised by another thread while the waiter blocks */
+    struct irq_dispatcher *d = irq_dispatcher_create(src);
+    for (int r = 0; r < num_rounds; r++){
+        uint64_t generation = irq_dispatcher_generation(d);
+        pthread_t thread;
+        int rc = pthread_create(&thread, NULL, irq_events_raise, &fd);
+        assert(rc == 0);
+        if (irq_dispatcher_wait(d, generation, 1000000000ULL) != 0 || irq_dispatcher_generation(d) != generation + 1){
+            printf("Error: interrupt %d was not dispatched\n", r);
+            test_success = 0;
+        }
+        pthread_join(thread, NULL);
+    }
+    if (irq_dispatcher_wait(d, irq_dispatcher_generation(d), 1000000) != -1){
+        printf("Error: irq_dispatcher_wait returned without an interrupt\n");
+        test_success = 0;
+    }
+    irq_dispatcher_destroy(d);
+
+    if (src->num_events != (uint64_t) num_rounds + 1){
+        printf("Error: %llu interrupts consumed, %d raised\n", (unsigned long long) src->num_events, num_rounds + 1);
+        test_success = 0;
+    }
+    irq_source_close(src);
+    close(fd);
+
+    if (test_success){
+        printf("%d interrupts waited for directly and through the dispatcher! Interrupt Event Test Passed!\n", num_rounds + 1);
+    }
+    else{
+        exit(1);
+    }
+}
+
+/* profiles the aggregate bandwidth of "test_size" floats striped over all enabled H2C/C2H channels
+ * and verifies that the striped write and read are consistent
+ */
+void profile_stripe_transfer(struct fpga_device *dev, uint32_t test_size){
+
+    struct stripe_engine *se = dev->stripe;
+
+    printf("Profiling striped data transfer over %d H2C and %d C2H channels...\n", se->num_h2c, se->num_c2h);
+
+    float *input;
+    float *output;
+    input = (float *) channel_alloc_buffer(se->h2c[0], sizeof(float)*test_size);
+    output = (float *) channel_alloc_buffer(se->c2h[0], sizeof(float)*test_size);
+
+    for (int i = 0; i < (int) test_size; i++){
+        input[i] = (rand()%10000 + 1) * 0.001f;
+    }
+
+
+    struct timespec ts_write, ts_read;
+    timespec_init(&ts_write);
+    timespec_init(&ts_read);
+
+    for (int p = 0; p < NUM_REPEAT; p++){
+        struct timespec ts = fpga_device_stripe_write(dev, dev->bram_addr, sizeof(float)*test_size, input);
+        timespec_add(&ts_write, &ts);
+        ts = stripe_read(se, dev->bram_addr, sizeof(float)*test_size, output);
+        timespec_add(&ts_read, &ts);
+    }
+
+    if (memcmp(input, output, sizeof(float)*test_size) != 0){
+        printf("Striped Read/Write Test FAILED!\n");
+        exit(1);
+    }
+
+    timespec_div(&ts_write, NUM_REPEAT);
+    timespec_div(&ts_read, NUM_REPEAT);
+    printf("Average striped WRITE time of %d bytes: %ld.%09ld seconds\n", (int) (sizeof(float)*test_size), ts_write.tv_sec, ts_write.tv_nsec);
+    printf("Average striped READ  time of %d bytes: %ld.%09ld seconds\n", (int) (sizeof(float)*test_size), ts_read.tv_sec, ts_read.tv_nsec);
+    stripe_print_stats(se);
+
+    channel_free_buffer(input);
+    channel_free_buffer(output);
 }
 
 /* profiles the overhead of data transfer of "test_size" (test_size: number of float data)
  * verbose functions are called instead of normal functions
  */
-void profile_overhead(uint32_t test_size){
+void profile_overhead(struct fpga_device *dev, uint32_t test_size){
 
     printf("Profiling data transfer overhead...\n");
 
@@ -124,14 +463,21 @@ void profile_overhead(uint32_t test_size){
         input[i] = (rand()%10000 + 1) * 0.001f;
     }
 
+    char h2c_path[64], c2h_path[64];
+    snprintf(h2c_path, sizeof(h2c_path), "%s_h2c_0", dev->prefix);
+    snprintf(c2h_path, sizeof(c2h_path), "%s_c2h_0", dev->prefix);
+
+    /* the writes go through the channel path, outside the write path of the device */
+    residency_invalidate_range(dev->resident, dev->bram_addr, test_size*sizeof(float));
+
     // Test NUM_REPEAT times for WRITE
     for (int p = 0; p < NUM_REPEAT; p++){
-        write_to_channel_verbose("/dev/xdma0_h2c_0", BRAM_ADDR, test_size*sizeof(float), input);
+        write_to_channel_verbose(h2c_path, dev->bram_addr, test_size*sizeof(float), input);
     }
 
     // Test NUM_REPEAT times for READ
     for (int p = 0; p < NUM_REPEAT; p++){
-        read_from_channel_verbose("/dev/xdma0_c2h_0", BRAM_ADDR, test_size*sizeof(float), output);
+        read_from_channel_verbose(c2h_path, dev->bram_addr, test_size*sizeof(float), output);
     }
 
     /* cleanup */
@@ -139,34 +485,86 @@ void profile_overhead(uint32_t test_size){
     free(output);
 }
 
+/* microbenchmark of the matrix transposes on the shapes transposed by the matmuls
+ * naive, blocked with each kernel this CPU supports, and multi-threaded; every result is checked against the naive one
+ */
+void profile_transpose(void){
+
+    printf("Profiling matrix transpose...\n");
+
+    /* matrix2 of fpga_matmul, matrix2 and output of the large matmul test, a large matrix */
+    static const int shapes[][2] = {{SIZE, SIZE}, {75, 1024}, {1024, 32}, {784, 512}, {2048, 2048}};
+    static const char *isa_names[] = {"blocked scalar", "blocked AVX2", "blocked AVX-512"};
+
+    for (int s = 0; s < (int) (sizeof(shapes) / sizeof(shapes[0])); s++){
+        int num_row = shapes[s][0], num_col = shapes[s][1];
+        size_t num = (size_t) num_row * num_col;
+        int num_trials = (num < (1 << 22)) ? (int) ((1 << 22) / num) : 1; // about 4M numbers per variant
+
+        float *in_matrix = (float *) malloc(sizeof(float) * num);
+        float *ref_matrix = (float *) malloc(sizeof(float) * num);
+        float *out_matrix = (float *) malloc(sizeof(float) * num);
+        for (size_t i = 0; i < num; i++){
+            in_matrix[i] = (rand()%10000 + 1) * 0.001f;
+        }
+        mat_transpose_naive(in_matrix, ref_matrix, num_row, num_col);
+
+        /* variants: naive, each kernel up to the widest supported one, multi-threaded */
+        for (int v = -1; v <= mat_transpose_isa() + 1; v++){
+            struct timespec ts_start, ts_end;
+            clock_gettime(CLOCK_MONOTONIC, &ts_start);
+            for (int p = 0; p < num_trials; p++){
+                if (v < 0){
+                    mat_transpose_naive(in_matrix, out_matrix, num_row, num_col);
+                }
+                else if (v <= mat_transpose_isa()){
+                    mat_transpose_blocked(in_matrix, out_matrix, num_row, num_col, v);
+                }
+                else{
+                    mat_transpose_parallel(in_matrix, out_matrix, num_row, num_col, 0);
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &ts_end);
+            timespec_sub(&ts_end, &ts_start);
+            timespec_div(&ts_end, num_trials);
+
+            if (memcmp(out_matrix, ref_matrix, sizeof(float) * num) != 0){
+                printf("ERROR: matrix transpose mismatch\n");
+                exit(1);
+            }
+            printf("Average transpose time of %4d*%4d (%s): %ld.%09ld seconds\n", num_row, num_col,
+                   (v < 0) ? "naive" : (v <= mat_transpose_isa()) ? isa_names[v] : "multi-threaded", ts_end.tv_sec, ts_end.tv_nsec);
+        }
+
+        free(in_matrix);
+        free(ref_matrix);
+        free(out_matrix);
+    }
+}
+
 /* [FPGA should be programmed with vector innerproudct]
  * triggers HW to perform vector innerproduct
  * returns the total execution time
  */ 
-struct timespec fpga_innerproduct(float *in_vector1, float *in_vector2, float *out){
+struct timespec fpga_innerproduct(struct fpga_device *dev, float *in_vector1, float *in_vector2, float *out){
 
     struct timespec ts_start, ts_end;
     uint32_t op_code = 0x5555;
 
     clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
-    /* Write Data to BRAM */
-    write_to_channel("/dev/xdma0_h2c_0", BRAM_ADDR, 0x0004*SIZE, in_vector1);
-    write_to_channel("/dev/xdma0_h2c_0", BRAM_ADDR + 0x0004*SIZE, 0x0004*SIZE, in_vector2);
+    /* Write Data to BRAM (both vectors go out as one DMA) */
+    fpga_device_stage(dev, dev->bram_addr, 0x0004*SIZE, in_vector1);
+    fpga_device_stage(dev, dev->bram_addr + 0x0004*SIZE, 0x0004*SIZE, in_vector2);
 
     /* Send op code to myip */
-    write_to_channel("/dev/xdma0_h2c_0", IP_ADDR, 0x0004, &op_code);
+    struct timespec ts_kick = fpga_device_kick(dev, &op_code);
 
     /* Wait until computation is done */
-    while(1){
-        read_from_channel("/dev/xdma0_c2h_0", IP_ADDR, 0x0004, &op_code);
-        if(op_code != 0x5555){
-            break;
-        }
-    }
+    fpga_device_wait(dev, OP_INNERPRODUCT, SIZE, 0x5555, &ts_kick);
 
     /* Read output from BRAM */
-    read_from_channel("/dev/xdma0_c2h_0", BRAM_ADDR, 0x0004, out);
+    channel_read(dev->c2h[0], dev->bram_addr, 0x0004, out);
 
     clock_gettime(CLOCK_MONOTONIC, &ts_end);
 
@@ -174,34 +572,38 @@ struct timespec fpga_innerproduct(float *in_vector1, float *in_vector2, float *o
     return ts_end;
 }
 
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * triggers HW on the vector and matrix already written to BRAM and reads back the output vector
+ */
+static void fpga_matvec_run(struct fpga_device *dev, float *out_vector){
+
+    uint32_t op_code = 0x5555;
+
+    // Send OP Code
+    struct timespec ts_kick = fpga_device_kick(dev, &op_code);
+
+    // Wait until OP is done
+    fpga_device_wait(dev, OP_MATVEC, SIZE, 0x5555, &ts_kick);
+    
+    channel_read(dev->c2h[0], dev->bram_addr, 0x0004*SIZE, out_vector); // multi PE
+//    channel_read(dev->c2h[0], dev->bram_addr + 0x0004*(SIZE + SIZE*SIZE), 0x0004*SIZE, out_vector); // single PE
+}
+
 /* [FPGA should be programmed with matrix-vector multiplier]
  * triggers HW to perform matrix-vector multiplication (matrix: SIZE*SIZE, vector: SIZE)
  * returns total execution time
  */
-struct timespec fpga_matvec(float *in_matrix, float *in_vector, float *out_vector){
+struct timespec fpga_matvec(struct fpga_device *dev, float *in_matrix, float *in_vector, float *out_vector){
 
     struct timespec ts_start, ts_end;
-    uint32_t op_code = 0x5555;
 
     clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
-    /* Write data to BRAM */
-    write_to_channel("/dev/xdma0_h2c_0", BRAM_ADDR, 0x0004*SIZE, in_vector);
-    write_to_channel("/dev/xdma0_h2c_0", BRAM_ADDR + 0x0004*SIZE, 0x0004*SIZE*SIZE, in_matrix); 
-
-    // Send OP Code
-    write_to_channel("/dev/xdma0_h2c_0", IP_ADDR, 0x0004, &op_code);
+    /* Write data to BRAM (vector and matrix go out as one DMA) */
+    fpga_device_stage(dev, dev->bram_addr, 0x0004*SIZE, in_vector);
+    fpga_device_stage(dev, dev->bram_addr + 0x0004*SIZE, 0x0004*SIZE*SIZE, in_matrix); 
 
-    // Wait until OP is done
-    while(1){
-        read_from_channel("/dev/xdma0_c2h_0", IP_ADDR, 0x0004, &op_code);
-        if(op_code != 0x5555){
-            break;
-        }
-    }
-    
-    read_from_channel("/dev/xdma0_c2h_0", BRAM_ADDR, 0x0004*SIZE, out_vector); // multi PE
-//    read_from_channel("/dev/xdma0_c2h_0", BRAM_ADDR + 0x0004*(SIZE + SIZE*SIZE), 0x0004*SIZE, out_vector); // single PE
+    fpga_matvec_run(dev, out_vector);
 
     clock_gettime(CLOCK_MONOTONIC, &ts_end);
     timespec_sub(&ts_end, &ts_start);
@@ -211,7 +613,7 @@ struct timespec fpga_matvec(float *in_matrix, float *in_vector, float *out_vecto
 
 /* [FPGA should be programmed with matrix-vector multiplier]
  * profiling version of matvec operation */
-void fpga_matvec_verbose(float *in_matrix, float *in_vector, float *out_vector){
+void fpga_matvec_verbose(struct fpga_device *dev, float *in_matrix, float *in_vector, float *out_vector){
 
     struct timespec ts_global_start, ts_global_end;
     struct timespec ts_write_vector, ts_write_matrix, ts_write_op_code, ts_read_output;
@@ -222,26 +624,22 @@ void fpga_matvec_verbose(float *in_matrix, float *in_vector, float *out_vector){
     clock_gettime(CLOCK_MONOTONIC, &ts_global_start);
 
     /* Write data to BRAM */
-    ts_write_vector = write_to_channel("/dev/xdma0_h2c_0", BRAM_ADDR, 0x0004*SIZE, in_vector);
-    ts_write_matrix = write_to_channel("/dev/xdma0_h2c_0", BRAM_ADDR + 0x0004*SIZE, 0x0004*SIZE*SIZE, in_matrix); 
+    ts_write_vector = fpga_device_write(dev, dev->bram_addr, 0x0004*SIZE, in_vector);
+    ts_write_matrix = fpga_device_write(dev, dev->bram_addr + 0x0004*SIZE, 0x0004*SIZE*SIZE, in_matrix); 
 
     // Send OP Code
-    ts_write_op_code = write_to_channel("/dev/xdma0_h2c_0", IP_ADDR, 0x0004, &op_code);
+    completion_arm(dev->waiter);
+    ts_write_op_code = channel_write(dev->h2c[0], dev->ip_addr, 0x0004, &op_code);
 
     clock_gettime(CLOCK_MONOTONIC, &ts_hw_start);
 
     // Wait until OP is done
-    while(1){
-        read_from_channel("/dev/xdma0_c2h_0", IP_ADDR, 0x0004, &op_code);
-        if(op_code != 0x5555){
-            break;
-        }
-    }
+    fpga_device_wait(dev, OP_MATVEC, SIZE, 0x5555, &ts_hw_start);
 
     clock_gettime(CLOCK_MONOTONIC, &ts_hw_end);
 
 
-    ts_read_output = read_from_channel("/dev/xdma0_c2h_0", BRAM_ADDR + 0x0004*(SIZE + SIZE*SIZE), 0x0004*SIZE, out_vector);
+    ts_read_output = channel_read(dev->c2h[0], dev->bram_addr + 0x0004*(SIZE + SIZE*SIZE), 0x0004*SIZE, out_vector);
 
     clock_gettime(CLOCK_MONOTONIC, &ts_global_end);
     timespec_sub(&ts_global_end, &ts_global_start);
@@ -252,66 +650,222 @@ void fpga_matvec_verbose(float *in_matrix, float *in_vector, float *out_vector){
     printf("Vector Write  : %ld.%09ld seconds\n", ts_write_vector.tv_sec, ts_write_vector.tv_nsec);
     printf("Matrix Write  : %ld.%09ld seconds\n", ts_write_matrix.tv_sec, ts_write_matrix.tv_nsec);
     printf("OP code Write : %ld.%09ld seconds\n", ts_write_op_code.tv_sec, ts_write_op_code.tv_nsec);
-    printf("HW Runtime    : %ld.%09ld seconds\n", ts_hw_end.tv_sec, ts_hw_end.tv_nsec);
+    printf("HW Runtime    : %ld.%09ld seconds (%llu op code checks)\n", ts_hw_end.tv_sec, ts_hw_end.tv_nsec, (unsigned long long) dev->waiter->last_checks);
     printf("Output Read   : %ld.%09ld seconds\n", ts_read_output.tv_sec, ts_read_output.tv_nsec);
 }
 
+/* writes a row of num_cols numbers to the vector operand at addr, zero-padded up to SIZE from the shared zero page
+ * full rows are combined with the pending writes, partial rows go out through channel_writev
+ */
+static void fpga_upload_row(struct fpga_device *dev, uint32_t addr, const float *row, int num_cols){
+
+    struct iovec iov[TILE_IOV_MAX(1, SIZE)];
+
+    if (num_cols == SIZE){
+        fpga_device_stage(dev, addr, 0x0004*SIZE, row);
+    }
+    else{
+        wc_flush(dev->wc);
+        int iovcnt = tile_iov_build(iov, 0, row, 0, 1, num_cols, 1, SIZE);
+        fpga_device_writev(dev, addr, iov, iovcnt);
+    }
+}
+
+/* writes a SIZE*SIZE matrix operand to the matrix slot at addr
+ * a buffer keeping the page offset of the slot (prepacked tiles) goes out as is, others are combined with the next row
+ * resident: the tile was claimed by residency_acquire, so the upload must not drop its residency
+ */
+static void fpga_upload_matrix(struct fpga_device *dev, uint32_t addr, const float *in_matrix, int resident){
+
+    if (channel_is_aligned(dev->h2c[0], addr, in_matrix)){
+        wc_flush(dev->wc);
+        if (resident){
+            channel_write(dev->h2c[0], addr, 0x0004*SIZE*SIZE, in_matrix);
+        }
+        else{
+            fpga_device_write(dev, addr, 0x0004*SIZE*SIZE, in_matrix);
+        }
+    }
+    else if (resident){
+        wc_write(dev->wc, addr, 0x0004*SIZE*SIZE, in_matrix);
+    }
+    else{
+        fpga_device_stage(dev, addr, 0x0004*SIZE*SIZE, in_matrix);
+    }
+}
+
+/* vector operands and outputs of a sequence of ops against the matrix operand in BRAM
+ * rows are either strided (in_base + in_ld*k, out_base + SIZE*k) or given as arrays of pointers
+ */
+struct op_rows {
+    const float *const *in; // NULL: strided
+    const float *in_base;
+    int in_ld;
+    float *const *out; // NULL: strided
+    float *out_base;
+};
+
+static const float *op_row_in(const struct op_rows *rows, int k){
+    return (rows->in != NULL) ? rows->in[k] : rows->in_base + (size_t) rows->in_ld * k;
+}
+
+static float *op_row_out(const struct op_rows *rows, int k){
+    return (rows->out != NULL) ? rows->out[k] : rows->out_base + (size_t) SIZE * k;
+}
+
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * triggers HW for each of the num_rows vector operands against the matrix operand already written to BRAM
+ * vector operands have num_cols valid numbers and are zero-padded up to SIZE from the shared zero page
+ */
+static void fpga_run_rows(struct fpga_device *dev, int op_type, const struct op_rows *rows, int num_rows, int num_cols, struct stage_stats *st){
+
+    struct timespec ts_start, ts_end, ts_now;
+    uint32_t op_code = 0x5555;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    int k;
+    for (k =0; k < num_rows; k++){
+        struct timespec ts_stage;
+        clock_gettime(CLOCK_MONOTONIC, &ts_stage);
+
+        /* Write kth vector operand to BRAM, sent out together with the op code */
+        fpga_upload_row(dev, dev->bram_addr, op_row_in(rows, k), num_cols);
+
+        op_code = 0x5555;
+        struct timespec ts_kick = fpga_device_kick(dev, &op_code);
+        ts_now = ts_kick;
+        timespec_sub(&ts_now, &ts_stage);
+        timespec_add(&st->h2c, &ts_now);
+
+        fpga_device_wait(dev, op_type, SIZE, 0x5555, &ts_kick);
+        clock_gettime(CLOCK_MONOTONIC, &ts_now);
+        timespec_sub(&ts_now, &ts_kick);
+        timespec_add(&st->compute, &ts_now);
+
+        /* Read kth output row from BRAM */
+//        channel_read(dev->c2h[0], dev->bram_addr + 0x0004*(SIZE + SIZE*SIZE), 0x0004*SIZE, op_row_out(rows, k)); // Single PE
+        ts_now = channel_read(dev->c2h[0], dev->bram_addr, 0x0004*SIZE, op_row_out(rows, k)); // Multi PE
+        timespec_add(&st->c2h, &ts_now);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+    timespec_add(&st->wall, &ts_end);
+    st->num_ops += num_rows;
+}
+
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * triggers HW for each of the num_rows rows of A against the transposed matrix B already written to BRAM
+ * rows of A have num_cols valid numbers (row stride lda) and are zero-padded up to SIZE
+ * kth output row is saved to out_matrix + SIZE*k
+ */
+static void fpga_matmul_rows(struct fpga_device *dev, const float *in_matrix1, int lda, int num_rows, int num_cols, float *out_matrix){
+
+    struct op_rows rows = {NULL, in_matrix1, lda, NULL, out_matrix};
+    fpga_run_rows(dev, OP_MATMUL_ROW, &rows, num_rows, num_cols, &dev->matmul_stats);
+}
+
 /* [FPGA should be programmed with matrix-vector multiplier]
  * triggers HW(Matrix-Vector) multiple times to perfrom matrix-matrix multiplication (matrix: SIZE*SIZE)
  * returns total execution time
  * NOTE: This function does not call fpga_matvec function, 
  *       because calling fpag_matvec function multiple times will lead to SIZE-1 extra copy of input matrix
  */
-struct timespec fpga_matmul(float *in_matrix1, float *in_matrix2, float *out_matrix){
+struct timespec fpga_matmul(struct fpga_device *dev, float *in_matrix1, float *in_matrix2, float *out_matrix){
 
     struct timespec ts_start, ts_end;
-    uint32_t op_code = 0x5555;
 
     float *in_matrix2_t;
-    in_matrix2_t = (float *) malloc(sizeof(float)*SIZE*SIZE);
+    in_matrix2_t = (float *) channel_alloc_buffer(dev->h2c[0], sizeof(float)*SIZE*SIZE);
 
     clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
     /* Transpose matrix B */
-    mat_transpose_naive(in_matrix2, in_matrix2_t, SIZE, SIZE);
+    mat_transpose_tiling(in_matrix2, in_matrix2_t, SIZE, SIZE);
+
+    /* Write transposed matrix B to BRAM */
+    fpga_upload_matrix(dev, dev->bram_addr + 0x0004*SIZE, in_matrix2_t, 0);
 
     /* for K=0~SIZE-1:  B * A_Row(K) */
+    fpga_matmul_rows(dev, in_matrix1, SIZE, SIZE, SIZE, out_matrix);
 
-    /* Write transposed matrix B to BRAM */
-    write_to_channel("/dev/xdma0_h2c_0", BRAM_ADDR + 0x0004*SIZE, 0x0004*SIZE*SIZE, in_matrix2_t);
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
 
-    int k;
-    for (k =0; k < SIZE; k++){
-        /* Write kth row of matrix A to BRAM */
-        write_to_channel("/dev/xdma0_h2c_0", BRAM_ADDR, 0x0004*SIZE, in_matrix1 + SIZE*k);
+    channel_free_buffer(in_matrix2_t);
 
-        op_code = 0x5555;
-        write_to_channel("/dev/xdma0_h2c_0", IP_ADDR, 0x0004, &op_code);
+    return ts_end;
+}
 
-        while(1){
-            read_from_channel("/dev/xdma0_c2h_0", IP_ADDR, 0x0004, &op_code);
-            if(op_code != 0x5555){
-                break;
-            }
+/* [FPGA should be programmed with the command queue consumer, or q emulated]
+ * matrix-matrix multiplication (matrix: SIZE*SIZE) with QUEUE_BATCH rows per doorbell
+ * the rows of a batch and their records go out together, the outputs come back as one read,
+ * so there is one PCIe round trip per batch instead of one per row
+ * returns total execution time
+ */
+struct timespec fpga_matmul_queued(struct cmd_queue *q, float *in_matrix1, float *in_matrix2, float *out_matrix){
+
+    struct timespec ts_start, ts_end;
+
+    float in_matrix2_t[SIZE*SIZE];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    /* Transpose matrix B and write it to the matrix slot */
+    mat_transpose_tiling(in_matrix2, in_matrix2_t, SIZE, SIZE);
+    cmd_queue_write(q, FPGA_MATRIX_SLOT_OFFSET, 0x0004*SIZE*SIZE, in_matrix2_t);
+
+    uint32_t input_offset = FPGA_CMD_DATA_OFFSET;
+    uint32_t output_offset = FPGA_CMD_DATA_OFFSET + 0x0004*SIZE*QUEUE_BATCH;
+    for (int i = 0; i < SIZE; i += QUEUE_BATCH){
+        int num_rows = (SIZE - i >= QUEUE_BATCH) ? QUEUE_BATCH : SIZE - i;
+
+        /* rows of matrix A are adjacent in BRAM, so they go out as one DMA */
+        cmd_queue_write(q, input_offset, 0x0004*SIZE*num_rows, in_matrix1 + SIZE*i);
+        for (int r = 0; r < num_rows; r++){
+            cmd_queue_push(q, FPGA_OP_MATVEC, input_offset + 0x0004*SIZE*r, FPGA_MATRIX_SLOT_OFFSET, output_offset + 0x0004*SIZE*r);
         }
-        /* Read kth row of output matrix from BRAM */
-//        read_from_channel("/dev/xdma0_c2h_0", BRAM_ADDR + 0x0004*(SIZE + SIZE*SIZE), 0x0004*SIZE, out_matrix + SIZE*k); // Single PE
-        read_from_channel("/dev/xdma0_c2h_0", BRAM_ADDR, 0x0004*SIZE, out_matrix + SIZE*k); // Multi PE
+        cmd_queue_kick(q);
+        cmd_queue_read(q, output_offset, 0x0004*SIZE*num_rows, out_matrix + SIZE*i);
     }
 
     clock_gettime(CLOCK_MONOTONIC, &ts_end);
     timespec_sub(&ts_end, &ts_start);
 
-    free(in_matrix2_t);
+    return ts_end;
+}
+
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * multiplies one SIZE*SIZE matrix with num_vectors vectors (out_vectors[k] = in_matrix * in_vectors[k])
+ * the matrix is uploaded once, then only the vector operand and the op code are written per vector
+ * returns total execution time
+ */
+struct timespec fpga_matvec_batched(struct fpga_device *dev, const float *in_matrix, const float *const *in_vectors, float *const *out_vectors, int num_vectors){
+
+    struct timespec ts_start, ts_end;
+    struct op_rows rows = {in_vectors, NULL, 0, out_vectors, NULL};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    fpga_upload_matrix(dev, dev->bram_addr + 0x0004*SIZE, in_matrix, 0);
+
+    fpga_run_rows(dev, OP_MATVEC, &rows, num_vectors, SIZE, &dev->batch_stats);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
 
     return ts_end;
 }
 
 /* [FPGA should be programmed with matrix-vector multiplier]
  * Naive Version of Large Matrix-Vector multiplication (Tiling)
+ * tiles that are clear in mask (tile_mask.h, NULL: every tile) are all zero and are neither uploaded nor computed
  * NOTE: This function calls fpga_matvec multiple tiems, without making use of temporal locality
  */
-struct timespec fpga_large_matvec_naive(float *in_matrix, float *in_vector, float *out_vector, int num_row, int num_col){
+struct timespec fpga_large_matvec_naive(struct fpga_device *dev, float *in_matrix, float *in_vector, float *out_vector, int num_row, int num_col, const struct tile_mask *mask){
+
+    assert(mask == NULL || (mask->tile == SIZE && mask->num_tile_row == (num_row + SIZE - 1) / SIZE && mask->num_tile_col == (num_col + SIZE - 1) / SIZE));
 
     /* zero initialize out_vector */
     for (int p = 0; p < num_row; p++){
@@ -319,11 +873,9 @@ struct timespec fpga_large_matvec_naive(float *in_matrix, float *in_vector, floa
     }
 
     struct timespec ts_start, ts_end;
-    uint32_t op_code = 0x5555;
 
-    /* Create a matrix and vector buffer that will be used for each tile operation */
-    float fpga_matrix[SIZE*SIZE];
-    float fpga_vector[SIZE];
+    /* vector tile and matrix tile are gathered from the source rows (no packing copy) */
+    struct iovec iov[TILE_IOV_MAX(1, SIZE) + TILE_IOV_MAX(SIZE, SIZE)];
    
     clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
@@ -332,61 +884,25 @@ struct timespec fpga_large_matvec_naive(float *in_matrix, float *in_vector, floa
     for (i = 0; i < num_row; i+=SIZE){
         float out[SIZE] = {0.0f};
         float output_buffer[SIZE] = {0.0f};
+
+        int num_row_in_tile = (num_row - i >= SIZE) ? SIZE : num_row - i;
+
         /* for each tile-row, loop over tile by column */
         int j;
         for (j = 0; j < num_col; j+=SIZE){
-            /* memcpy for matrix tile */
-            int num_row_in_tile = 0;
-            // case 1: can fully tile row-wise
-            if (num_row - i >= SIZE){
-                num_row_in_tile = SIZE;
-            }
-            // case 2: cannot fully tile row-wise
-            else{
-                num_row_in_tile = num_row - i;
-                // zero-initialze matrix (zero-padding in advance)
-                int k;
-                for (k = 0; k < SIZE*SIZE; k++){
-                    *(fpga_matrix + k) = 0.0f;
-                }
-            }
+            int num_col_in_tile = (num_col - j >= SIZE) ? SIZE : num_col - j;
 
-            // memcpy the matrix tile based on num_row_in_tile
-            int m;
-            for (m = 0; m < num_row_in_tile; m++){
-                // Case 1: Can fully tile column-wise
-                if (num_col - j >= SIZE){
-                    memcpy(fpga_matrix + SIZE*m, in_matrix + num_col * i + j + num_col * m, SIZE*sizeof(float));     
-                }
-                // Case 2: cannot fully tile column-wise
-                else{
-                    memcpy(fpga_matrix + SIZE*m, in_matrix + num_col * i + j + num_col * m, (num_col - j)*sizeof(float));
-                    // zero-pad the rest of column with 0
-                    int k;
-                    for (k = 0; k < (SIZE - (num_col - j)); k++){
-                        *(fpga_matrix + SIZE*m + (num_col - j) + k) = 0.0f;
-                    }
-                
-                }
+            if (!tile_mask_test(mask, i / SIZE, j / SIZE)){
+                continue;
             }
 
-            /* memcpy for vector tile */
-            // case 1: can fully tile column-wise
-            if (num_col - j >= SIZE){
-                memcpy(fpga_vector, in_vector + j, SIZE*sizeof(float));
-            }
-            // case 2: cannot fully tile column-wise
-            else{
-                memcpy(fpga_vector, in_vector + j, (num_col - j)*sizeof(float));
-                // zero-pad the rest of input vector with 0
-                int k;
-                for (k = 0; k < (SIZE - (num_col - j)); ++k){
-                    *(fpga_vector + (num_col - j) + k) = 0.0f;
-                }
-            }
+            /* vector tile at the start of BRAM followed by matrix tile, edge tiles are zero-padded */
+            int iovcnt = tile_iov_build(iov, 0, in_vector + j, 0, 1, num_col_in_tile, 1, SIZE);
+            iovcnt = tile_iov_build(iov, iovcnt, in_matrix + num_col * i + j, num_col, num_row_in_tile, num_col_in_tile, SIZE, SIZE);
+            fpga_device_writev(dev, dev->bram_addr, iov, iovcnt);
 
             /* Perform Matrix-Vector Multiplication for given input */
-            fpga_matvec(fpga_matrix, fpga_vector, out); 
+            fpga_matvec_run(dev, out);
 
             int n;
             for (n = 0; n < SIZE; n++){
@@ -395,37 +911,254 @@ struct timespec fpga_large_matvec_naive(float *in_matrix, float *in_vector, floa
 
         }
 
-        if (num_row - i >= SIZE){
-            memcpy(out_vector + i, output_buffer, SIZE*sizeof(float));
+        memcpy(out_vector + i, output_buffer, num_row_in_tile*sizeof(float));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    return ts_end;
+}
+
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * multiplies the matrix tile (tile_row, tile_col) of the matrix identified by key and version with in_vector
+ * the tile has num_row_in_tile*num_col_in_tile numbers at tile (row stride ld), in_vector has num_vector numbers
+ * the matrix tile is uploaded only if the residency manager does not already hold this version of it in BRAM
+ */
+static void fpga_matvec_tile(struct fpga_device *dev, const void *key, uint64_t version, int tile_row, int tile_col,
+                             const float *tile, int ld, int num_row_in_tile, int num_col_in_tile,
+                             const float *in_vector, int num_vector, float *out){
+
+    struct iovec iov[TILE_IOV_MAX(1, SIZE) + TILE_IOV_MAX(SIZE, SIZE)];
+    uint32_t slot_addr;
+
+    int hit = residency_acquire(dev->resident, key, version, tile_row, tile_col, 0x0004*SIZE*SIZE, &slot_addr);
+
+    /* the tile claimed by residency_acquire is uploaded on h2c[0] directly, the vector through the device */
+    int iovcnt = tile_iov_build(iov, 0, in_vector, 0, 1, num_vector, 1, SIZE);
+    if (!hit && slot_addr == dev->bram_addr + 0x0004*SIZE){
+        /* vector and matrix tile are adjacent: one DMA */
+        iovcnt = tile_iov_build(iov, iovcnt, tile, ld, num_row_in_tile, num_col_in_tile, SIZE, SIZE);
+        channel_writev(dev->h2c[0], dev->bram_addr, iov, iovcnt);
+    }
+    else{
+        fpga_device_writev(dev, dev->bram_addr, iov, iovcnt);
+        if (!hit){
+            iovcnt = tile_iov_build(iov, 0, tile, ld, num_row_in_tile, num_col_in_tile, SIZE, SIZE);
+            channel_writev(dev->h2c[0], slot_addr, iov, iovcnt);
         }
-        else{
-            memcpy(out_vector + i, output_buffer, (num_row - i)*sizeof(float));
+    }
+
+    fpga_matvec_run(dev, out);
+}
+
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * Large Matrix-Vector multiplication against weights kept resident in BRAM across calls
+ * "version" identifies the contents of in_matrix, the caller must change it whenever in_matrix is modified
+ * NOTE: only tiles that fit in the BRAM matrix slots stay resident, e.g. a SIZE*SIZE matrix with one slot
+ */
+struct timespec fpga_large_matvec_resident(struct fpga_device *dev, const float *in_matrix, uint64_t version, float *in_vector, float *out_vector, int num_row, int num_col){
+
+    struct timespec ts_start, ts_end;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    for (int i = 0; i < num_row; i+=SIZE){
+        float out[SIZE];
+        float output_buffer[SIZE] = {0.0f};
+
+        int num_row_in_tile = (num_row - i >= SIZE) ? SIZE : num_row - i;
+
+        for (int j = 0; j < num_col; j+=SIZE){
+            int num_col_in_tile = (num_col - j >= SIZE) ? SIZE : num_col - j;
+
+            fpga_matvec_tile(dev, in_matrix, version, i / SIZE, j / SIZE, in_matrix + num_col * i + j, num_col,
+                             num_row_in_tile, num_col_in_tile, in_vector + j, num_col_in_tile, out);
+
+            for (int n = 0; n < SIZE; n++){
+                output_buffer[n] += out[n];
+            }
         }
+
+        memcpy(out_vector + i, output_buffer, num_row_in_tile*sizeof(float));
     }
 
     clock_gettime(CLOCK_MONOTONIC, &ts_end);
     timespec_sub(&ts_end, &ts_start);
 
-    for(int p =0; p < SIZE*SIZE; p++){
-        fpga_matrix[p] = 0.0f;
+    return ts_end;
+}
+
+/* [FPGA should be programmed with the format build of matrix-vector multiplier, or dev is NULL]
+ * Large Matrix-Vector multiplication with operands moved in a reduced-precision transfer format (formats.h)
+ * zero-padded tiles are packed before upload, tile outputs (in format_output(format)) are widened and summed in fp32 on the host
+ * with dev NULL each op runs on the software model of the format build, so accuracy and traffic can be checked without HW
+ * other formats than fp32 need the format build, so they run on the model too unless dev->packed_formats is set (FPGA_FORMATS=1)
+ * traffic and conversion time are added to st
+ */
+struct timespec fpga_large_matvec_format(struct fpga_device *dev, int format, const float *in_matrix, const float *in_vector, float *out_vector, int num_row, int num_col, struct format_stats *st){
+
+    if (dev != NULL && format != FORMAT_FP32 && !dev->packed_formats){
+        printf("NOTE: %s is not marked as a format build (FPGA_FORMATS=1), %s ops run on the software model\n", dev->prefix, format_name(format));
+        dev = NULL;
     }
-    for(int p=0; p< SIZE; p++){
-        fpga_vector[p] = 0.0f;
+
+    int num_tile_cols = (num_col + SIZE - 1) / SIZE;
+    size_t vector_bytes = format_bytes(format, SIZE);
+    size_t matrix_bytes = format_bytes(format, SIZE*SIZE);
+    size_t out_bytes = format_bytes(format_output(format), SIZE);
+    uint32_t op_code = (format == FORMAT_FP32) ? FPGA_OP_MATVEC : FPGA_OP_MATVEC_PACKED + format;
+
+    struct timespec ts_start, ts_end, ts_conv, ts_conv_end;
+
+    /* scratch memory, no allocation once it has grown: the H2C staging buffer of dev, or a buffer kept for the model
+     * the packed matrix sits at the page offset of the matrix slot (zero-copy upload), the bytes before it take
+     * the bounced vector upload, followed by the fp32 tile, the packed output and the packed vector tiles
+     */
+    static char *model_workspace = NULL;
+    static size_t model_workspace_size = 0;
+    size_t workspace_size = FPGA_MATRIX_SLOT_OFFSET + 0x0004*SIZE*SIZE + 0x0004*SIZE*SIZE + 0x0004*SIZE + vector_bytes * num_tile_cols;
+    char *workspace;
+    if (dev != NULL){
+        workspace = (char *) channel_staging(dev->h2c[0], workspace_size);
+    }
+    else{
+        if (workspace_size > model_workspace_size){
+            free(model_workspace);
+            model_workspace = (char *) malloc(workspace_size);
+            assert(model_workspace);
+            model_workspace_size = workspace_size;
+        }
+        workspace = model_workspace;
     }
+    char *packed_matrix = workspace + FPGA_MATRIX_SLOT_OFFSET;
+    float *tile = (float *) (packed_matrix + 0x0004*SIZE*SIZE);
+    char *packed_out = (char *) (tile + SIZE*SIZE);
+    char *packed_vectors = packed_out + 0x0004*SIZE;
+
+    if (dev != NULL){
+        /* a bounced matrix upload would overwrite itself in the staging buffer */
+        assert(channel_is_aligned(dev->h2c[0], dev->bram_addr + FPGA_MATRIX_SLOT_OFFSET, packed_matrix));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    /* the vector tiles are packed once and sent with every tile-row */
+    for (int j = 0; j < num_col; j+=SIZE){
+        int num_col_in_tile = (num_col - j >= SIZE) ? SIZE : num_col - j;
+        memset(tile, 0, 0x0004*SIZE);
+        memcpy(tile, in_vector + j, 0x0004*num_col_in_tile);
+        clock_gettime(CLOCK_MONOTONIC, &ts_conv);
+        format_pack(format, tile, SIZE, packed_vectors + vector_bytes * (j / SIZE));
+        clock_gettime(CLOCK_MONOTONIC, &ts_conv_end);
+        timespec_sub(&ts_conv_end, &ts_conv);
+        timespec_add(&st->pack_time, &ts_conv_end);
+    }
+
+    for (int i = 0; i < num_row; i+=SIZE){
+        float out[SIZE];
+        float output_buffer[SIZE] = {0.0f};
+
+        int num_row_in_tile = (num_row - i >= SIZE) ? SIZE : num_row - i;
+
+        for (int j = 0; j < num_col; j+=SIZE){
+            int num_col_in_tile = (num_col - j >= SIZE) ? SIZE : num_col - j;
+            const char *packed_vector = packed_vectors + vector_bytes * (j / SIZE);
+
+            memset(tile, 0, 0x0004*SIZE*SIZE);
+            for (int r = 0; r < num_row_in_tile; r++){
+                memcpy(tile + SIZE * r, in_matrix + num_col * (i + r) + j, 0x0004*num_col_in_tile);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &ts_conv);
+            format_pack(format, tile, SIZE*SIZE, packed_matrix);
+            clock_gettime(CLOCK_MONOTONIC, &ts_conv_end);
+            timespec_sub(&ts_conv_end, &ts_conv);
+            timespec_add(&st->pack_time, &ts_conv_end);
+
+            if (dev != NULL){
+                fpga_device_write(dev, dev->bram_addr, vector_bytes, packed_vector);
+                fpga_device_write(dev, dev->bram_addr + FPGA_MATRIX_SLOT_OFFSET, matrix_bytes, packed_matrix);
+
+                struct timespec ts_kick = fpga_device_kick(dev, &op_code);
+                fpga_device_wait(dev, OP_MATVEC, SIZE, op_code, &ts_kick);
+
+                channel_read(dev->c2h[0], dev->bram_addr, out_bytes, packed_out);
+            }
+            else{
+                format_model_matvec(format, packed_matrix, packed_vector, packed_out, SIZE);
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &ts_conv);
+            format_unpack(format_output(format), packed_out, SIZE, out);
+            clock_gettime(CLOCK_MONOTONIC, &ts_conv_end);
+            timespec_sub(&ts_conv_end, &ts_conv);
+            timespec_add(&st->unpack_time, &ts_conv_end);
+
+            for (int n = 0; n < SIZE; n++){
+                output_buffer[n] += out[n];
+            }
+
+            st->num_ops++;
+            st->fp32_bytes += 0x0004*(SIZE + SIZE*SIZE + SIZE);
+            st->moved_bytes += vector_bytes + matrix_bytes + out_bytes;
+        }
+
+        memcpy(out_vector + i, output_buffer, num_row_in_tile*sizeof(float));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
 
     return ts_end;
 }
 
+/* packs the CSR matrix into SIZE*SIZE slabs (sparse.h) laid out for zero-copy DMA to the BRAM matrix slot */
+struct ell_slabs *fpga_sparse_prepack(struct fpga_device *dev, const struct csr_matrix *in_matrix){
+    return ell_pack(in_matrix, SIZE, (dev->bram_addr + FPGA_MATRIX_SLOT_OFFSET) & 0x0FFF);
+}
+
 /* [FPGA should be programmed with matrix-vector multiplier]
- * Naive Version of Large Matrix-Matrix Multiplication (Tiling)
- * NOTE: This function calls fpga_large_matvec multiple times, without making use of temporal locality
+ * Sparse Matrix-Vector multiplication on the slabs of fpga_sparse_prepack
+ * each slab goes out with its gathered vector, and its outputs are scattered back to their rows
+ */
+struct timespec fpga_spmv(struct fpga_device *dev, const struct ell_slabs *in_matrix, const float *in_vector, float *out_vector){
+
+    struct timespec ts_start, ts_end;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    for (int p = 0; p < in_matrix->num_row; p++){
+        out_vector[p] = 0.0f;
+    }
+
+    for (int s = 0; s < in_matrix->num_slabs; s++){
+        float slab_vector[SIZE];
+        float out[SIZE];
+
+        ell_gather(in_matrix, s, in_vector, slab_vector);
+        fpga_matvec_tile(dev, in_matrix->slabs, in_matrix->slabs->version, s, 0, matrix_tile(in_matrix->slabs, s, 0), SIZE,
+                         SIZE, SIZE, slab_vector, SIZE, out);
+        ell_scatter(in_matrix, s, out, out_vector);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    return ts_end;
+}
+
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * Large Matrix-Matrix Multiplication (Tiling) as matrix-vector multiplications
+ * each tile of matrix1 is uploaded once and stays in BRAM while it is multiplied with every column of matrix2
+ * NOTE: with the single BRAM matrix slot the next tile evicts it, so matrix1 is sent once per call (not once per column),
+ * tiles are not kept across calls; use fpga_large_matvec_resident for weights that stay unchanged between calls
  */
-struct timespec fpga_large_matmul_naive(float *in_matrix1, float *in_matrix2, float *out_matrix, int num_rowA, int num_colA, int num_colB){
+struct timespec fpga_large_matmul_naive(struct fpga_device *dev, float *in_matrix1, float *in_matrix2, float *out_matrix, int num_rowA, int num_colA, int num_colB){
 
     float *in_matrix2_t;
-    in_matrix2_t = (float *)malloc(sizeof(float)*num_colA*num_colB);
+    in_matrix2_t = (float *)dma_pool_alloc(sizeof(float)*num_colA*num_colB);
     float *out_matrix_t;
-    out_matrix_t = (float *)malloc(sizeof(float)*num_rowA*num_colB);
+    out_matrix_t = (float *)dma_pool_alloc(sizeof(float)*num_rowA*num_colB);
 
     for (int n = 0; n < num_rowA*num_colB; n++){
         *(out_matrix_t + n) = 0.0f;
@@ -435,158 +1168,787 @@ struct timespec fpga_large_matmul_naive(float *in_matrix1, float *in_matrix2, fl
     struct timespec ts_start, ts_end;
 
 
-    clock_gettime(CLOCK_MONOTONIC, &ts_start);
- 
-    mat_transpose_naive(in_matrix2, in_matrix2_t, num_colA, num_colB);
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+ 
+    mat_transpose_tiling(in_matrix2, in_matrix2_t, num_colA, num_colB);
+
+    /* contents of matrix1 may have changed since the last call (no version is passed in) */
+    residency_invalidate(dev->resident, in_matrix1);
+
+    for (int i = 0; i < num_rowA; i+=SIZE){
+        int num_row_in_tile = (num_rowA - i >= SIZE) ? SIZE : num_rowA - i;
+
+        for (int j = 0; j < num_colA; j+=SIZE){
+            int num_col_in_tile = (num_colA - j >= SIZE) ? SIZE : num_colA - j;
+
+            /* cth column of the output += tile (i, j) of matrix1 * rows j ~ j+SIZE-1 of cth column of matrix2 */
+            for (int c = 0; c < num_colB; c++){
+                float out[SIZE];
+                fpga_matvec_tile(dev, in_matrix1, 0, i / SIZE, j / SIZE, in_matrix1 + num_colA * i + j, num_colA,
+                                 num_row_in_tile, num_col_in_tile, in_matrix2_t + num_colA * c + j, num_col_in_tile, out);
+
+                for (int n = 0; n < num_row_in_tile; n++){
+                    out_matrix_t[num_rowA * c + i + n] += out[n];
+                }
+            }
+        }
+    }
+
+    mat_transpose_tiling(out_matrix_t, out_matrix, num_colB, num_rowA);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    dma_pool_free(in_matrix2_t);
+    dma_pool_free(out_matrix_t);
+
+    return ts_end;
+}
+
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * Naive Version of Large Matrix-Matrix Multiplication (Tiling)
+ * k-steps where the tile of matrix1 is clear in mask1 or the tile of matrix2 is clear in mask2 (NULL: every tile) are skipped
+ * NOTE: This function calls fpga_matmul multiple times, without making use of temporal locality
+ */
+struct timespec fpga_large_matmul_naive2(struct fpga_device *dev, float *in_matrix1, float *in_matrix2, float *out_matrix, int num_rowA, int num_colA, int num_colB,
+                                         const struct tile_mask *mask1, const struct tile_mask *mask2){
+ 
+    assert(mask1 == NULL || (mask1->tile == SIZE && mask1->num_tile_row == (num_rowA + SIZE - 1) / SIZE && mask1->num_tile_col == (num_colA + SIZE - 1) / SIZE));
+    assert(mask2 == NULL || (mask2->tile == SIZE && mask2->num_tile_row == (num_colA + SIZE - 1) / SIZE && mask2->num_tile_col == (num_colB + SIZE - 1) / SIZE));
+
+    struct timespec ts_start, ts_end;
+
+    /* Transposed tile of matrix2, tiles of matrix1 are streamed row by row from the source */
+    float *fpga_matrix2_t;
+    fpga_matrix2_t = (float *) channel_alloc_buffer(dev->h2c[0], sizeof(float)*SIZE*SIZE);
+   
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    /* ith tile row of matrix1 */
+    for (int i = 0; i < num_rowA; i+=SIZE){
+
+
+        // first check whether we can fully tile in terms of i
+        int tilesize_i = 0;
+        if (num_rowA - i >= SIZE){
+            tilesize_i = SIZE;
+        }
+        else{
+            tilesize_i = num_rowA - i;
+        }
+
+        /* jth tile column of matrix2 */
+        for (int j = 0; j < num_colB; j+=SIZE){
+
+            // then check whether we can fully tile in terms of j
+            int tilesize_j = 0;
+            if (num_colB - j >= SIZE){
+                tilesize_j = SIZE;
+            }
+            else{
+                tilesize_j = num_colB - j;
+            }
+
+            float out[SIZE*SIZE] = {0.0f}; // save output of each FPGA computation
+            float output_buffer[SIZE*SIZE] = {0.0f}; // buffer to sum k "out" for each (i, j) pair
+
+            /* kth tile of multiplying ith tile row and jth tile column */
+            for (int k =0; k< num_colA; k+=SIZE){
+
+                // finally check whether we can fully tile in terms of k
+                int tilesize_k = 0;
+                if (num_colA - k >= SIZE){
+                    tilesize_k = SIZE;
+                }
+                else{
+                    tilesize_k = num_colA - k;
+                }
+
+                /* a zero tile on either side adds nothing to the output tile */
+                if (!tile_mask_test(mask1, i / SIZE, k / SIZE) || !tile_mask_test(mask2, k / SIZE, j / SIZE)){
+                    continue;
+                }
+
+                /* gather the tile of matrix2 already transposed, zero-padding only for edge tiles */
+                if (tilesize_j < SIZE || tilesize_k < SIZE){
+                    for (int p = 0; p < SIZE*SIZE; p++){
+                        fpga_matrix2_t[p] = 0.0f;
+                    }
+                }
+                mat_transpose_strided(in_matrix2 + num_colB * k + j, num_colB, fpga_matrix2_t, SIZE, tilesize_k, tilesize_j);
+
+                /* invoke matrix-matrix multiplication, rows of the tile beyond tilesize_i are never saved */
+                fpga_upload_matrix(dev, dev->bram_addr + 0x0004*SIZE, fpga_matrix2_t, 0);
+                fpga_matmul_rows(dev, in_matrix1 + num_colA * i + k, num_colA, tilesize_i, tilesize_k, out);
+
+                for (int p = 0; p < SIZE*SIZE; p++){
+                    output_buffer[p] += out[p];
+                }
+
+            }
+
+            /* save result to output */
+            for (int p = 0; p < tilesize_i; p++){
+                memcpy(out_matrix + num_colB * i + num_colB * p + j, output_buffer + SIZE*p, sizeof(float)*tilesize_j);
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    channel_free_buffer(fpga_matrix2_t);
+
+    return ts_end;
+}
+
+/* prepacks a row-major matrix to tile-major storage (MATRIX_TILED, or MATRIX_TILED_T for matrix2 of fpga_gemm)
+ * tiles keep the page offset of the BRAM matrix slot, so that each tile is one zero-copy DMA
+ */
+struct matrix *fpga_prepack(struct fpga_device *dev, const float *src, int num_row, int num_col, int layout){
+    return matrix_prepack(src, num_row, num_col, SIZE, layout, (dev->bram_addr + FPGA_MATRIX_SLOT_OFFSET) & 0x0FFF);
+}
+
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * Large Matrix-Vector multiplication on either layout of in_matrix
+ * prepacked (MATRIX_TILED) tiles are sent as they are and stay resident in BRAM until the matrix is repacked
+ */
+struct timespec fpga_gemv(struct fpga_device *dev, const struct matrix *in_matrix, float *in_vector, float *out_vector){
+
+    if (in_matrix->layout == MATRIX_ROW_MAJOR){
+        return fpga_large_matvec_naive(dev, in_matrix->data, in_vector, out_vector, in_matrix->num_row, in_matrix->num_col, NULL);
+    }
+    if (in_matrix->layout != MATRIX_TILED || in_matrix->tile != SIZE){
+        printf("ERROR: fpga_gemv needs a row-major matrix or a MATRIX_TILED matrix with %d*%d tiles\n", SIZE, SIZE);
+        exit(1);
+    }
+
+    struct timespec ts_start, ts_end;
+    int num_row = in_matrix->num_row;
+    int num_col = in_matrix->num_col;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    for (int i = 0; i < num_row; i+=SIZE){
+        float out[SIZE];
+        float output_buffer[SIZE] = {0.0f};
+
+        int num_row_in_tile = (num_row - i >= SIZE) ? SIZE : num_row - i;
+
+        for (int j = 0; j < num_col; j+=SIZE){
+            int num_col_in_tile = (num_col - j >= SIZE) ? SIZE : num_col - j;
+
+            /* tiles are already zero-padded: one contiguous segment */
+            fpga_matvec_tile(dev, in_matrix, in_matrix->version, i / SIZE, j / SIZE, matrix_tile(in_matrix, i / SIZE, j / SIZE), SIZE,
+                             SIZE, SIZE, in_vector + j, num_col_in_tile, out);
+
+            for (int n = 0; n < SIZE; n++){
+                output_buffer[n] += out[n];
+            }
+        }
+
+        memcpy(out_vector + i, output_buffer, num_row_in_tile*sizeof(float));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    return ts_end;
+}
+
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * Large Matrix-Matrix Multiplication on either layout
+ * with in_matrix2 prepacked as MATRIX_TILED_T, every tile of matrix2 is sent once (no transpose, no packing)
+ * and multiplied with all rows of in_matrix1 (row-major, or MATRIX_TILED with zero-padded rows)
+ * two row-major operands fall back to fpga_large_matmul_naive2
+ */
+struct timespec fpga_gemm(struct fpga_device *dev, const struct matrix *in_matrix1, const struct matrix *in_matrix2, float *out_matrix){
+
+    if (in_matrix1->layout == MATRIX_ROW_MAJOR && in_matrix2->layout == MATRIX_ROW_MAJOR){
+        return fpga_large_matmul_naive2(dev, in_matrix1->data, in_matrix2->data, out_matrix,
+                                        in_matrix1->num_row, in_matrix1->num_col, in_matrix2->num_col, NULL, NULL);
+    }
+    if (in_matrix2->layout != MATRIX_TILED_T || in_matrix2->tile != SIZE ||
+        in_matrix1->layout == MATRIX_TILED_T || (in_matrix1->layout == MATRIX_TILED && in_matrix1->tile != SIZE)){
+        printf("ERROR: fpga_gemm needs matrix2 prepacked as MATRIX_TILED_T and matrix1 row-major or MATRIX_TILED, with %d*%d tiles\n", SIZE, SIZE);
+        exit(1);
+    }
+    assert(in_matrix1->num_col == in_matrix2->num_row);
+
+    struct timespec ts_start, ts_end;
+    int num_rowA = in_matrix1->num_row;
+    int num_colA = in_matrix1->num_col;
+    int num_colB = in_matrix2->num_col;
+
+    /* output rows of one tile of matrix2, for all rows of matrix1 (padded up to SIZE rows) */
+    float *out;
+    out = (float *) dma_pool_alloc(sizeof(float)*SIZE*(num_rowA + SIZE));
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    memset(out_matrix, 0, sizeof(float)*num_rowA*num_colB);
+
+    for (int j = 0; j < num_colB; j+=SIZE){
+        int tilesize_j = (num_colB - j >= SIZE) ? SIZE : num_colB - j;
+
+        for (int k = 0; k < num_colA; k+=SIZE){
+            int tilesize_k = (num_colA - k >= SIZE) ? SIZE : num_colA - k;
+
+            uint32_t slot_addr;
+            if (!residency_acquire(dev->resident, in_matrix2, in_matrix2->version, k / SIZE, j / SIZE, 0x0004*SIZE*SIZE, &slot_addr)){
+                fpga_upload_matrix(dev, slot_addr, matrix_tile(in_matrix2, k / SIZE, j / SIZE), 1);
+            }
+
+            if (in_matrix1->layout == MATRIX_ROW_MAJOR){
+                fpga_matmul_rows(dev, in_matrix1->data + k, num_colA, num_rowA, tilesize_k, out);
+            }
+            else{
+                for (int i = 0; i < num_rowA; i+=SIZE){
+                    int tilesize_i = (num_rowA - i >= SIZE) ? SIZE : num_rowA - i;
+                    fpga_matmul_rows(dev, matrix_tile(in_matrix1, i / SIZE, k / SIZE), SIZE, tilesize_i, SIZE, out + SIZE*i);
+                }
+            }
+
+            for (int p = 0; p < num_rowA; p++){
+                float *dst = out_matrix + num_colB * p + j;
+                for (int q = 0; q < tilesize_j; q++){
+                    dst[q] += out[SIZE*p + q];
+                }
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    dma_pool_free(out);
+
+    return ts_end;
+}
+
+/* operands of a CPU+FPGA split matvec/matmul, blocks are SIZE rows of A */
+struct hetero_args {
+    struct fpga_device *dev;
+    float *A;
+    float *B; // vector of matvec, matrix2 of matmul
+    const struct matrix *packed_B; // matmul: matrix2 prepacked once for the FPGA chunks
+    float *C;
+    int num_rowA;
+    int num_colA;
+    int num_colB; // 1 for matvec
+};
+
+/* first row and number of rows of count blocks from block first */
+static int hetero_rows(const struct hetero_args *h, int first, int count, int *num_rows){
+
+    int row = first * SIZE;
+    *num_rows = (h->num_rowA - row < count * SIZE) ? h->num_rowA - row : count * SIZE;
+    return row;
+}
+
+static void hetero_matvec_fpga(void *arg, int first, int count){
+
+    struct hetero_args *h = (struct hetero_args *) arg;
+    int num_rows;
+    int row = hetero_rows(h, first, count, &num_rows);
+    fpga_large_matvec_naive(h->dev, h->A + (size_t) h->num_colA * row, h->B, h->C + row, num_rows, h->num_colA, NULL);
+}
+
+static void hetero_matvec_cpu(void *arg, int first, int count){
+
+    struct hetero_args *h = (struct hetero_args *) arg;
+    int num_rows;
+    int row = hetero_rows(h, first, count, &num_rows);
+    cpu_gemv(NULL, h->A + (size_t) h->num_colA * row, h->B, h->C + row, num_rows, h->num_colA, CPU_SUM_FAST);
+}
+
+static void hetero_matmul_fpga(void *arg, int first, int count){
+
+    struct hetero_args *h = (struct hetero_args *) arg;
+    int num_rows;
+    int row = hetero_rows(h, first, count, &num_rows);
+    struct matrix rows;
+    matrix_view(&rows, h->A + (size_t) h->num_colA * row, num_rows, h->num_colA);
+    fpga_gemm(h->dev, &rows, h->packed_B, h->C + (size_t) h->num_colB * row);
+}
+
+static void hetero_matmul_cpu(void *arg, int first, int count){
+
+    struct hetero_args *h = (struct hetero_args *) arg;
+    int num_rows;
+    int row = hetero_rows(h, first, count, &num_rows);
+    cpu_gemm(NULL, h->A + (size_t) h->num_colA * row, h->B, h->C + (size_t) h->num_colB * row, num_rows, h->num_colA, h->num_colB);
+}
+
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * Large Matrix-Vector multiplication with the rows split between the FPGA and the CPU threads of hs
+ * every output number is computed by one side only
+ * returns total execution time
+ */
+struct timespec fpga_hetero_matvec(struct fpga_device *dev, struct hetero_scheduler *hs, float *in_matrix, float *in_vector, float *out_vector, int num_row, int num_col){
+
+    struct hetero_args h = {dev, in_matrix, in_vector, NULL, out_vector, num_row, num_col, 1};
+    return hetero_run(hs, HETERO_MATVEC, (num_row + SIZE - 1) / SIZE, hetero_matvec_fpga, hetero_matvec_cpu, &h);
+}
+
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * Large Matrix-Matrix multiplication with the rows of matrix1 split between the FPGA and the CPU threads of hs
+ * matrix2 is prepacked once for all FPGA chunks, the prepacking is part of the returned time
+ */
+struct timespec fpga_hetero_matmul(struct fpga_device *dev, struct hetero_scheduler *hs, float *in_matrix1, float *in_matrix2, float *out_matrix, int num_rowA, int num_colA, int num_colB){
+
+    struct timespec ts_start, ts_end;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    struct matrix *packed_matrix2 = fpga_prepack(dev, in_matrix2, num_colA, num_colB, MATRIX_TILED_T);
+    struct hetero_args h = {dev, in_matrix1, in_matrix2, packed_matrix2, out_matrix, num_rowA, num_colA, num_colB};
+    hetero_run(hs, HETERO_MATMUL, (num_rowA + SIZE - 1) / SIZE, hetero_matmul_fpga, hetero_matmul_cpu, &h);
+    matrix_free(packed_matrix2);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    return ts_end;
+}
+
+/* Matrix-Vector multiplication on the CPU or on the FPGA, whichever the cost model predicts to finish first
+ * returns total execution time
+ */
+struct timespec fpga_auto_matvec(struct fpga_device *dev, struct cost_model *cost, float *in_matrix, float *in_vector, float *out_vector, int num_row, int num_col){
+
+    if (cost_model_choose(cost, COST_OP_MATVEC, num_row, num_col, 1) == COST_TARGET_CPU){
+        return cpu_gemv(NULL, in_matrix, in_vector, out_vector, num_row, num_col, CPU_SUM_FAST);
+    }
+    return fpga_large_matvec_naive(dev, in_matrix, in_vector, out_vector, num_row, num_col, NULL);
+}
+
+/* Matrix-Matrix multiplication on the CPU or on the FPGA (matrix2 prepacked for fpga_gemm), whichever the cost model predicts to finish first
+ * returns total execution time
+ */
+struct timespec fpga_auto_matmul(struct fpga_device *dev, struct cost_model *cost, float *in_matrix1, float *in_matrix2, float *out_matrix, int num_rowA, int num_colA, int num_colB){
+
+    if (cost_model_choose(cost, COST_OP_MATMUL, num_rowA, num_colA, num_colB) == COST_TARGET_CPU){
+        return cpu_gemm(NULL, in_matrix1, in_matrix2, out_matrix, num_rowA, num_colA, num_colB);
+    }
+
+    struct timespec ts_start, ts_end;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    struct matrix view_matrix1;
+    matrix_view(&view_matrix1, in_matrix1, num_rowA, num_colA);
+    struct matrix *packed_matrix2 = fpga_prepack(dev, in_matrix2, num_colA, num_colB, MATRIX_TILED_T);
+    fpga_gemm(dev, &view_matrix1, packed_matrix2, out_matrix);
+    matrix_free(packed_matrix2);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    return ts_end;
+}
+
+/* [FPGA should be programmed with matrix-vector multiplier]
+ * replays an execution plan: y = A*x for PLAN_MATVEC (B is x), C = A*B for PLAN_MATMUL
+ * the shape, the tile schedule, the staging tiles and the BRAM address map all come from the plan
+ * returns total execution time
+ */
+struct timespec offload_execute(struct offload_plan *plan, const float *A, const float *B, float *C){
+
+    struct fpga_device *dev = plan->dev;
+    struct timespec ts_start, ts_end;
+    int M = plan->M, K = plan->K, N = plan->N;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    if (!(plan->flags & OFFLOAD_PLAN_ACCUMULATE)){
+        memset(C, 0, sizeof(float)*M*N);
+    }
+    if (plan->type == PLAN_MATVEC){
+        struct iovec iov[TILE_IOV_MAX(1, SIZE) + TILE_IOV_MAX(SIZE, SIZE)];
+
+        for (int s = 0; s < plan->num_steps; s++){
+            const struct plan_step *step = &plan->steps[s];
+            float out[SIZE];
+
+            /* vector tile and matrix tile in one DMA, edges zero-padded */
+            int iovcnt = tile_iov_build(iov, 0, B + step->col, 0, 1, step->cols, 1, SIZE);
+            iovcnt = tile_iov_build(iov, iovcnt, A + K * step->row + step->col, K, step->rows, step->cols, SIZE, SIZE);
+            fpga_device_writev(dev, plan->vector_addr, iov, iovcnt);
+
+            fpga_matvec_run(dev, out);
+
+            for (int n = 0; n < step->rows; n++){
+                C[step->row + n] += out[n];
+            }
+        }
+    }
+    else{
+        for (int s = 0; s < plan->num_steps; s++){
+            const struct plan_step *step = &plan->steps[s];
+            float *tile = plan->staging[step->staging];
+
+            /* transposed tile of B, padding of the staging tile is never written */
+            if (plan->flags & OFFLOAD_PLAN_B_TRANSPOSED){
+                for (int q = 0; q < step->cols; q++){
+                    memcpy(tile + SIZE*q, B + K * (step->col + q) + step->row, sizeof(float)*step->rows);
+                }
+            }
+            else{
+                for (int p = 0; p < step->rows; p++){
+                    const float *src = B + N * (step->row + p) + step->col;
+                    for (int q = 0; q < step->cols; q++){
+                        tile[SIZE*q + p] = src[q];
+                    }
+                }
+            }
+            fpga_upload_matrix(dev, plan->matrix_addr, tile, 0);
+
+            /* all rows of A against the tile */
+            fpga_matmul_rows(dev, A + step->row, K, M, step->rows, plan->output);
 
-    int i;
-    for(i = 0; i < num_colB; i++){
-        fpga_large_matvec_naive(in_matrix1, in_matrix2_t + num_colA * i, out_matrix_t + num_rowA * i, num_rowA, num_colA);
+            for (int r = 0; r < M; r++){
+                float *dst = C + N * r + step->col;
+                const float *out = plan->output + SIZE * r;
+                for (int q = 0; q < step->cols; q++){
+                    dst[q] += out[q];
+                }
+            }
+        }
     }
 
-    mat_transpose_naive(out_matrix_t, out_matrix, num_colB, num_rowA);
-
     clock_gettime(CLOCK_MONOTONIC, &ts_end);
     timespec_sub(&ts_end, &ts_start);
 
-    free(in_matrix2_t);
-    free(out_matrix_t);
-
     return ts_end;
 }
 
+/* an output element differs from its reference when the float difference exceeds DIFF_THRESHOLD,
+ * relative to |ref| for large values and absolute near zero (where a relative test would divide by ~0)
+ */
+static int output_differs(float out, float ref){
+
+    float scale = (fabsf(ref) > 1.0f) ? fabsf(ref) : 1.0f;
+    return fabsf(out - ref) > DIFF_THRESHOLD * scale;
+}
+
 /* [FPGA should be programmed with matrix-vector multiplier]
- * Naive Version of Large Matrix-Matrix Multiplication (Tiling)
- * NOTE: This function calls fpga_matmul multiple times, without making use of temporal locality
+ * sweeps the tile density of pruned operands from 100% to 5%: whole tiles are zeroed at random,
+ * the occupancy is found by tile_mask_scan and the zero tiles are skipped by the large matvec/matmul
  */
-struct timespec fpga_large_matmul_naive2(float *in_matrix1, float *in_matrix2, float *out_matrix, int num_rowA, int num_colA, int num_colB){
- 
-    struct timespec ts_start, ts_end;
-    uint32_t op_code = 0x5555;
+void profile_block_sparse(struct fpga_device *dev){
 
-    /* Create a matrix buffer that will be used for each tile operation */
-    float fpga_matrix1[SIZE*SIZE];
-    float fpga_matrix2[SIZE*SIZE];
-   
-    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+    printf("Profiling block-sparse tile skipping...\n");
 
-    /* ith tile row of matrix1 */
-    for (int i = 0; i < num_rowA; i+=SIZE){
+    static const int densities[] = {100, 75, 50, 25, 10, 5}; // percent of nonzero tiles
+    const int num_row = 784, num_col = 512; // matvec
+    const int num_rowA = SIZE, num_colA = 512, num_colB = 256; // matmul, matrix2 pruned
+    const int num_trials = 10;
 
+    float *in_matrix = (float *) malloc(sizeof(float) * num_row * num_col);
+    float *in_matrix1 = (float *) malloc(sizeof(float) * num_rowA * num_colA);
+    float *in_matrix2 = (float *) malloc(sizeof(float) * num_colA * num_colB);
+    float *in_vector = (float *) malloc(sizeof(float) * num_col);
+    float *ref_out = (float *) malloc(sizeof(float) * num_rowA * num_colB);
+    float *fpga_out = (float *) malloc(sizeof(float) * num_rowA * num_colB);
 
-        // first check whether we can fully tile in terms of i
-        int tilesize_i = 0;
-        if (num_rowA - i >= SIZE){
-            tilesize_i = SIZE;
+    for (int d = 0; d < (int) (sizeof(densities) / sizeof(densities[0])); d++){
+        for (int m = 0; m < num_row * num_col; m++){
+            in_matrix[m] = (rand()%10000 + 1) * 0.001f;
         }
-        else{
-            tilesize_i = num_rowA - i;
+        for (int m = 0; m < num_rowA * num_colA; m++){
+            in_matrix1[m] = (rand()%10000 + 1) * 0.001f;
+        }
+        for (int m = 0; m < num_colA * num_colB; m++){
+            in_matrix2[m] = (rand()%10000 + 1) * 0.001f;
+        }
+        for (int m = 0; m < num_col; m++){
+            in_vector[m] = (rand()%10000 + 1) * 0.001f;
         }
 
-        /* jth tile column of matrix2 */
-        for (int j = 0; j < num_colB; j+=SIZE){
+        /* prune whole tiles */
+        for (int i = 0; i < num_row; i++){
+            for (int j = 0; j < num_col; j+=SIZE){
+                if ((((i / SIZE) * 7919 + (j / SIZE) * 104729 + d * 31) % 100) >= densities[d]){
+                    memset(in_matrix + num_col * i + j, 0, sizeof(float) * ((num_col - j < SIZE) ? num_col - j : SIZE));
+                }
+            }
+        }
+        for (int k = 0; k < num_colA; k++){
+            for (int j = 0; j < num_colB; j+=SIZE){
+                if ((((k / SIZE) * 7919 + (j / SIZE) * 104729 + d * 31) % 100) >= densities[d]){
+                    memset(in_matrix2 + num_colB * k + j, 0, sizeof(float) * ((num_colB - j < SIZE) ? num_colB - j : SIZE));
+                }
+            }
+        }
 
-            // then check whether we can fully tile in terms of j
-            int tilesize_j = 0;
-            if (num_colB - j >= SIZE){
-                tilesize_j = SIZE;
+        struct timespec ts_start, ts_scan;
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+        struct tile_mask *mask = tile_mask_scan(in_matrix, num_row, num_col, SIZE);
+        clock_gettime(CLOCK_MONOTONIC, &ts_scan);
+        timespec_sub(&ts_scan, &ts_start);
+        struct tile_mask *mask1 = tile_mask_scan(in_matrix1, num_rowA, num_colA, SIZE);
+        struct tile_mask *mask2 = tile_mask_scan(in_matrix2, num_colA, num_colB, SIZE);
+
+        /* matvec: every tile, then only the occupied ones */
+        struct timespec ts_dense, ts_sparse, ts;
+        timespec_init(&ts_dense);
+        timespec_init(&ts_sparse);
+        cpu_matvec(in_matrix, in_vector, ref_out, num_row, num_col);
+        for (int p = 0; p < num_trials; p++){
+            ts = fpga_large_matvec_naive(dev, in_matrix, in_vector, fpga_out, num_row, num_col, NULL);
+            timespec_add(&ts_dense, &ts);
+            ts = fpga_large_matvec_naive(dev, in_matrix, in_vector, fpga_out, num_row, num_col, mask);
+            timespec_add(&ts_sparse, &ts);
+        }
+        for (int n = 0; n < num_row; n++){
+            if (output_differs(fpga_out[n], ref_out[n])){
+                printf("ERROR: block-sparse matvec %4dth element Differ - FPGA: %f CPU: %f\n", n, fpga_out[n], ref_out[n]);
+                exit(1);
             }
-            else{
-                tilesize_j = num_colB - j;
+        }
+        timespec_div(&ts_dense, num_trials);
+        timespec_div(&ts_sparse, num_trials);
+        double dense = ts_dense.tv_sec + ts_dense.tv_nsec / 1e9;
+        double sparse = ts_sparse.tv_sec + ts_sparse.tv_nsec / 1e9;
+        printf("Block-sparse matvec %d*%d, %5.1f%% tiles: dense %.9f s, skipping %.9f s (%.2fx, ideal %.2fx), scan %ld.%09ld s\n",
+               num_row, num_col, 100.0 * tile_mask_density(mask), dense, sparse, (sparse > 0) ? dense / sparse : 0.0,
+               (mask->num_occupied > 0) ? 1.0 / tile_mask_density(mask) : 0.0, ts_scan.tv_sec, ts_scan.tv_nsec);
+
+        /* matmul with pruned matrix2 */
+        cpu_matmul(in_matrix1, in_matrix2, ref_out, num_rowA, num_colA, num_colB);
+        ts_dense = fpga_large_matmul_naive2(dev, in_matrix1, in_matrix2, fpga_out, num_rowA, num_colA, num_colB, NULL, NULL);
+        ts_sparse = fpga_large_matmul_naive2(dev, in_matrix1, in_matrix2, fpga_out, num_rowA, num_colA, num_colB, mask1, mask2);
+        for (int n = 0; n < num_rowA * num_colB; n++){
+            if (output_differs(fpga_out[n], ref_out[n])){
+                printf("ERROR: block-sparse matmul %4dth element Differ - FPGA: %f CPU: %f\n", n, fpga_out[n], ref_out[n]);
+                exit(1);
             }
+        }
+        dense = ts_dense.tv_sec + ts_dense.tv_nsec / 1e9;
+        sparse = ts_sparse.tv_sec + ts_sparse.tv_nsec / 1e9;
+        printf("Block-sparse matmul %d*%d*%d, %5.1f%% tiles of matrix2: dense %.9f s, skipping %.9f s (%.2fx)\n",
+               num_rowA, num_colA, num_colB, 100.0 * tile_mask_density(mask2), dense, sparse, (sparse > 0) ? dense / sparse : 0.0);
+
+        tile_mask_free(mask);
+        tile_mask_free(mask1);
+        tile_mask_free(mask2);
+    }
 
-            float out[SIZE*SIZE] = {0.0f}; // save output of each FPGA computation
-            float output_buffer[SIZE*SIZE] = {0.0f}; // buffer to sum k "out" for each (i, j) pair
+    free(in_matrix);
+    free(in_matrix1);
+    free(in_matrix2);
+    free(in_vector);
+    free(ref_out);
+    free(fpga_out);
+}
 
-            /* kth tile of multiplying ith tile row and jth tile column */
-            for (int k =0; k< num_colA; k+=SIZE){
+/* tests fpga_matmul_queued on q (destroyed afterwards) against cpu_matmul
+ * a queue created without a device runs on the host emulation of the consumer, so the protocol is checked without HW
+ */
+void queued_matmul_test(struct cmd_queue *q){
 
-                // zero initialize matrix buffer
-                for (int p =0; p < SIZE*SIZE; p++){
-                    fpga_matrix1[p] = 0.0f;
-                    fpga_matrix2[p] = 0.0f;
-                }
+    printf("Performing Queued Matrix-Matrix Multiplication Test (%s queue)...\n", (q->dev == NULL) ? "emulated" : "FPGA");
 
-                // finally check whether we can fully tile in terms of k
-                int tilesize_k = 0;
-                if (num_colA - k >= SIZE){
-                    tilesize_k = SIZE;
-                }
-                else{
-                    tilesize_k = num_colA - k;
-                }
+    float in_matrix1[SIZE*SIZE];
+    float in_matrix2[SIZE*SIZE];
+    float cpu_out_matrix[SIZE*SIZE];
+    float queued_out_matrix[SIZE*SIZE];
+    struct timespec ts, ts_avg;
+    int success_flag = 1;
 
-                /* memcpy the according tile to matrix buffer */
+    timespec_init(&ts_avg);
+    for (int p = 0; p < NUM_REPEAT; p++){
+        for (int i = 0; i < SIZE*SIZE; i++){
+            in_matrix1[i] = (rand()%10000 + 1) * 0.001f;
+            in_matrix2[i] = (rand()%10000 + 1) * 0.001f;
+        }
+        ts = fpga_matmul_queued(q, in_matrix1, in_matrix2, queued_out_matrix);
+        cpu_matmul(in_matrix1, in_matrix2, cpu_out_matrix, SIZE, SIZE, SIZE);
+        timespec_add(&ts_avg, &ts);
 
-                // memcpy tile from matrix1
-                for (int p = 0; p < tilesize_i; p++){
-                    memcpy(fpga_matrix1 + SIZE*p, in_matrix1 + num_colA * i + num_colA * p + k, sizeof(float)*tilesize_k);
-                }
-                // memcpy tile from matrix2
-                for (int p = 0; p < tilesize_k; p++){
-                    memcpy(fpga_matrix2 + SIZE*p, in_matrix2 + num_colB * k + num_colB * p + j, sizeof(float)*tilesize_j);
-                }
+        for (int k = 0; k < SIZE*SIZE; k++){
+            if (output_differs(queued_out_matrix[k], cpu_out_matrix[k])){
+                printf("%4dth element Differ - Queued: %f CPU: %f\n", k, queued_out_matrix[k], cpu_out_matrix[k]);
+                success_flag = 0;
+            }
+        }
+    }
+    timespec_div(&ts_avg, NUM_REPEAT);
+    printf("Average time (%s queue): %ld.%09ld seconds\n", (q->dev == NULL) ? "emulated" : "FPGA", ts_avg.tv_sec, ts_avg.tv_nsec);
+    cmd_queue_print_stats(q);
+    cmd_queue_destroy(q);
 
-                /* invoke matrix-matrix multiplication */
-                fpga_matmul(fpga_matrix1, fpga_matrix2, out);
+    if (success_flag){
+        printf("Queued Matrix-Matrix Multiplication Test PASSED!\n");
+    }
+    else{
+        printf("Queued Matrix-Matrix Multiplication Test FAILED!\n");
+        exit(1);
+    }
+}
 
-                for (int p = 0; p < SIZE*SIZE; p++){
-                    output_buffer[p] += out[p];
-                }
+/* tests fpga_large_matvec_format in every transfer format on a 784*512 matrix against cpu_matvec
+ * dev NULL runs the software model of the format build (no HW needed); with a cost model,
+ * the transfer time of each format is also predicted from the calibrated link
+ */
+void format_matvec_test(struct fpga_device *dev, const struct cost_model *cost){
 
-            }
+    printf("Performing Reduced-Precision Matrix-Vector Multiplication Test (%s)...\n", (dev != NULL) ? "FPGA" : "model");
 
-            /* save result to output */
-            for (int p = 0; p < tilesize_i; p++){
-                memcpy(out_matrix + num_colB * i + num_colB * p + j, output_buffer + SIZE*p, sizeof(float)*tilesize_j);
+    const double format_threshold[FORMAT_NUM] = {1e-5, 2e-3, 1e-2, 2e-2}; // max relative error vs cpu_matvec
+    const int num_row = 784, num_col = 512;
+    float *in_matrix = (float *) malloc(sizeof(float) * num_row * num_col);
+    float *in_vector = (float *) malloc(sizeof(float) * num_col);
+    float *cpu_out = (float *) malloc(sizeof(float) * num_row);
+    float *format_out = (float *) malloc(sizeof(float) * num_row);
+    assert(in_matrix && in_vector && cpu_out && format_out);
+
+    for (int i = 0; i < num_row * num_col; i++){
+        in_matrix[i] = (rand()%10000 + 1) * 0.001f;
+    }
+    for (int i = 0; i < num_col; i++){
+        in_vector[i] = (rand()%10000 + 1) * 0.001f;
+    }
+    cpu_matvec(in_matrix, in_vector, cpu_out, num_row, num_col);
+
+    double fp32_transfer = 0.0;
+    int success_flag = 1;
+    for (int f = 0; f < FORMAT_NUM; f++){
+        struct format_stats st;
+        memset(&st, 0, sizeof(st));
+
+        struct timespec ts = fpga_large_matvec_format(dev, f, in_matrix, in_vector, format_out, num_row, num_col, &st);
+
+        double max_err = 0.0, sum_err = 0.0;
+        for (int n = 0; n < num_row; n++){
+            double err = fabs((double) format_out[n] - cpu_out[n]) / fabs(cpu_out[n]);
+            max_err = (err > max_err) ? err : max_err;
+            sum_err += err * err;
+        }
+
+        printf("Large Matrix-Vector Multiplication(%s, %s): %ld.%09ld seconds, max error %.2e, RMS error %.2e\n",
+               format_name(f), (dev != NULL) ? "FPGA" : "model", ts.tv_sec, ts.tv_nsec, max_err, sqrt(sum_err / num_row));
+
+        /* transfer time predicted from the calibrated link: two uploads and one readback per op */
+        if (cost != NULL){
+            double transfer = st.num_ops * (2 * cost->params.h2c_fixed + cost->params.c2h_fixed)
+                              + (st.moved_bytes - st.num_ops * format_bytes(format_output(f), SIZE)) * cost->params.h2c_per_byte
+                              + st.num_ops * format_bytes(format_output(f), SIZE) * cost->params.c2h_per_byte;
+            if (f == FORMAT_FP32){
+                fp32_transfer = transfer;
             }
+            printf("Modeled transfer (%s): %.9f s (%.2fx faster than fp32)\n", format_name(f), transfer,
+                   (transfer > 0) ? fp32_transfer / transfer : 0.0);
+        }
+        format_stats_print(f, &st);
+
+        if (max_err > format_threshold[f]){
+            printf("%s error %.2e over the threshold %.2e\n", format_name(f), max_err, format_threshold[f]);
+            success_flag = 0;
         }
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &ts_end);
-    timespec_sub(&ts_end, &ts_start);
+    free(in_matrix);
+    free(in_vector);
+    free(cpu_out);
+    free(format_out);
 
-    return ts_end;
+    if (success_flag){
+        printf("Reduced-Precision Matrix-Vector Multiplication Test PASSED!\n");
+    }
+    else{
+        printf("Reduced-Precision Matrix-Vector Multiplication Test FAILED!\n");
+        exit(1);
+    }
 }
 
 int main(void){
 
+    /* submission code of the asynchronous transfers, checked on a temporary file (needs no HW) */
+    printf("Performing asynchronous read/write test...\n");
+    aio_readback_test(AIO_BACKEND_AUTO);
+    aio_readback_test(AIO_BACKEND_LINUX_AIO);
+
+    /* interrupt wait paths, on an eventfd in place of the events device (needs no HW) */
+    printf("Performing interrupt event test...\n");
+    irq_events_test();
+
+    /* command queue protocol, checked against the host emulation of the consumer (needs no HW) */
+    queued_matmul_test(cmd_queue_create(NULL));
+
+    /* accuracy and traffic of the transfer formats, on the software model of the format build (needs no HW) */
+    format_matvec_test(NULL, NULL);
+
     /* Making sure that the device is recognized */
     device_check();
 
-    /* Check the number of enabled channels by reading xmda control register values */
-    int num_en_h2c = check_h2c_channels();
-    printf("Number of Enabled H2C channels: %d\n", num_en_h2c);
-    if (num_en_h2c == 0){
-        printf("ERROR: No PCIe DMA H2C channels were identified\n");
+    /* Open every card once, the tests below run on the first one */
+    struct fpga_device *devices[MAX_DEVICES];
+    int num_devices = fpga_device_discover(devices, MAX_DEVICES);
+    if (num_devices == 0){
+        printf("ERROR: No xdma device was found\n");
         exit(1);
     }
-
-    int num_en_c2h = check_c2h_channels();
-    printf("Number of Enabled C2H channels: %d\n", num_en_c2h);
-    if (num_en_c2h == 0){
-        printf("ERROR: No PCIe DMA C2H channels were identified\n");
-        exit(1);
+    printf("Number of xdma devices: %d\n", num_devices);
+    struct fpga_device *dev = devices[0];
+
+    /* FPGA_WAIT_MODE selects how op completion is detected: dma (default), mmio, irq, irq-thread
+     * FPGA_WAIT_POLICY enables the adaptive sleep/spin/block wait tuned for latency or cpu
+     */
+    for (int d = 0; d < num_devices; d++){
+        fpga_device_set_wait(devices[d], getenv("FPGA_WAIT_MODE"), getenv("FPGA_WAIT_POLICY"));
     }
 
+    /* latency model of the first card for the CPU/FPGA dispatch, cached per card until the device or bitstream changes */
+    char cost_path[32];
+    snprintf(cost_path, sizeof(cost_path), "xdma%d.cost", dev->index);
+    struct cost_model *cost = cost_model_warm(dev, cost_path);
+
+    /* CPU backend (GEMM, GEMV), one thread per online CPU; cpu_matmul and cpu_matvec stay the reference of every test */
+    struct cpu_backend *cpu = cpu_backend_create(0, -1);
+
     /* Functionality Tests */
     srand(time(NULL)); // random seed
 
     /* 1. Perform BRAM read/write test */
-    bram_readwrite_test(8192);
+    bram_readwrite_test(dev, 8192);
 
 //    gettime_overhead();
 
     /* 2. Performance Profiling */
-    profile_transferSize();
+    profile_transferSize(dev);
+    profile_async_transfer(dev);
+    profile_tile_upload(dev);
+    profile_stripe_transfer(dev, 8192);
+    profile_transpose();
 
     /* 3. Overhead Profiling */
-//    profile_overhead(SIZE*SIZE); //
+//    profile_overhead(dev, SIZE*SIZE); //
 
 
     /* 4. Vector Innerproduct Test */
 //    fpga_innerproduct();
 
+    /* CPU kernels of the innerproduct: SIMD and compensated against the reference */
+    {
+        float in_vector1[8192], in_vector2[8192];
+        float cpu_out = 0.0f, fast_out, kahan_out;
+        for (int i = 0; i < 8192; i++){
+            in_vector1[i] = (rand()%10000 + 1) * 0.001f;
+            in_vector2[i] = (rand()%10000 + 1) * 0.001f;
+        }
+        struct timespec ts_ref = cpu_innerproduct(in_vector1, in_vector2, &cpu_out, 8192);
+        struct timespec ts_fast = cpu_fast_innerproduct(in_vector1, in_vector2, &fast_out, 8192, CPU_SUM_FAST);
+        struct timespec ts_kahan = cpu_fast_innerproduct(in_vector1, in_vector2, &kahan_out, 8192, CPU_SUM_KAHAN);
+        printf("Vector Innerproduct(CPU): %ld.%09ld seconds, (CPU, SIMD): %ld.%09ld seconds, (CPU, compensated): %ld.%09ld seconds\n",
+               ts_ref.tv_sec, ts_ref.tv_nsec, ts_fast.tv_sec, ts_fast.tv_nsec, ts_kahan.tv_sec, ts_kahan.tv_nsec);
+        if (output_differs(fast_out, cpu_out) || output_differs(kahan_out, cpu_out)){
+            printf("Vector Innerproduct Test FAILED! CPU: %f SIMD: %f compensated: %f\n", cpu_out, fast_out, kahan_out);
+            exit(1);
+        }
+    }
+
     /* variable setup and initialization for following tests*/    
     float in_vector[SIZE];
     float in_matrix1[SIZE*SIZE];
@@ -596,8 +1958,8 @@ int main(void){
     float cpu_out_matrix[SIZE*SIZE];
     float fpga_out_matrix[SIZE*SIZE];
     
-    struct timespec ts_fpga, ts_cpu;
-    struct timespec ts_fpga_avg, ts_cpu_avg;
+    struct timespec ts_fpga, ts_cpu, ts_prepacked, ts_planned, ts_hetero, ts_gemm;
+    struct timespec ts_fpga_avg, ts_cpu_avg, ts_prepacked_avg, ts_planned_avg, ts_hetero_avg, ts_gemm_avg;
     int success_flag = 1;
 
     /* 5. Matrix-Vector Multiplication Test */
@@ -619,14 +1981,14 @@ int main(void){
         }
 
         success_flag = 1;
-        ts_fpga = fpga_matvec(in_matrix1, in_vector, fpga_out_vector);
+        ts_fpga = fpga_matvec(dev, in_matrix1, in_vector, fpga_out_vector);
         ts_cpu = cpu_matvec(in_matrix1, in_vector, cpu_out_vector, SIZE, SIZE);
 
         timespec_add(&ts_fpga_avg, &ts_fpga);
         timespec_add(&ts_cpu_avg, &ts_cpu);
 
         for (int j=0; j < SIZE; j++){
-            if(abs((fpga_out_vector[j] - cpu_out_vector[j]))/cpu_out_vector[j] > DIFF_THRESHOLD){
+            if (output_differs(fpga_out_vector[j], cpu_out_vector[j])){
                 printf("%2dth element Differ - FPGA: %f CPU: %f Diff: %f\n", j, fpga_out_vector[j], cpu_out_vector[j], (fpga_out_vector[j] - cpu_out_vector[j])/cpu_out_vector[j]);
                 success_flag = 0;
             }
@@ -653,13 +2015,92 @@ int main(void){
     /* 5-2. Matrix-Vector Multiplication in Verbose Mode */
     for (int p=0; p <NUM_REPEAT; p++){
         printf("%dth iteration...\n", p);
-        fpga_matvec_verbose(in_matrix1, in_vector, fpga_out_vector);
+        fpga_matvec_verbose(dev, in_matrix1, in_vector, fpga_out_vector);
+    }
+
+    /* 5-3. Matrix-Vector Multiplication against weights resident in BRAM (matrix uploaded only once) */
+    printf("Performing Resident Matrix-Vector Multiplication Test...\n");
+    timespec_init(&ts_fpga_avg);
+    success_flag = 1;
+
+    for (int p = 0; p < NUM_REPEAT; p++){
+        for (int i=0; i < SIZE; i++){
+            in_vector[i] = (rand()%10000 + 1) * 0.001f;
+            cpu_out_vector[i] = 0.0f;
+        }
+
+        ts_fpga = fpga_large_matvec_resident(dev, in_matrix1, 1, in_vector, fpga_out_vector, SIZE, SIZE);
+        cpu_matvec(in_matrix1, in_vector, cpu_out_vector, SIZE, SIZE);
+        timespec_add(&ts_fpga_avg, &ts_fpga);
+
+        for (int j=0; j < SIZE; j++){
+            if (output_differs(fpga_out_vector[j], cpu_out_vector[j])){
+                printf("%2dth element Differ - FPGA: %f CPU: %f\n", j, fpga_out_vector[j], cpu_out_vector[j]);
+                success_flag = 0;
+            }
+        }
+    }
+
+    timespec_div(&ts_fpga_avg, NUM_REPEAT);
+    printf("Average time (FPGA, resident weights): %ld.%09ld seconds\n", ts_fpga_avg.tv_sec, ts_fpga_avg.tv_nsec);
+    if (success_flag){
+        printf("Resident Matrix-Vector Multiplication Test PASSED!\n");
+    }
+    else{
+        printf("Resident Matrix-Vector Multiplication Test FAILED!\n");
+        exit(1);
+    }
+
+    /* 5-4. Batched Matrix-Vector Multiplication: one matrix, NUM_BATCH vectors per call */
+    printf("Performing Batched Matrix-Vector Multiplication Test...\n");
+    float *batch_in = (float *) malloc(sizeof(float)*SIZE*NUM_BATCH);
+    float *batch_out = (float *) malloc(sizeof(float)*SIZE*NUM_BATCH);
+    const float *batch_in_ptrs[NUM_BATCH];
+    float *batch_out_ptrs[NUM_BATCH];
+    for (int k = 0; k < NUM_BATCH; k++){
+        batch_in_ptrs[k] = batch_in + SIZE*k;
+        batch_out_ptrs[k] = batch_out + SIZE*k;
+    }
+    timespec_init(&ts_fpga_avg);
+    success_flag = 1;
+
+    for (int p = 0; p < NUM_REPEAT; p++){
+        for (int i = 0; i < SIZE*NUM_BATCH; i++){
+            batch_in[i] = (rand()%10000 + 1) * 0.001f;
+        }
+
+        ts_fpga = fpga_matvec_batched(dev, in_matrix1, batch_in_ptrs, batch_out_ptrs, NUM_BATCH);
+        timespec_add(&ts_fpga_avg, &ts_fpga);
+
+        for (int k = 0; k < NUM_BATCH; k++){
+            cpu_matvec(in_matrix1, batch_in + SIZE*k, cpu_out_vector, SIZE, SIZE);
+            for (int j = 0; j < SIZE; j++){
+                if (output_differs(batch_out[SIZE*k + j], cpu_out_vector[j])){
+                    printf("vector %d, %2dth element Differ - FPGA: %f CPU: %f\n", k, j, batch_out[SIZE*k + j], cpu_out_vector[j]);
+                    success_flag = 0;
+                }
+            }
+        }
+    }
+
+    timespec_div(&ts_fpga_avg, NUM_REPEAT);
+    printf("Average time of %d vectors (FPGA, batched): %ld.%09ld seconds, %.0f vectors/s\n", NUM_BATCH,
+           ts_fpga_avg.tv_sec, ts_fpga_avg.tv_nsec, NUM_BATCH / (ts_fpga_avg.tv_sec + ts_fpga_avg.tv_nsec / 1e9));
+    free(batch_in);
+    free(batch_out);
+    if (success_flag){
+        printf("Batched Matrix-Vector Multiplication Test PASSED!\n");
+    }
+    else{
+        printf("Batched Matrix-Vector Multiplication Test FAILED!\n");
+        exit(1);
     }
 
     /* 6. Matirx-Matrix Multiplication Test */
     printf("Performing Matrix-Matrix Multiplication Test...\n");
     timespec_init(&ts_fpga_avg);
     timespec_init(&ts_cpu_avg);
+    timespec_init(&ts_gemm_avg);
 
     for (int p =0; p < NUM_REPEAT; p++){
         /* random initialization for input, zero initialization for output */        
@@ -671,21 +2112,32 @@ int main(void){
         }
 
         success_flag = 1;
-        ts_fpga = fpga_matmul(in_matrix1, in_matrix2, fpga_out_matrix);
+        ts_fpga = fpga_matmul(dev, in_matrix1, in_matrix2, fpga_out_matrix);
         ts_cpu = cpu_matmul(in_matrix1, in_matrix2, cpu_out_matrix, SIZE, SIZE, SIZE);
     
         timespec_add(&ts_fpga_avg, &ts_fpga);
         timespec_add(&ts_cpu_avg, &ts_cpu);
 
         for (int k=0; k < SIZE*SIZE; k++){
-            if(abs((fpga_out_matrix[k] - cpu_out_matrix[k]))/cpu_out_matrix[k] > DIFF_THRESHOLD){
+            if (output_differs(fpga_out_matrix[k], cpu_out_matrix[k])){
                 printf("%4dth element Differ - FPGA: %f CPU: %f Diff: %f\n", k, fpga_out_matrix[k], cpu_out_matrix[k], (fpga_out_matrix[k] - cpu_out_matrix[k])/cpu_out_matrix[k]);
                 success_flag = 0;
             }
          }
 
+        ts_gemm = cpu_gemm(cpu, in_matrix1, in_matrix2, fpga_out_matrix, SIZE, SIZE, SIZE);
+        timespec_add(&ts_gemm_avg, &ts_gemm);
+
+        for (int k=0; k < SIZE*SIZE; k++){
+            if (output_differs(fpga_out_matrix[k], cpu_out_matrix[k])){
+                printf("%4dth element Differ - CPU GEMM: %f CPU: %f\n", k, fpga_out_matrix[k], cpu_out_matrix[k]);
+                success_flag = 0;
+            }
+        }
+
          printf("Matrix-Matrix Multiplication(FPGA): %ld.%09ld seconds\n", ts_fpga.tv_sec, ts_fpga.tv_nsec);
          printf("Matrix-Matrix Multiplication(CPU) : %ld.%09ld seconds\n", ts_cpu.tv_sec, ts_cpu.tv_nsec);
+         printf("Matrix-Matrix Multiplication(CPU, GEMM): %ld.%09ld seconds\n", ts_gemm.tv_sec, ts_gemm.tv_nsec);
         if (success_flag){
             printf("Matrix-Matrix Multiplication Test PASSED!\n");
         }
@@ -701,6 +2153,15 @@ int main(void){
 
     printf("Average time (FPGA): %ld.%09ld seconds\n", ts_fpga_avg.tv_sec, ts_fpga_avg.tv_nsec);
     printf("Average time (CPU) : %ld.%09ld seconds\n", ts_cpu_avg.tv_sec, ts_cpu_avg.tv_nsec);
+    timespec_div(&ts_gemm_avg, NUM_REPEAT);
+    printf("Average time (CPU, GEMM): %ld.%09ld seconds\n", ts_gemm_avg.tv_sec, ts_gemm_avg.tv_nsec);
+
+    /* 6-2. Queued Matrix-Matrix Multiplication Test on HW logic built with the command queue (FPGA_CMD_QUEUE=1)
+     * the emulated consumer is tested at the start, without HW
+     */
+    if (getenv("FPGA_CMD_QUEUE") != NULL && atoi(getenv("FPGA_CMD_QUEUE")) != 0){
+        queued_matmul_test(cmd_queue_create(dev));
+    }
 
     /* variable setup and initialization for following tests */
     float in_large_vector[512];
@@ -711,10 +2172,22 @@ int main(void){
     float cpu_out_large_matrix[32*1024];
     float fpga_out_large_matrix[32*1024];
 
-    /* 7. Large Matrix-Vector Multiplication Test */
+    /* CPU+FPGA scheduler, FPGA_CPU_THREADS worker threads (default: one per other online CPU) */
+    const char *cpu_threads = getenv("FPGA_CPU_THREADS");
+    struct hetero_scheduler *hetero = hetero_create((cpu_threads != NULL) ? atoi(cpu_threads) : 0);
+
+    /* execution plans of the large shapes, saved for the next run */
+    struct offload_plan *matvec_plan = offload_plan_warm(dev, "matvec_784x512.plan", PLAN_MATVEC, 784, 512, 1, 0);
+    struct offload_plan *matmul_plan = offload_plan_warm(dev, "matmul_32x75x1024.plan", PLAN_MATMUL, 32, 75, 1024, 0);
+
+    /* 7. Large Matrix-Vector Multiplication Test (row-major, prepacked to tiles, and planned) */
     printf("Performing Large Matrix-Vector Multiplication Test...\n");
     timespec_init(&ts_fpga_avg);
     timespec_init(&ts_cpu_avg);
+    timespec_init(&ts_prepacked_avg);
+    timespec_init(&ts_planned_avg);
+    timespec_init(&ts_hetero_avg);
+    timespec_init(&ts_gemm_avg);
 
     for (int p =0; p < NUM_REPEAT; p++){
 
@@ -732,21 +2205,68 @@ int main(void){
 
         success_flag = 1;
 
-        ts_fpga = fpga_large_matvec_naive(in_large_matrix1, in_large_vector, fpga_out_large_vector, 784, 512);
+        ts_fpga = fpga_large_matvec_naive(dev, in_large_matrix1, in_large_vector, fpga_out_large_vector, 784, 512, NULL);
         ts_cpu = cpu_matvec(in_large_matrix1, in_large_vector, cpu_out_large_vector, 784, 512);
 
         timespec_add(&ts_fpga_avg, &ts_fpga);
         timespec_add(&ts_cpu_avg, &ts_cpu);
  
         for (int n = 0; n < 784; n++){
-            if(abs((fpga_out_large_vector[n] - cpu_out_large_vector[n]))/cpu_out_large_vector[n] > DIFF_THRESHOLD){
+            if (output_differs(fpga_out_large_vector[n], cpu_out_large_vector[n])){
                 printf("%4dth element Differ - FPGA: %f CPU: %f Diff: %f\n", n, fpga_out_large_vector[n], cpu_out_large_vector[n], (fpga_out_large_vector[n] - cpu_out_large_vector[n])/cpu_out_large_vector[n]);
                success_flag = 0;
             }
         }
+
+        /* weights prepacked once, outside of the measured time */
+        struct matrix *packed_matrix = fpga_prepack(dev, in_large_matrix1, 784, 512, MATRIX_TILED);
+        ts_prepacked = fpga_gemv(dev, packed_matrix, in_large_vector, fpga_out_large_vector);
+        timespec_add(&ts_prepacked_avg, &ts_prepacked);
+        matrix_free(packed_matrix);
+
+        for (int n = 0; n < 784; n++){
+            if (output_differs(fpga_out_large_vector[n], cpu_out_large_vector[n])){
+                printf("%4dth element Differ (prepacked) - FPGA: %f CPU: %f\n", n, fpga_out_large_vector[n], cpu_out_large_vector[n]);
+               success_flag = 0;
+            }
+        }
+        printf("Large Matrix-Vector Multiplication(FPGA, prepacked): %ld.%09ld seconds\n", ts_prepacked.tv_sec, ts_prepacked.tv_nsec);
+
+        ts_planned = offload_execute(matvec_plan, in_large_matrix1, in_large_vector, fpga_out_large_vector);
+        timespec_add(&ts_planned_avg, &ts_planned);
+
+        for (int n = 0; n < 784; n++){
+            if (output_differs(fpga_out_large_vector[n], cpu_out_large_vector[n])){
+                printf("%4dth element Differ (planned) - FPGA: %f CPU: %f\n", n, fpga_out_large_vector[n], cpu_out_large_vector[n]);
+               success_flag = 0;
+            }
+        }
+        printf("Large Matrix-Vector Multiplication(FPGA, planned): %ld.%09ld seconds\n", ts_planned.tv_sec, ts_planned.tv_nsec);
+
+        ts_hetero = fpga_hetero_matvec(dev, hetero, in_large_matrix1, in_large_vector, fpga_out_large_vector, 784, 512);
+        timespec_add(&ts_hetero_avg, &ts_hetero);
+
+        for (int n = 0; n < 784; n++){
+            if (output_differs(fpga_out_large_vector[n], cpu_out_large_vector[n])){
+                printf("%4dth element Differ (CPU+FPGA) - FPGA: %f CPU: %f\n", n, fpga_out_large_vector[n], cpu_out_large_vector[n]);
+               success_flag = 0;
+            }
+        }
+        printf("Large Matrix-Vector Multiplication(CPU+FPGA): %ld.%09ld seconds\n", ts_hetero.tv_sec, ts_hetero.tv_nsec);
     
+        ts_gemm = cpu_gemv(cpu, in_large_matrix1, in_large_vector, fpga_out_large_vector, 784, 512, CPU_SUM_FAST);
+        timespec_add(&ts_gemm_avg, &ts_gemm);
+
+        for (int n = 0; n < 784; n++){
+            if (output_differs(fpga_out_large_vector[n], cpu_out_large_vector[n])){
+                printf("%4dth element Differ - CPU GEMV: %f CPU: %f\n", n, fpga_out_large_vector[n], cpu_out_large_vector[n]);
+               success_flag = 0;
+            }
+        }
+
         printf("Large Matrix-Vector Multiplication(FPGA): %ld.%09ld seconds\n", ts_fpga.tv_sec, ts_fpga.tv_nsec);
         printf("Large Matrix-Vector Multiplication(CPU) : %ld.%09ld seconds\n", ts_cpu.tv_sec, ts_cpu.tv_nsec);
+        printf("Large Matrix-Vector Multiplication(CPU, GEMV): %ld.%09ld seconds\n", ts_gemm.tv_sec, ts_gemm.tv_nsec);
         if (success_flag){
             printf("Large Matrix-Vector Multiplication Test PASSED!\n");
         }
@@ -761,12 +2281,97 @@ int main(void){
 
     printf("Average time (FPGA): %ld.%09ld seconds\n", ts_fpga_avg.tv_sec, ts_fpga_avg.tv_nsec);
     printf("Average time (CPU) : %ld.%09ld seconds\n", ts_cpu_avg.tv_sec, ts_cpu_avg.tv_nsec);
+    timespec_div(&ts_prepacked_avg, NUM_REPEAT);
+    printf("Average time (FPGA, prepacked): %ld.%09ld seconds\n", ts_prepacked_avg.tv_sec, ts_prepacked_avg.tv_nsec);
+    timespec_div(&ts_planned_avg, NUM_REPEAT);
+    printf("Average time (FPGA, planned): %ld.%09ld seconds\n", ts_planned_avg.tv_sec, ts_planned_avg.tv_nsec);
+    timespec_div(&ts_hetero_avg, NUM_REPEAT);
+    printf("Average time (CPU+FPGA): %ld.%09ld seconds\n", ts_hetero_avg.tv_sec, ts_hetero_avg.tv_nsec);
+    timespec_div(&ts_gemm_avg, NUM_REPEAT);
+    printf("Average time (CPU, GEMV): %ld.%09ld seconds\n", ts_gemm_avg.tv_sec, ts_gemm_avg.tv_nsec);
+
+
+    /* 7-2. Reduced-Precision Matrix-Vector Multiplication Test on the format build (FPGA_FORMATS=1)
+     * the software model of the format build is tested at the start, without HW
+     */
+    if (getenv("FPGA_FORMATS") != NULL && atoi(getenv("FPGA_FORMATS")) != 0){
+        dev->packed_formats = 1;
+        format_matvec_test(dev, cost);
+    }
+
+    /* 7-3. Sparse Matrix-Vector Multiplication Test: CSR matrices packed to slabs, against the CPU CSR SpMV */
+    printf("Performing Sparse Matrix-Vector Multiplication Test...\n");
+    {
+        static const double sparse_densities[] = {0.05, 0.01, 0.001};
+        const int num_row = 2048, num_col = 2048;
+        float *dense_matrix = (float *) malloc(sizeof(float) * num_row * num_col);
+        float *sparse_vector = (float *) malloc(sizeof(float) * num_col);
+        float *cpu_out = (float *) malloc(sizeof(float) * num_row);
+        float *spmv_out = (float *) malloc(sizeof(float) * num_row);
+        float *fpga_out = (float *) malloc(sizeof(float) * num_row);
+        assert(dense_matrix && sparse_vector && cpu_out && spmv_out && fpga_out);
+
+        success_flag = 1;
+        for (int d = 0; d < (int) (sizeof(sparse_densities) / sizeof(sparse_densities[0])); d++){
+            for (int m = 0; m < num_row * num_col; m++){
+                dense_matrix[m] = (rand() < sparse_densities[d] * ((double) RAND_MAX + 1)) ? (rand()%10000 + 1) * 0.001f : 0.0f;
+            }
+            for (int m = 0; m < num_col; m++){
+                sparse_vector[m] = (rand()%10000 + 1) * 0.001f;
+            }
+
+            struct csr_matrix *csr = csr_from_dense(dense_matrix, num_row, num_col);
+            struct ell_slabs *slabs = fpga_sparse_prepack(dev, csr);
+
+            ts_cpu = cpu_matvec(dense_matrix, sparse_vector, cpu_out, num_row, num_col);
+            struct timespec ts_spmv = cpu_spmv(csr, sparse_vector, spmv_out);
+            ts_fpga = fpga_spmv(dev, slabs, sparse_vector, fpga_out);
+
+            for (int n = 0; n < num_row; n++){
+                if (output_differs(fpga_out[n], cpu_out[n]) || output_differs(spmv_out[n], cpu_out[n])){
+                    printf("%4dth element Differ (sparse) - FPGA: %f CPU SpMV: %f CPU: %f\n", n, fpga_out[n], spmv_out[n], cpu_out[n]);
+                    success_flag = 0;
+                }
+            }
 
+            /* every op moves the vector, one matrix tile and the output */
+            uint64_t op_bytes = 0x0004*(SIZE + SIZE*SIZE + SIZE);
+            uint64_t dense_ops = (uint64_t) ((num_row + SIZE - 1) / SIZE) * ((num_col + SIZE - 1) / SIZE);
+            printf("Sparse Matrix-Vector Multiplication %d*%d, %d nonzeros (%.2f%%): %d slabs (%.1f nonzeros per slab), %llu bytes moved vs %llu dense (%.2fx less)\n",
+                   num_row, num_col, csr->nnz, 100.0 * csr->nnz / ((double) num_row * num_col), slabs->num_slabs,
+                   (slabs->num_slabs > 0) ? (double) csr->nnz / slabs->num_slabs : 0.0, (unsigned long long) (op_bytes * slabs->num_slabs),
+                   (unsigned long long) (op_bytes * dense_ops), (slabs->num_slabs > 0) ? (double) dense_ops / slabs->num_slabs : 0.0);
+            printf("Sparse Matrix-Vector Multiplication(FPGA, slabs): %ld.%09ld seconds\n", ts_fpga.tv_sec, ts_fpga.tv_nsec);
+            printf("Sparse Matrix-Vector Multiplication(CPU, CSR)   : %ld.%09ld seconds\n", ts_spmv.tv_sec, ts_spmv.tv_nsec);
+            printf("Sparse Matrix-Vector Multiplication(CPU, dense) : %ld.%09ld seconds\n", ts_cpu.tv_sec, ts_cpu.tv_nsec);
+
+            ell_free(slabs);
+            csr_free(csr);
+        }
+
+        free(dense_matrix);
+        free(sparse_vector);
+        free(cpu_out);
+        free(spmv_out);
+        free(fpga_out);
+
+        if (success_flag){
+            printf("Sparse Matrix-Vector Multiplication Test PASSED!\n");
+        }
+        else{
+            printf("Sparse Matrix-Vector Multiplication Test FAILED!\n");
+            exit(1);
+        }
+    }
 
-    /* 8. Large Matrix-Matrix Multiplication Test */ 
+    /* 8. Large Matrix-Matrix Multiplication Test (row-major, matrix2 prepacked to transposed tiles, and planned) */ 
     printf("Performing Large Matrix-Matrix Multiplication Test...\n");
     timespec_init(&ts_fpga_avg);
     timespec_init(&ts_cpu_avg);
+    timespec_init(&ts_gemm_avg);
+    timespec_init(&ts_prepacked_avg);
+    timespec_init(&ts_planned_avg);
+    timespec_init(&ts_hetero_avg);
 
     for (int p =0; p < NUM_REPEAT; p++){
 
@@ -784,21 +2389,70 @@ int main(void){
  
         success_flag = 1;
 
-        ts_fpga = fpga_large_matmul_naive2(in_large_matrix1, in_large_matrix2, fpga_out_large_matrix, 32, 75, 1024);
+        ts_fpga = fpga_large_matmul_naive2(dev, in_large_matrix1, in_large_matrix2, fpga_out_large_matrix, 32, 75, 1024, NULL, NULL);
         ts_cpu = cpu_matmul(in_large_matrix1, in_large_matrix2, cpu_out_large_matrix, 32, 75, 1024);
 
         timespec_add(&ts_fpga_avg, &ts_fpga);
         timespec_add(&ts_cpu_avg, &ts_cpu);
  
         for (int q = 0; q < 32*1024; q++){
-           if(abs((fpga_out_large_matrix[q] - cpu_out_large_matrix[q]))/cpu_out_large_matrix[q] > DIFF_THRESHOLD){
+           if (output_differs(fpga_out_large_matrix[q], cpu_out_large_matrix[q])){
                printf("%5dth element Differ - FPGA: %f CPU: %f Diff: %f\n", q, fpga_out_large_matrix[q], cpu_out_large_matrix[q], (fpga_out_large_matrix[q] - cpu_out_large_matrix[q])/cpu_out_large_matrix[q]);
               success_flag = 0; 
             }
         }
 
+        /* matrix2 prepacked once, outside of the measured time */
+        struct matrix view_matrix1;
+        matrix_view(&view_matrix1, in_large_matrix1, 32, 75);
+        struct matrix *packed_matrix2 = fpga_prepack(dev, in_large_matrix2, 75, 1024, MATRIX_TILED_T);
+        ts_prepacked = fpga_gemm(dev, &view_matrix1, packed_matrix2, fpga_out_large_matrix);
+        timespec_add(&ts_prepacked_avg, &ts_prepacked);
+        matrix_free(packed_matrix2);
+
+        for (int q = 0; q < 32*1024; q++){
+           if (output_differs(fpga_out_large_matrix[q], cpu_out_large_matrix[q])){
+               printf("%5dth element Differ (prepacked) - FPGA: %f CPU: %f\n", q, fpga_out_large_matrix[q], cpu_out_large_matrix[q]);
+              success_flag = 0; 
+            }
+        }
+        printf("Large Matrix-Matrix Multiplication(FPGA, prepacked): %ld.%09ld seconds\n", ts_prepacked.tv_sec, ts_prepacked.tv_nsec);
+
+        ts_planned = offload_execute(matmul_plan, in_large_matrix1, in_large_matrix2, fpga_out_large_matrix);
+        timespec_add(&ts_planned_avg, &ts_planned);
+
+        for (int q = 0; q < 32*1024; q++){
+           if (output_differs(fpga_out_large_matrix[q], cpu_out_large_matrix[q])){
+               printf("%5dth element Differ (planned) - FPGA: %f CPU: %f\n", q, fpga_out_large_matrix[q], cpu_out_large_matrix[q]);
+              success_flag = 0; 
+            }
+        }
+        printf("Large Matrix-Matrix Multiplication(FPGA, planned): %ld.%09ld seconds\n", ts_planned.tv_sec, ts_planned.tv_nsec);
+
+        ts_hetero = fpga_hetero_matmul(dev, hetero, in_large_matrix1, in_large_matrix2, fpga_out_large_matrix, 32, 75, 1024);
+        timespec_add(&ts_hetero_avg, &ts_hetero);
+
+        for (int q = 0; q < 32*1024; q++){
+           if (output_differs(fpga_out_large_matrix[q], cpu_out_large_matrix[q])){
+               printf("%5dth element Differ (CPU+FPGA) - FPGA: %f CPU: %f\n", q, fpga_out_large_matrix[q], cpu_out_large_matrix[q]);
+              success_flag = 0; 
+            }
+        }
+        printf("Large Matrix-Matrix Multiplication(CPU+FPGA): %ld.%09ld seconds\n", ts_hetero.tv_sec, ts_hetero.tv_nsec);
+
+        ts_gemm = cpu_gemm(cpu, in_large_matrix1, in_large_matrix2, fpga_out_large_matrix, 32, 75, 1024);
+        timespec_add(&ts_gemm_avg, &ts_gemm);
+
+        for (int q = 0; q < 32*1024; q++){
+           if (output_differs(fpga_out_large_matrix[q], cpu_out_large_matrix[q])){
+               printf("%5dth element Differ - CPU GEMM: %f CPU: %f\n", q, fpga_out_large_matrix[q], cpu_out_large_matrix[q]);
+              success_flag = 0; 
+            }
+        }
+
         printf("Large Matrix-Matrix Multiplication(FPGA): %ld.%09ld seconds\n", ts_fpga.tv_sec, ts_fpga.tv_nsec);
         printf("Large Matrix-Matrix Multiplication(CPU) : %ld.%09ld seconds\n", ts_cpu.tv_sec, ts_cpu.tv_nsec);    
+        printf("Large Matrix-Matrix Multiplication(CPU, GEMM): %ld.%09ld seconds\n", ts_gemm.tv_sec, ts_gemm.tv_nsec);
         if (success_flag){
             printf("Large Matrix-Matrix Multiplication Test PASSED!\n");
         }
@@ -813,8 +2467,75 @@ int main(void){
 
     printf("Average time (FPGA): %ld.%09ld seconds\n", ts_fpga_avg.tv_sec, ts_fpga_avg.tv_nsec);
     printf("Average time (CPU) : %ld.%09ld seconds\n", ts_cpu_avg.tv_sec, ts_cpu_avg.tv_nsec);
+    timespec_div(&ts_prepacked_avg, NUM_REPEAT);
+    printf("Average time (FPGA, prepacked): %ld.%09ld seconds\n", ts_prepacked_avg.tv_sec, ts_prepacked_avg.tv_nsec);
+    timespec_div(&ts_planned_avg, NUM_REPEAT);
+    printf("Average time (FPGA, planned): %ld.%09ld seconds\n", ts_planned_avg.tv_sec, ts_planned_avg.tv_nsec);
+    timespec_div(&ts_hetero_avg, NUM_REPEAT);
+    printf("Average time (CPU+FPGA): %ld.%09ld seconds\n", ts_hetero_avg.tv_sec, ts_hetero_avg.tv_nsec);
+    timespec_div(&ts_gemm_avg, NUM_REPEAT);
+    printf("Average time (CPU, GEMM): %ld.%09ld seconds\n", ts_gemm_avg.tv_sec, ts_gemm_avg.tv_nsec);
+
+    profile_block_sparse(dev);
+
+    /* 9. Dispatch Test: each shape runs where the cost model predicts it finishes first */
+    printf("Performing Dispatch Test...\n");
+    {
+        /* matvec: M, K, 0; matmul: M, K, N */
+        static const int shapes[][3] = {{8, 8, 0}, {64, 64, 0}, {784, 512, 0}, {8, 8, 8}, {64, 64, 64}, {32, 75, 1024}};
+        int success_flag = 1;
+
+        for (int s = 0; s < (int) (sizeof(shapes) / sizeof(shapes[0])); s++){
+            int M = shapes[s][0], K = shapes[s][1], N = shapes[s][2];
+            int op = (N == 0) ? COST_OP_MATVEC : COST_OP_MATMUL;
+            int num_out = (N == 0) ? M : M * N;
+
+            if (N == 0){
+                ts_fpga = fpga_auto_matvec(dev, cost, in_large_matrix1, in_large_vector, fpga_out_large_vector, M, K);
+                cpu_matvec(in_large_matrix1, in_large_vector, cpu_out_large_vector, M, K);
+            }
+            else{
+                ts_fpga = fpga_auto_matmul(dev, cost, in_large_matrix1, in_large_matrix2, fpga_out_large_matrix, M, K, N);
+                cpu_matmul(in_large_matrix1, in_large_matrix2, cpu_out_large_matrix, M, K, N);
+            }
+
+            float *out = (N == 0) ? fpga_out_large_vector : fpga_out_large_matrix;
+            float *ref = (N == 0) ? cpu_out_large_vector : cpu_out_large_matrix;
+            for (int q = 0; q < num_out; q++){
+                if (output_differs(out[q], ref[q])){
+                    printf("%5dth element Differ - Dispatched: %f CPU: %f\n", q, out[q], ref[q]);
+                    success_flag = 0;
+                }
+            }
+            printf("%s %dx%dx%d: predicted CPU %.9f s, FPGA %.9f s, dispatched: %ld.%09ld seconds\n",
+                   (N == 0) ? "matvec" : "matmul", M, K, (N == 0) ? 1 : N,
+                   cost_model_cpu(cost, op, M, K, N), cost_model_fpga(cost, op, M, K, N), ts_fpga.tv_sec, ts_fpga.tv_nsec);
+        }
+        if (success_flag){
+            printf("Dispatch Test PASSED!\n");
+        }
+        else{
+            printf("Dispatch Test FAILED!\n");
+            exit(1);
+        }
+    }
 
     printf("Passed all functionality test!\n");
 
+    offload_plan_destroy(matvec_plan);
+    offload_plan_destroy(matmul_plan);
+    hetero_print_stats(hetero);
+    hetero_destroy(hetero);
+    cost_model_print(cost);
+    cost_model_destroy(cost);
+    cpu_backend_print_stats(cpu);
+    cpu_backend_destroy(cpu);
+
+    for (int d = 0; d < num_devices; d++){
+        fpga_device_print_stats(devices[d]);
+        fpga_device_close(devices[d]);
+    }
+    dma_pool_release();
+
     return 0;
 }
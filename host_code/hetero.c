@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "hetero.h"
+#include "utils.h"
+
+#define HETERO_ALPHA 0.25 // weight of the newest throughput sample
+
+/* shared state of one hetero_run call */
+struct hetero_work {
+    pthread_mutex_t lock;
+    int lo; // next block of the FPGA
+    int hi; // one past the next block of the CPU
+    int split; // planned boundary between FPGA and CPU blocks
+    hetero_fn cpu_fn;
+    void *arg;
+    int cpu_blocks;
+    int stolen;
+    struct timespec ts_start;
+    double cpu_end; // seconds from ts_start until the last CPU block was done
+};
+
+static double elapsed_seconds(const struct timespec *ts_start){
+
+    struct timespec ts_now;
+    clock_gettime(CLOCK_MONOTONIC, &ts_now);
+    timespec_sub(&ts_now, ts_start);
+    return ts_now.tv_sec + ts_now.tv_nsec / 1e9;
+}
+
+/* CPU side of one call: single blocks from the back until the range is empty */
+static void hetero_cpu_blocks(struct hetero_work *work){
+
+    while (1){
+        pthread_mutex_lock(&work->lock);
+        if (work->lo == work->hi){
+            pthread_mutex_unlock(&work->lock);
+            break;
+        }
+        int block = --work->hi;
+        work->cpu_blocks++;
+        if (block < work->split){
+            work->stolen++;
+        }
+        pthread_mutex_unlock(&work->lock);
+
+        work->cpu_fn(work->arg, block, 1);
+
+        double end = elapsed_seconds(&work->ts_start);
+        pthread_mutex_lock(&work->lock);
+        if (end > work->cpu_end){
+            work->cpu_end = end;
+        }
+        pthread_mutex_unlock(&work->lock);
+    }
+}
+
+static void *hetero_cpu_worker(void *arg){
+
+    struct hetero_scheduler *hs = (struct hetero_scheduler *) arg;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&hs->lock);
+    while (1){
+        while (hs->generation == seen && !hs->quit){
+            pthread_cond_wait(&hs->start, &hs->lock);
+        }
+        if (hs->quit){
+            break;
+        }
+        seen = hs->generation;
+        struct hetero_work *work = hs->work;
+        pthread_mutex_unlock(&hs->lock);
+
+        hetero_cpu_blocks(work);
+
+        pthread_mutex_lock(&hs->lock);
+        if (--hs->num_busy == 0){
+            pthread_cond_signal(&hs->done);
+        }
+    }
+    pthread_mutex_unlock(&hs->lock);
+
+    return NULL;
+}
+
+/* num_threads CPU worker threads next to the FPGA, 0 for the number of online CPUs minus the calling thread */
+struct hetero_scheduler *hetero_create(int num_threads){
+
+    if (num_threads <= 0){
+        num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        if (num_threads < 1){
+            num_threads = 1;
+        }
+    }
+    if (num_threads > HETERO_MAX_THREADS){
+        num_threads = HETERO_MAX_THREADS;
+    }
+
+    struct hetero_scheduler *hs;
+    hs = (struct hetero_scheduler *) calloc(1, sizeof(struct hetero_scheduler));
+    assert(hs);
+    hs->num_threads = num_threads;
+
+    pthread_mutex_init(&hs->lock, NULL);
+    pthread_cond_init(&hs->start, NULL);
+    pthread_cond_init(&hs->done, NULL);
+    for (int i = 0; i < num_threads; i++){
+        if (pthread_create(&hs->threads[i], NULL, hetero_cpu_worker, hs) != 0){
+            printf("ERROR: hetero CPU worker thread could not be created\n");
+            exit(1);
+        }
+    }
+
+    return hs;
+}
+
+void hetero_destroy(struct hetero_scheduler *hs){
+
+    if (hs == NULL){
+        return;
+    }
+
+    pthread_mutex_lock(&hs->lock);
+    hs->quit = 1;
+    pthread_cond_broadcast(&hs->start);
+    pthread_mutex_unlock(&hs->lock);
+    for (int i = 0; i < hs->num_threads; i++){
+        pthread_join(hs->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&hs->done);
+    pthread_cond_destroy(&hs->start);
+    pthread_mutex_destroy(&hs->lock);
+    free(hs);
+}
+
+/* runs num_blocks blocks of one kind of work on the FPGA and the CPU threads together
+ * returns total execution time
+ */
+struct timespec hetero_run(struct hetero_scheduler *hs, int kind, int num_blocks, hetero_fn fpga_fn, hetero_fn cpu_fn, void *arg){
+
+    assert(kind >= 0 && kind < HETERO_MAX_KINDS);
+
+    struct timespec ts_start, ts_end;
+    struct hetero_rate *rate = &hs->rate[kind];
+
+    /* share of the FPGA, even until both sides have been measured */
+    double share = 0.5;
+    if (rate->fpga > 0 && rate->cpu > 0){
+        share = rate->fpga / (rate->fpga + rate->cpu);
+    }
+
+    struct hetero_work work;
+    pthread_mutex_init(&work.lock, NULL);
+    work.lo = 0;
+    work.hi = num_blocks;
+    work.split = (int) (num_blocks * share + 0.5);
+    work.cpu_fn = cpu_fn;
+    work.arg = arg;
+    work.cpu_blocks = 0;
+    work.stolen = 0;
+    work.cpu_end = 0.0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+    work.ts_start = ts_start;
+
+    /* wake the CPU workers */
+    pthread_mutex_lock(&hs->lock);
+    hs->work = &work;
+    hs->num_busy = hs->num_threads;
+    hs->generation++;
+    pthread_cond_broadcast(&hs->start);
+    pthread_mutex_unlock(&hs->lock);
+
+    /* FPGA: guided chunks, half of the expected remaining share at a time, so that the end is shared fairly */
+    int fpga_blocks = 0;
+    double fpga_time = 0.0;
+    while (1){
+        pthread_mutex_lock(&work.lock);
+        int remaining = work.hi - work.lo;
+        if (remaining == 0){
+            pthread_mutex_unlock(&work.lock);
+            break;
+        }
+        int chunk = (int) (remaining * share / 2);
+        if (chunk < 1){
+            chunk = 1;
+        }
+        int first = work.lo;
+        work.lo += chunk;
+        if (first + chunk > work.split){
+            work.stolen += first + chunk - ((first > work.split) ? first : work.split);
+        }
+        pthread_mutex_unlock(&work.lock);
+
+        struct timespec ts_chunk;
+        clock_gettime(CLOCK_MONOTONIC, &ts_chunk);
+        fpga_fn(arg, first, chunk);
+        fpga_time += elapsed_seconds(&ts_chunk);
+        fpga_blocks += chunk;
+    }
+
+    pthread_mutex_lock(&hs->lock);
+    while (hs->num_busy > 0){
+        pthread_cond_wait(&hs->done, &hs->lock);
+    }
+    hs->work = NULL;
+    pthread_mutex_unlock(&hs->lock);
+    pthread_mutex_destroy(&work.lock);
+
+    /* learn the throughput of both sides, the CPU side was busy from the start until its last block was done */
+    if (fpga_blocks > 0 && fpga_time > 0){
+        double sample = fpga_blocks / fpga_time;
+        rate->fpga = (rate->fpga > 0) ? (1 - HETERO_ALPHA) * rate->fpga + HETERO_ALPHA * sample : sample;
+    }
+    if (work.cpu_blocks > 0){
+        double sample = work.cpu_blocks / work.cpu_end;
+        rate->cpu = (rate->cpu > 0) ? (1 - HETERO_ALPHA) * rate->cpu + HETERO_ALPHA * sample : sample;
+    }
+
+    hs->num_calls++;
+    hs->fpga_blocks += fpga_blocks;
+    hs->cpu_blocks += work.cpu_blocks;
+    hs->stolen_blocks += work.stolen;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    return ts_end;
+}
+
+void hetero_print_stats(const struct hetero_scheduler *hs){
+
+    uint64_t blocks = hs->fpga_blocks + hs->cpu_blocks;
+    printf("hetero: %d CPU threads, %llu calls, %llu blocks on FPGA (%.1f%%), %llu on CPU, %llu stolen\n",
+           hs->num_threads, (unsigned long long) hs->num_calls, (unsigned long long) hs->fpga_blocks,
+           blocks ? 100.0 * hs->fpga_blocks / blocks : 0.0, (unsigned long long) hs->cpu_blocks,
+           (unsigned long long) hs->stolen_blocks);
+    for (int k = 0; k < HETERO_MAX_KINDS; k++){
+        if (hs->rate[k].fpga > 0 || hs->rate[k].cpu > 0){
+            printf("hetero: kind %d, FPGA %.1f blocks/s, CPU %.1f blocks/s\n", k, hs->rate[k].fpga, hs->rate[k].cpu);
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef HETERO_H
+#define HETERO_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define HETERO_MAX_THREADS 16
+#define HETERO_MAX_KINDS 4 // kinds of work with their own learned split (e.g. matvec, matmul)
+
+/* processes count blocks from block first, e.g. rows first*SIZE ~ (first+count)*SIZE-1 of a matrix */
+typedef void (*hetero_fn)(void *arg, int first, int count);
+
+/* learned throughput of both sides for one kind of work, in blocks per second */
+struct hetero_rate {
+    double fpga;
+    double cpu; // all CPU threads together
+};
+
+struct hetero_work;
+
+/* cooperative CPU+FPGA scheduler
+ * blocks of one call form a range: the FPGA (calling thread) takes chunks from the front, sized by its learned share,
+ * and CPU worker threads take single blocks from the back, so that both sides keep stealing until they meet
+ * the CPU worker threads are created once by hetero_create and wait for the next call in between
+ */
+struct hetero_scheduler {
+    int num_threads; // CPU worker threads
+    struct hetero_rate rate[HETERO_MAX_KINDS];
+
+    pthread_t threads[HETERO_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t start; // a new call for the workers
+    pthread_cond_t done; // a worker finished the call
+    uint64_t generation; // number of calls started
+    int num_busy; // workers still on the current call
+    int quit;
+    struct hetero_work *work; // shared state of the current call
+
+    uint64_t num_calls;
+    uint64_t fpga_blocks;
+    uint64_t cpu_blocks;
+    uint64_t stolen_blocks; // blocks done by the other side than the learned split planned
+};
+
+struct hetero_scheduler *hetero_create(int num_threads);
+
+void hetero_destroy(struct hetero_scheduler *hs);
+
+struct timespec hetero_run(struct hetero_scheduler *hs, int kind, int num_blocks, hetero_fn fpga_fn, hetero_fn cpu_fn, void *arg);
+
+void hetero_print_stats(const struct hetero_scheduler *hs);
+
+#endif
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "irq_events.h"
+
+static struct irq_source *irq_source_init(int fd, int read_size, int own_fd){
+
+    struct irq_source *src;
+    src = (struct irq_source *) calloc(1, sizeof(struct irq_source));
+    assert(src);
+
+    src->fd = fd;
+    src->read_size = read_size;
+    src->own_fd = own_fd;
+
+    src->epfd = epoll_create1(0);
+    assert(src->epfd >= 0);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    int rc = epoll_ctl(src->epfd, EPOLL_CTL_ADD, fd, &ev);
+    assert(rc == 0);
+
+    return src;
+}
+
+/* opens a user interrupt events device, e.g. "/dev/xdma0_events_0"
+ * returns NULL if the device can not be opened
+ */
+struct irq_source *irq_source_open(const char *eventsDevice){
+
+    int fd = open(eventsDevice, O_RDONLY);
+    if (fd < 0){
+        return NULL;
+    }
+    return irq_source_init(fd, 4, 1);
+}
+
+/* wraps an already opened fd (e.g. an eventfd with read_size 8), the fd stays owned by the caller */
+struct irq_source *irq_source_from_fd(int fd, int read_size){
+    return irq_source_init(fd, read_size, 0);
+}
+
+void irq_source_close(struct irq_source *src){
+
+    if (src == NULL){
+        return;
+    }
+    close(src->epfd);
+    if (src->own_fd){
+        close(src->fd);
+    }
+    free(src);
+}
+
+/* blocks in epoll_wait until an interrupt is latched, then consumes it
+ * timeout_ns of 0 waits forever
+ * returns 0 on interrupt (latched events in *events if not NULL), -1 on timeout or error
+ */
+int irq_source_wait(struct irq_source *src, uint64_t timeout_ns, uint32_t *events){
+
+    int timeout_ms = (timeout_ns > 0) ? (int) ((timeout_ns + 999999) / 1000000) : -1;
+    struct epoll_event ev;
+
+    while (1){
+        int rc = epoll_wait(src->epfd, &ev, 1, timeout_ms);
+        if (rc < 0 && errno == EINTR){
+            continue;
+        }
+        if (rc <= 0){
+            return -1;
+        }
+        break;
+    }
+
+    uint64_t value = 0;
+    if (read(src->fd, &value, src->read_size) != src->read_size){
+        return -1;
+    }
+    src->num_events++;
+    if (events != NULL){
+        *events = (uint32_t) value;
+    }
+
+    return 0;
+}
+
+static void *irq_dispatcher_thread(void *arg){
+
+    struct irq_dispatcher *d = (struct irq_dispatcher *) arg;
+    struct epoll_event ev;
+
+    /* the stop eventfd shares the epoll set of the source */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = d->stop_fd;
+    epoll_ctl(d->src->epfd, EPOLL_CTL_ADD, d->stop_fd, &ev);
+
+    while (1){
+        int rc = epoll_wait(d->src->epfd, &ev, 1, -1);
+        if (rc < 0 && errno == EINTR){
+            continue;
+        }
+        if (rc <= 0 || ev.data.fd == d->stop_fd){
+            break;
+        }
+
+        uint64_t value = 0;
+        if (read(d->src->fd, &value, d->src->read_size) != d->src->read_size){
+            continue;
+        }
+
+        pthread_mutex_lock(&d->lock);
+        d->src->num_events++;
+        d->generation++;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    epoll_ctl(d->src->epfd, EPOLL_CTL_DEL, d->stop_fd, NULL);
+
+    return NULL;
+}
+
+/* starts a poller thread on src, waiters are woken through irq_dispatcher_wait */
+struct irq_dispatcher *irq_dispatcher_create(struct irq_source *src){
+
+    struct irq_dispatcher *d;
+    d = (struct irq_dispatcher *) calloc(1, sizeof(struct irq_dispatcher));
+    assert(d);
+
+    d->src = src;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&d->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    d->stop_fd = eventfd(0, 0);
+    assert(d->stop_fd >= 0);
+
+    int rc = pthread_create(&d->thread, NULL, irq_dispatcher_thread, d);
+    assert(rc == 0);
+
+    return d;
+}
+
+void irq_dispatcher_destroy(struct irq_dispatcher *d){
+
+    if (d == NULL){
+        return;
+    }
+    uint64_t one = 1;
+    if (write(d->stop_fd, &one, sizeof(one)) != sizeof(one)){
+        printf("Error: failed to stop the interrupt poller thread\n");
+    }
+    pthread_join(d->thread, NULL);
+
+    close(d->stop_fd);
+    pthread_cond_destroy(&d->cond);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
+
+/* generation to pass to irq_dispatcher_wait, must be taken before the op is kicked */
+uint64_t irq_dispatcher_generation(struct irq_dispatcher *d){
+
+    pthread_mutex_lock(&d->lock);
+    uint64_t generation = d->generation;
+    pthread_mutex_unlock(&d->lock);
+
+    return generation;
+}
+
+/* blocks until an interrupt arrived after seen_generation
+ * timeout_ns of 0 waits forever
+ * returns 0 on interrupt, -1 on timeout
+ */
+int irq_dispatcher_wait(struct irq_dispatcher *d, uint64_t seen_generation, uint64_t timeout_ns){
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ns / 1000000000ULL;
+    deadline.tv_nsec += timeout_ns % 1000000000ULL;
+    if (deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int rc = 0;
+    pthread_mutex_lock(&d->lock);
+    while (d->generation == seen_generation){
+        if (timeout_ns == 0){
+            pthread_cond_wait(&d->cond, &d->lock);
+        }
+        else if (pthread_cond_timedwait(&d->cond, &d->lock, &deadline) == ETIMEDOUT){
+            rc = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return rc;
+}
@@ -0,0 +1,45 @@
+#ifndef IRQ_EVENTS_H
+#define IRQ_EVENTS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* user interrupt events of xdma (/dev/xdma0_events_N)
+ * char_events_poll reports the device readable once an interrupt is latched, char_events_read returns
+ * and clears the latched events (4 bytes); an eventfd (8 bytes) can stand in for the device
+ */
+struct irq_source {
+    int fd;
+    int epfd;
+    int read_size;
+    int own_fd;
+    uint64_t num_events;
+};
+
+/* one poller thread blocks on an irq_source and wakes every waiting thread */
+struct irq_dispatcher {
+    struct irq_source *src;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t generation; // incremented on every interrupt
+    int stop_fd; // eventfd used to stop the poller thread
+};
+
+struct irq_source *irq_source_open(const char *eventsDevice);
+
+struct irq_source *irq_source_from_fd(int fd, int read_size);
+
+void irq_source_close(struct irq_source *src);
+
+int irq_source_wait(struct irq_source *src, uint64_t timeout_ns, uint32_t *events);
+
+struct irq_dispatcher *irq_dispatcher_create(struct irq_source *src);
+
+void irq_dispatcher_destroy(struct irq_dispatcher *d);
+
+uint64_t irq_dispatcher_generation(struct irq_dispatcher *d);
+
+int irq_dispatcher_wait(struct irq_dispatcher *d, uint64_t seen_generation, uint64_t timeout_ns);
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "matrix.h"
+#include "dma_pool.h"
+
+/* versions are unique over all matrices, so that a new matrix at the address of a freed one never matches its tiles */
+static uint64_t matrix_versions = 0;
+
+/* wraps row-major caller memory without copying */
+void matrix_view(struct matrix *m, float *data, int num_row, int num_col){
+
+    memset(m, 0, sizeof(struct matrix));
+    m->layout = MATRIX_ROW_MAJOR;
+    m->num_row = num_row;
+    m->num_col = num_col;
+    m->data = data;
+}
+
+/* converts the row-major num_row*num_col matrix src to a tiled layout (MATRIX_TILED or MATRIX_TILED_T)
+ * tiles start at page_offset within a page, so that a tile is a zero-copy DMA to a device address with the same offset
+ */
+struct matrix *matrix_prepack(const float *src, int num_row, int num_col, int tile, int layout, uint32_t page_offset){
+
+    assert(layout == MATRIX_TILED || layout == MATRIX_TILED_T);
+    assert(page_offset < 0x1000);
+
+    struct matrix *m;
+    m = (struct matrix *) calloc(1, sizeof(struct matrix));
+    assert(m);
+
+    m->layout = layout;
+    m->num_row = num_row;
+    m->num_col = num_col;
+    m->tile = tile;
+    m->num_tile_row = (num_row + tile - 1) / tile;
+    m->num_tile_col = (num_col + tile - 1) / tile;
+
+    size_t size = sizeof(float) * tile * tile * m->num_tile_row * m->num_tile_col;
+    m->allocated = (char *) dma_pool_alloc(size + page_offset);
+    m->data = (float *) (m->allocated + page_offset);
+
+    matrix_repack(m, src);
+
+    return m;
+}
+
+/* copies new contents of the same shape into a tiled matrix */
+void matrix_repack(struct matrix *m, const float *src){
+
+    assert(m->layout != MATRIX_ROW_MAJOR);
+
+    int tile = m->tile;
+    for (int ti = 0; ti < m->num_tile_row; ti++){
+        int rows = (m->num_row - ti*tile < tile) ? m->num_row - ti*tile : tile;
+
+        for (int tj = 0; tj < m->num_tile_col; tj++){
+            int cols = (m->num_col - tj*tile < tile) ? m->num_col - tj*tile : tile;
+            float *dst = matrix_tile(m, ti, tj);
+            const float *block = src + (size_t) m->num_col * ti*tile + tj*tile;
+
+            /* only edge tiles have padding */
+            if (rows < tile || cols < tile){
+                memset(dst, 0, sizeof(float) * tile * tile);
+            }
+
+            if (m->layout == MATRIX_TILED){
+                for (int p = 0; p < rows; p++){
+                    memcpy(dst + tile*p, block + (size_t) m->num_col * p, sizeof(float) * cols);
+                }
+            }
+            else{
+                for (int p = 0; p < rows; p++){
+                    for (int q = 0; q < cols; q++){
+                        dst[tile*q + p] = block[(size_t) m->num_col * p + q];
+                    }
+                }
+            }
+        }
+    }
+
+    m->version = __atomic_add_fetch(&matrix_versions, 1, __ATOMIC_RELAXED);
+}
+
+void matrix_free(struct matrix *m){
+
+    if (m == NULL){
+        return;
+    }
+    dma_pool_free(m->allocated);
+    free(m);
+}
+
+/* first number of tile (tile_row, tile_col), tile*tile numbers follow */
+float *matrix_tile(const struct matrix *m, int tile_row, int tile_col){
+    return m->data + (size_t) m->tile * m->tile * (tile_row * m->num_tile_col + tile_col);
+}
@@ -0,0 +1,35 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <stdint.h>
+
+#define MATRIX_ROW_MAJOR 0 // plain row-major view of caller memory
+#define MATRIX_TILED 1 // tile-major, every tile row-major and zero-padded to tile*tile
+#define MATRIX_TILED_T 2 // tile-major, every tile stored transposed (prepacked B of matmul)
+
+/* matrix operand of the offload functions
+ * tiled layouts are produced once by matrix_prepack, so that each tile is one contiguous DMA
+ */
+struct matrix {
+    int layout;
+    int num_row;
+    int num_col;
+    int tile; // tile edge of the tiled layouts
+    int num_tile_row;
+    int num_tile_col;
+    float *data; // row-major data, or first tile
+    char *allocated; // NULL for views
+    uint64_t version; // renewed whenever the contents change (BRAM residency key), 0 for views
+};
+
+void matrix_view(struct matrix *m, float *data, int num_row, int num_col);
+
+struct matrix *matrix_prepack(const float *src, int num_row, int num_col, int tile, int layout, uint32_t page_offset);
+
+void matrix_repack(struct matrix *m, const float *src);
+
+void matrix_free(struct matrix *m);
+
+float *matrix_tile(const struct matrix *m, int tile_row, int tile_col);
+
+#endif
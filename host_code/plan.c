@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "plan.h"
+#include "dma_pool.h"
+
+#define PLAN_MAGIC "FPGAPLAN"
+#define PLAN_FORMAT 1 // bumped whenever struct plan_header or struct plan_step changes
+
+/* on-disk header, followed by num_steps struct plan_step */
+struct plan_header {
+    char magic[8];
+    uint32_t format;
+    int32_t type;
+    int32_t flags;
+    int32_t tile;
+    int32_t M;
+    int32_t K;
+    int32_t N;
+    int32_t num_steps;
+    uint64_t checksum; // FNV-1a of the steps
+};
+
+static uint64_t plan_checksum(const struct plan_step *steps, int num_steps){
+
+    const unsigned char *p = (const unsigned char *) steps;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < sizeof(struct plan_step) * num_steps; i++){
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* edge class of a tile with rows*cols valid numbers */
+static int plan_edge_class(int tile, int rows, int cols){
+    return (rows < tile ? 1 : 0) | (cols < tile ? 2 : 0);
+}
+
+/* allocates the tile schedule, the address map and the staging buffers of a plan whose shape is set */
+static struct offload_plan *plan_alloc(struct fpga_device *dev, int type, int flags, int M, int K, int N, int num_steps){
+
+    struct offload_plan *plan;
+    plan = (struct offload_plan *) calloc(1, sizeof(struct offload_plan));
+    assert(plan);
+
+    plan->dev = dev;
+    plan->type = type;
+    plan->flags = flags;
+    plan->tile = FPGA_TILE;
+    plan->M = M;
+    plan->K = K;
+    plan->N = N;
+    plan->num_steps = num_steps;
+    plan->steps = (struct plan_step *) calloc(num_steps, sizeof(struct plan_step));
+    assert(plan->steps);
+
+    plan->vector_addr = dev->bram_addr;
+    plan->matrix_addr = dev->bram_addr + FPGA_MATRIX_SLOT_OFFSET;
+    plan->output_addr = dev->bram_addr; // multi PE: output overwrites the vector operand
+
+    size_t tile_bytes = sizeof(float) * FPGA_TILE * FPGA_TILE;
+    for (int i = 0; i < PLAN_NUM_STAGING; i++){
+        plan->allocated[i] = (char *) dma_pool_alloc(tile_bytes + 0x1000);
+        plan->staging[i] = (float *) (plan->allocated[i] + (plan->matrix_addr & 0x0FFF));
+        memset(plan->staging[i], 0, tile_bytes);
+    }
+    plan->output = (float *) dma_pool_alloc(sizeof(float) * FPGA_TILE * (M + FPGA_TILE));
+
+    return plan;
+}
+
+/* plan of y = A*x, A: M*K row-major
+ * steps go over the tiles of A row by row, the tiles of one tile row accumulate into the same rows of y
+ */
+struct offload_plan *offload_plan_matvec(struct fpga_device *dev, int M, int K, int flags){
+
+    assert(M > 0 && K > 0);
+
+    int num_tile_row = (M + FPGA_TILE - 1) / FPGA_TILE;
+    int num_tile_col = (K + FPGA_TILE - 1) / FPGA_TILE;
+    struct offload_plan *plan = plan_alloc(dev, PLAN_MATVEC, flags, M, K, 1, num_tile_row * num_tile_col);
+
+    int s = 0;
+    for (int i = 0; i < M; i += FPGA_TILE){
+        for (int j = 0; j < K; j += FPGA_TILE){
+            struct plan_step *step = &plan->steps[s++];
+            step->row = i;
+            step->col = j;
+            step->rows = (M - i < FPGA_TILE) ? M - i : FPGA_TILE;
+            step->cols = (K - j < FPGA_TILE) ? K - j : FPGA_TILE;
+            step->staging = plan_edge_class(FPGA_TILE, step->rows, step->cols);
+        }
+    }
+
+    return plan;
+}
+
+/* plan of C = A*B, A: M*K, B: K*N (N*K with OFFLOAD_PLAN_B_TRANSPOSED), C: M*N, all row-major
+ * steps go over the tiles of B column by column; each tile of B is sent once, transposed into its staging tile,
+ * and multiplied with all M rows of A
+ */
+struct offload_plan *offload_plan_matmul(struct fpga_device *dev, int M, int K, int N, int flags){
+
+    assert(M > 0 && K > 0 && N > 0);
+
+    int num_tile_k = (K + FPGA_TILE - 1) / FPGA_TILE;
+    int num_tile_n = (N + FPGA_TILE - 1) / FPGA_TILE;
+    struct offload_plan *plan = plan_alloc(dev, PLAN_MATMUL, flags, M, K, N, num_tile_k * num_tile_n);
+
+    int s = 0;
+    for (int j = 0; j < N; j += FPGA_TILE){
+        for (int k = 0; k < K; k += FPGA_TILE){
+            struct plan_step *step = &plan->steps[s++];
+            step->row = k;
+            step->col = j;
+            step->rows = (K - k < FPGA_TILE) ? K - k : FPGA_TILE;
+            step->cols = (N - j < FPGA_TILE) ? N - j : FPGA_TILE;
+            /* the staging tile holds the tile transposed */
+            step->staging = plan_edge_class(FPGA_TILE, step->cols, step->rows);
+        }
+    }
+
+    return plan;
+}
+
+void offload_plan_destroy(struct offload_plan *plan){
+
+    if (plan == NULL){
+        return;
+    }
+    for (int i = 0; i < PLAN_NUM_STAGING; i++){
+        dma_pool_free(plan->allocated[i]);
+    }
+    dma_pool_free(plan->output);
+    free(plan->steps);
+    free(plan);
+}
+
+/* writes the shape and the tile schedule of the plan to path
+ * returns 0 on success, -1 otherwise
+ */
+int offload_plan_save(const struct offload_plan *plan, const char *path){
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL){
+        return -1;
+    }
+
+    struct plan_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PLAN_MAGIC, sizeof(header.magic));
+    header.format = PLAN_FORMAT;
+    header.type = plan->type;
+    header.flags = plan->flags;
+    header.tile = plan->tile;
+    header.M = plan->M;
+    header.K = plan->K;
+    header.N = plan->N;
+    header.num_steps = plan->num_steps;
+    header.checksum = plan_checksum(plan->steps, plan->num_steps);
+
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(plan->steps, sizeof(struct plan_step), plan->num_steps, fp) == (size_t) plan->num_steps;
+
+    if (fclose(fp) != 0 || !ok){
+        return -1;
+    }
+    return 0;
+}
+
+/* reads a plan saved by offload_plan_save for dev
+ * returns NULL if the file is missing, corrupt, was made for another tile size,
+ * or its steps do not cover every tile of the shape exactly once
+ */
+struct offload_plan *offload_plan_load(struct fpga_device *dev, const char *path){
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL){
+        return NULL;
+    }
+
+    struct plan_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, PLAN_MAGIC, sizeof(header.magic)) != 0 || header.format != PLAN_FORMAT ||
+        header.tile != FPGA_TILE || (header.type != PLAN_MATVEC && header.type != PLAN_MATMUL) ||
+        header.M <= 0 || header.K <= 0 || header.N <= 0 || header.num_steps <= 0){
+        fclose(fp);
+        return NULL;
+    }
+
+    /* matvec tiles A (M*K), matmul tiles B (K*N): one step per tile */
+    int max_row = (header.type == PLAN_MATVEC) ? header.M : header.K;
+    int max_col = (header.type == PLAN_MATVEC) ? header.K : header.N;
+    int num_tile_row = (max_row + FPGA_TILE - 1) / FPGA_TILE;
+    int num_tile_col = (max_col + FPGA_TILE - 1) / FPGA_TILE;
+    if ((int64_t) num_tile_row * num_tile_col != header.num_steps){
+        fclose(fp);
+        return NULL;
+    }
+
+    struct offload_plan *plan = plan_alloc(dev, header.type, header.flags, header.M, header.K, header.N, header.num_steps);
+    if (fread(plan->steps, sizeof(struct plan_step), plan->num_steps, fp) != (size_t) plan->num_steps ||
+        plan_checksum(plan->steps, plan->num_steps) != header.checksum){
+        fclose(fp);
+        offload_plan_destroy(plan);
+        return NULL;
+    }
+    fclose(fp);
+
+    /* never trust the file for memory accesses: each step must be a whole tile of the grid
+     * (the edge tiles clipped to the shape) and each tile must be marked exactly once,
+     * otherwise outputs would be skipped or accumulated twice
+     */
+    char *covered = (char *) calloc(plan->num_steps, 1);
+    assert(covered);
+    for (int s = 0; s < plan->num_steps; s++){
+        struct plan_step *step = &plan->steps[s];
+        int edge_class = (plan->type == PLAN_MATVEC) ? plan_edge_class(FPGA_TILE, step->rows, step->cols)
+                                                     : plan_edge_class(FPGA_TILE, step->cols, step->rows);
+        int valid = step->row >= 0 && step->col >= 0 && step->row < max_row && step->col < max_col &&
+                    step->row % FPGA_TILE == 0 && step->col % FPGA_TILE == 0 &&
+                    step->rows == ((max_row - step->row < FPGA_TILE) ? max_row - step->row : FPGA_TILE) &&
+                    step->cols == ((max_col - step->col < FPGA_TILE) ? max_col - step->col : FPGA_TILE) &&
+                    step->staging == edge_class;
+        int t = valid ? (step->row / FPGA_TILE) * num_tile_col + step->col / FPGA_TILE : 0;
+        if (!valid || covered[t]){
+            free(covered);
+            offload_plan_destroy(plan);
+            return NULL;
+        }
+        covered[t] = 1;
+    }
+    free(covered);
+
+    return plan;
+}
+
+/* warm start: returns the plan saved at path if it has the requested type, shape and flags,
+ * otherwise makes the plan and saves it to path for the next run
+ */
+struct offload_plan *offload_plan_warm(struct fpga_device *dev, const char *path, int type, int M, int K, int N, int flags){
+
+    struct offload_plan *plan = offload_plan_load(dev, path);
+    if (plan != NULL && plan->type == type && plan->M == M && plan->K == K && plan->N == N && plan->flags == flags){
+        return plan;
+    }
+    offload_plan_destroy(plan);
+
+    if (type == PLAN_MATVEC){
+        plan = offload_plan_matvec(dev, M, K, flags);
+    }
+    else{
+        plan = offload_plan_matmul(dev, M, K, N, flags);
+    }
+    if (offload_plan_save(plan, path) != 0){
+        printf("Warning: plan could not be saved to %s\n", path);
+    }
+
+    return plan;
+}
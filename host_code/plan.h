@@ -0,0 +1,67 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdint.h>
+
+#include "fpga_device.h"
+
+#define PLAN_MATVEC 1
+#define PLAN_MATMUL 2
+
+/* flags of offload_plan_matvec / offload_plan_matmul */
+#define OFFLOAD_PLAN_B_TRANSPOSED 0x1 // matmul: B is given transposed (N*K), tiles are gathered by row copies
+#define OFFLOAD_PLAN_ACCUMULATE 0x2 // C += A*B instead of C = A*B
+
+#define PLAN_NUM_STAGING 4 // staging tile per edge class: interior, row edge, column edge, corner
+
+/* one op group of a plan
+ * matvec: tile (row, col) of A; matmul: tile (row, col) of B, multiplied with all rows of A
+ */
+struct plan_step {
+    int32_t row; // first row / column of the tile
+    int32_t col;
+    int32_t rows; // valid rows / columns of the tile, the rest is zero padding
+    int32_t cols;
+    int32_t staging; // staging tile of its edge class (matmul, matvec tiles are gathered without copy)
+};
+
+/* execution plan of one shape, computed once and replayed by offload_execute
+ * holds the tile schedule, the BRAM address map and the staging buffers;
+ * each staging tile is only ever written at the same valid region, so its zero padding is filled once
+ */
+struct offload_plan {
+    struct fpga_device *dev;
+    int type;
+    int flags;
+    int tile;
+    int M; // rows of A
+    int K; // columns of A, rows of B (length of x for matvec)
+    int N; // columns of B (1 for matvec)
+
+    int num_steps;
+    struct plan_step *steps;
+
+    /* BRAM address map */
+    uint32_t vector_addr;
+    uint32_t matrix_addr;
+    uint32_t output_addr;
+
+    /* staging */
+    char *allocated[PLAN_NUM_STAGING];
+    float *staging[PLAN_NUM_STAGING]; // keep the page offset of matrix_addr (zero-copy upload)
+    float *output; // output rows of one step, tile numbers per row of A
+};
+
+struct offload_plan *offload_plan_matvec(struct fpga_device *dev, int M, int K, int flags);
+
+struct offload_plan *offload_plan_matmul(struct fpga_device *dev, int M, int K, int N, int flags);
+
+void offload_plan_destroy(struct offload_plan *plan);
+
+int offload_plan_save(const struct offload_plan *plan, const char *path);
+
+struct offload_plan *offload_plan_load(struct fpga_device *dev, const char *path);
+
+struct offload_plan *offload_plan_warm(struct fpga_device *dev, const char *path, int type, int M, int K, int N, int flags);
+
+#endif
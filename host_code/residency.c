@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "residency.h"
+
+/* num_slots slots of slot_size bytes each, back to back from first_slot_addr */
+struct residency_manager *residency_create(uint32_t num_slots, uint32_t first_slot_addr, uint32_t slot_size){
+
+    assert(num_slots > 0);
+
+    struct residency_manager *rm;
+    rm = (struct residency_manager *) calloc(1, sizeof(struct residency_manager));
+    assert(rm);
+
+    rm->slots = (struct residency_slot *) calloc(num_slots, sizeof(struct residency_slot));
+    assert(rm->slots);
+
+    rm->num_slots = num_slots;
+    rm->slot_size = slot_size;
+    for (uint32_t i = 0; i < num_slots; i++){
+        rm->slots[i].addr = first_slot_addr + i * slot_size;
+    }
+
+    return rm;
+}
+
+void residency_destroy(struct residency_manager *rm){
+
+    if (rm == NULL){
+        return;
+    }
+    free(rm->slots);
+    free(rm);
+}
+
+/* finds the slot of the given tile
+ * returns 1 on a hit (the tile is already at *addr), 0 on a miss
+ * on a miss the tile is assigned to a free slot, to the slot of its older version, or to the LRU slot,
+ * and the caller must upload "bytes" bytes of the tile to *addr before the next op
+ */
+int residency_acquire(struct residency_manager *rm, const void *buf, uint64_t version,
+                      uint32_t tile_row, uint32_t tile_col, uint32_t bytes, uint32_t *addr){
+
+    assert(bytes <= rm->slot_size);
+
+    struct residency_slot *victim = NULL;
+    int victim_rank = 0; // 3: older version of the tile, 2: free slot, 1: LRU
+    rm->clock++;
+
+    for (uint32_t i = 0; i < rm->num_slots; i++){
+        struct residency_slot *s = &rm->slots[i];
+
+        if (!s->valid){
+            if (victim_rank < 2){
+                victim = s;
+                victim_rank = 2;
+            }
+            continue;
+        }
+
+        if (s->buf == buf && s->tile_row == tile_row && s->tile_col == tile_col){
+            if (s->version == version){
+                s->last_use = rm->clock;
+                rm->num_hits++;
+                rm->bytes_saved += bytes;
+                *addr = s->addr;
+                return 1;
+            }
+            victim = s;
+            victim_rank = 3;
+            continue;
+        }
+
+        if (victim_rank < 1 || (victim_rank == 1 && s->last_use < victim->last_use)){
+            victim = s;
+            victim_rank = 1;
+        }
+    }
+
+    if (victim_rank == 1){
+        rm->num_evictions++;
+    }
+    victim->valid = 1;
+    victim->buf = buf;
+    victim->tile_row = tile_row;
+    victim->tile_col = tile_col;
+    victim->version = version;
+    victim->last_use = rm->clock;
+
+    rm->num_misses++;
+    rm->bytes_uploaded += bytes;
+    *addr = victim->addr;
+    return 0;
+}
+
+/* drops every tile of buf, e.g. before the buffer is freed or reused */
+void residency_invalidate(struct residency_manager *rm, const void *buf){
+
+    for (uint32_t i = 0; i < rm->num_slots; i++){
+        if (rm->slots[i].valid && rm->slots[i].buf == buf){
+            rm->slots[i].valid = 0;
+            rm->num_invalidations++;
+        }
+    }
+}
+
+/* drops every tile overlapping [addr, addr + size), must be called by anyone writing BRAM past the manager */
+void residency_invalidate_range(struct residency_manager *rm, uint32_t addr, uint32_t size){
+
+    for (uint32_t i = 0; i < rm->num_slots; i++){
+        struct residency_slot *s = &rm->slots[i];
+        if (s->valid && addr < s->addr + rm->slot_size && s->addr < addr + size){
+            s->valid = 0;
+            rm->num_invalidations++;
+        }
+    }
+}
+
+void residency_print_stats(const struct residency_manager *rm){
+
+    uint64_t lookups = rm->num_hits + rm->num_misses;
+    printf("residency: %u slots, %llu hits / %llu misses (%.1f%% hit rate), %llu evictions, %llu invalidations\n",
+           rm->num_slots, (unsigned long long) rm->num_hits, (unsigned long long) rm->num_misses,
+           lookups ? 100.0 * rm->num_hits / lookups : 0.0,
+           (unsigned long long) rm->num_evictions, (unsigned long long) rm->num_invalidations);
+    printf("residency: %llu bytes uploaded, %llu bytes saved\n",
+           (unsigned long long) rm->bytes_uploaded, (unsigned long long) rm->bytes_saved);
+}
@@ -0,0 +1,56 @@
+#ifndef RESIDENCY_H
+#define RESIDENCY_H
+
+#include <stdint.h>
+
+/* BRAM slot holding one matrix tile
+ * a tile is identified by its host buffer, its tile coordinates and a version chosen by the caller
+ * (the caller bumps the version whenever the contents of the buffer change)
+ */
+struct residency_slot {
+    uint32_t addr; // device address of the slot
+    int valid;
+    const void *buf;
+    uint32_t tile_row;
+    uint32_t tile_col;
+    uint64_t version;
+    uint64_t last_use; // LRU timestamp
+};
+
+/* residency manager: remembers which host matrix tile is in which BRAM slot,
+ * so that uploads of tiles already in BRAM are skipped (weight-stationary caching)
+ * every BRAM write through the device (fpga_device_write and friends) invalidates the slots it overlaps,
+ * only the upload of a tile claimed by residency_acquire goes to the channel directly
+ * NOTE: the HW logic computes on the single matrix operand at FPGA_MATRIX_SLOT_OFFSET, so fpga_device runs it
+ * with FPGA_NUM_MATRIX_SLOTS (1) slot: a hit needs consecutive ops on the same tile (one tile multiplied with
+ * several vectors, or a SIZE*SIZE weight matrix across calls), and every change of tile evicts the previous one.
+ * More slots only pay off on a bitstream that takes the matrix operand address from a register.
+ */
+struct residency_manager {
+    uint32_t num_slots;
+    uint32_t slot_size; // bytes
+    struct residency_slot *slots;
+    uint64_t clock;
+
+    uint64_t num_hits;
+    uint64_t num_misses;
+    uint64_t num_evictions;
+    uint64_t num_invalidations;
+    uint64_t bytes_saved; // H2C bytes not sent thanks to hits
+    uint64_t bytes_uploaded;
+};
+
+struct residency_manager *residency_create(uint32_t num_slots, uint32_t first_slot_addr, uint32_t slot_size);
+
+void residency_destroy(struct residency_manager *rm);
+
+int residency_acquire(struct residency_manager *rm, const void *buf, uint64_t version,
+                      uint32_t tile_row, uint32_t tile_col, uint32_t bytes, uint32_t *addr);
+
+void residency_invalidate(struct residency_manager *rm, const void *buf);
+
+void residency_invalidate_range(struct residency_manager *rm, uint32_t addr, uint32_t size);
+
+void residency_print_stats(const struct residency_manager *rm);
+
+#endif
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sparse.h"
+#include "utils.h"
+
+/* row segment of a CSR matrix: the nonzeros of one row within one column panel */
+struct csr_segment {
+    int row;
+    int start; // first nonzero (index into col_idx and val)
+    int end;
+};
+
+/* CSR copy of the nonzeros of the row-major num_row*num_col matrix src */
+struct csr_matrix *csr_from_dense(const float *src, int num_row, int num_col){
+
+    struct csr_matrix *a;
+    a = (struct csr_matrix *) calloc(1, sizeof(struct csr_matrix));
+    assert(a);
+
+    a->num_row = num_row;
+    a->num_col = num_col;
+    a->row_ptr = (int *) malloc(sizeof(int) * (num_row + 1));
+    assert(a->row_ptr);
+
+    a->row_ptr[0] = 0;
+    for (int i = 0; i < num_row; i++){
+        int count = 0;
+        for (int j = 0; j < num_col; j++){
+            count += (src[(size_t) num_col * i + j] != 0.0f);
+        }
+        a->row_ptr[i + 1] = a->row_ptr[i] + count;
+    }
+
+    a->nnz = a->row_ptr[num_row];
+    a->col_idx = (int *) malloc(sizeof(int) * (a->nnz + 1));
+    a->val = (float *) malloc(sizeof(float) * (a->nnz + 1));
+    assert(a->col_idx && a->val);
+
+    int k = 0;
+    for (int i = 0; i < num_row; i++){
+        for (int j = 0; j < num_col; j++){
+            float v = src[(size_t) num_col * i + j];
+            if (v != 0.0f){
+                a->col_idx[k] = j;
+                a->val[k] = v;
+                k++;
+            }
+        }
+    }
+
+    return a;
+}
+
+void csr_free(struct csr_matrix *a){
+
+    if (a == NULL){
+        return;
+    }
+    free(a->row_ptr);
+    free(a->col_idx);
+    free(a->val);
+    free(a);
+}
+
+/* CPU CSR sparse matrix-vector multiplication (baseline of the slab offload) */
+struct timespec cpu_spmv(const struct csr_matrix *a, const float *in_vector, float *out_vector){
+
+    struct timespec ts_start, ts_end;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    for (int i = 0; i < a->num_row; i++){
+        float sum = 0.0f;
+        for (int k = a->row_ptr[i]; k < a->row_ptr[i + 1]; k++){
+            sum += a->val[k] * in_vector[a->col_idx[k]];
+        }
+        out_vector[i] = sum;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    return ts_end;
+}
+
+/* packs the CSR matrix a into tile*tile slabs (struct ell_slabs)
+ * row segments are bucketed by column panel (counting sort, rows ascending in a panel) and appended to the open slab
+ * while it has a free row and room for the new columns of the segment, a slab left open at the end of a panel
+ * takes the first segments of the next one; slab memory starts at page_offset within a page (see matrix_prepack)
+ */
+struct ell_slabs *ell_pack(const struct csr_matrix *a, int tile, uint32_t page_offset){
+
+    int num_panels = (a->num_col + tile - 1) / tile;
+
+    /* count the segments of each panel, rows must have sorted column indices */
+    int *panel_start = (int *) calloc(num_panels + 1, sizeof(int));
+    assert(panel_start);
+    for (int i = 0; i < a->num_row; i++){
+        int last = -1;
+        for (int k = a->row_ptr[i]; k < a->row_ptr[i + 1]; k++){
+            if (a->col_idx[k] < 0 || a->col_idx[k] >= a->num_col || (k > a->row_ptr[i] && a->col_idx[k] <= a->col_idx[k - 1])){
+                printf("ERROR: ell_pack needs CSR column indices in [0, %d) and ascending within a row (row %d)\n", a->num_col, i);
+                exit(1);
+            }
+            int panel = a->col_idx[k] / tile;
+            if (panel != last){
+                panel_start[panel + 1]++;
+                last = panel;
+            }
+        }
+    }
+    for (int p = 0; p < num_panels; p++){
+        panel_start[p + 1] += panel_start[p];
+    }
+
+    int num_segments = panel_start[num_panels];
+    struct csr_segment *segments = (struct csr_segment *) malloc(sizeof(struct csr_segment) * (num_segments + 1));
+    int *fill = (int *) malloc(sizeof(int) * (num_panels + 1));
+    assert(segments && fill);
+    memcpy(fill, panel_start, sizeof(int) * num_panels);
+
+    for (int i = 0; i < a->num_row; i++){
+        int k = a->row_ptr[i];
+        while (k < a->row_ptr[i + 1]){
+            int panel = a->col_idx[k] / tile;
+            struct csr_segment *seg = &segments[fill[panel]++];
+            seg->row = i;
+            seg->start = k;
+            while (k < a->row_ptr[i + 1] && a->col_idx[k] / tile == panel){
+                k++;
+            }
+            seg->end = k;
+        }
+    }
+
+    /* greedy packing, at most one slab per segment */
+    int capacity = (num_segments > 0) ? num_segments : 1;
+    int *rows = (int *) malloc(sizeof(int) * tile * capacity);
+    int *cols = (int *) malloc(sizeof(int) * tile * capacity);
+    int *col_slot = (int *) malloc(sizeof(int) * a->num_col); // column of the open slab holding each matrix column, -1: none
+    assert(rows && cols && col_slot);
+    for (int j = 0; j < a->num_col; j++){
+        col_slot[j] = -1;
+    }
+
+    int num_slabs = 0, num_rows_open = tile, num_cols_open = tile;
+    size_t data_capacity = (size_t) tile * tile * 16;
+    float *data = (float *) malloc(sizeof(float) * data_capacity);
+    assert(data);
+
+    for (int s = 0; s < num_segments; s++){
+        const struct csr_segment *seg = &segments[s];
+
+        int new_cols = 0;
+        for (int k = seg->start; k < seg->end; k++){
+            new_cols += (num_slabs > 0 && col_slot[a->col_idx[k]] < 0);
+        }
+
+        if (num_slabs == 0 || num_rows_open == tile || num_cols_open + new_cols > tile){
+            /* close the open slab: forget its columns */
+            if (num_slabs > 0){
+                for (int c = 0; c < num_cols_open; c++){
+                    col_slot[cols[tile * (num_slabs - 1) + c]] = -1;
+                }
+            }
+
+            if ((size_t) tile * tile * (num_slabs + 1) > data_capacity){
+                data_capacity *= 2;
+                data = (float *) realloc(data, sizeof(float) * data_capacity);
+                assert(data);
+            }
+            memset(data + (size_t) tile * tile * num_slabs, 0, sizeof(float) * tile * tile);
+            for (int r = 0; r < tile; r++){
+                rows[tile * num_slabs + r] = -1;
+                cols[tile * num_slabs + r] = -1;
+            }
+            num_slabs++;
+            num_rows_open = 0;
+            num_cols_open = 0;
+        }
+
+        int slab = num_slabs - 1;
+        float *slab_data = data + (size_t) tile * tile * slab;
+        rows[tile * slab + num_rows_open] = seg->row;
+        for (int k = seg->start; k < seg->end; k++){
+            int j = a->col_idx[k];
+            if (col_slot[j] < 0){
+                col_slot[j] = num_cols_open;
+                cols[tile * slab + num_cols_open] = j;
+                num_cols_open++;
+            }
+            slab_data[tile * num_rows_open + col_slot[j]] = a->val[k];
+        }
+        num_rows_open++;
+    }
+
+    struct ell_slabs *e;
+    e = (struct ell_slabs *) calloc(1, sizeof(struct ell_slabs));
+    assert(e);
+
+    e->num_row = a->num_row;
+    e->num_col = a->num_col;
+    e->nnz = a->nnz;
+    e->tile = tile;
+    e->num_slabs = num_slabs;
+    e->rows = rows;
+    e->cols = cols;
+    e->slabs = (num_slabs > 0) ? matrix_prepack(data, tile * num_slabs, tile, tile, MATRIX_TILED, page_offset) : NULL;
+
+    free(data);
+    free(col_slot);
+    free(fill);
+    free(segments);
+    free(panel_start);
+
+    return e;
+}
+
+void ell_free(struct ell_slabs *e){
+
+    if (e == NULL){
+        return;
+    }
+    if (e->slabs){
+        matrix_free(e->slabs);
+    }
+    free(e->rows);
+    free(e->cols);
+    free(e);
+}
+
+/* operand vector of a slab: the numbers of in_vector in the columns of the slab, zero for padding */
+void ell_gather(const struct ell_slabs *e, int slab, const float *in_vector, float *slab_vector){
+
+    const int *cols = e->cols + e->tile * slab;
+    for (int c = 0; c < e->tile; c++){
+        slab_vector[c] = (cols[c] >= 0) ? in_vector[cols[c]] : 0.0f;
+    }
+}
+
+/* adds the outputs of a slab to the rows they belong to */
+void ell_scatter(const struct ell_slabs *e, int slab, const float *slab_out, float *out_vector){
+
+    const int *rows = e->rows + e->tile * slab;
+    for (int r = 0; r < e->tile && rows[r] >= 0; r++){
+        out_vector[rows[r]] += slab_out[r];
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "matrix.h"
+
+/* compressed sparse row matrix, column indices of a row in ascending order */
+struct csr_matrix {
+    int num_row;
+    int num_col;
+    int nnz;
+    int *row_ptr; // num_row + 1
+    int *col_idx; // nnz
+    float *val; // nnz
+};
+
+/* ELL-style slabs of a CSR matrix for the dense tile*tile matrix-vector HW
+ * a slab holds up to tile row segments over up to tile distinct columns: it is multiplied with the gathered
+ * vector in_vector[cols[c]] and its outputs are added to out_vector[rows[r]]
+ * row segments are reordered by column panel (tile columns each) and packed greedily, so the number of slabs
+ * follows the number of nonzeros rather than num_row*num_col
+ */
+struct ell_slabs {
+    int num_row;
+    int num_col;
+    int nnz;
+    int tile;
+    int num_slabs;
+    int *rows; // num_slabs*tile output row of each slab row, -1 for padding
+    int *cols; // num_slabs*tile column of each slab column, -1 for padding
+    struct matrix *slabs; // num_slabs*tile x tile, MATRIX_TILED: slab s is matrix_tile(slabs, s, 0)
+};
+
+struct csr_matrix *csr_from_dense(const float *src, int num_row, int num_col);
+
+void csr_free(struct csr_matrix *a);
+
+struct timespec cpu_spmv(const struct csr_matrix *a, const float *in_vector, float *out_vector);
+
+struct ell_slabs *ell_pack(const struct csr_matrix *a, int tile, uint32_t page_offset);
+
+void ell_free(struct ell_slabs *e);
+
+void ell_gather(const struct ell_slabs *e, int slab, const float *in_vector, float *slab_vector);
+
+void ell_scatter(const struct ell_slabs *e, int slab, const float *slab_out, float *out_vector);
+
+#endif
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "stripe.h"
+#include "utils.h"
+
+#define STRIPE_ALIGN 4096 // chunk boundaries keep the page offset of the buffer (zero-copy)
+
+/* work of one channel for one striped transfer */
+struct stripe_chunk {
+    struct channel_handle *ch;
+    uint32_t addr;
+    uint32_t size;
+    char *buffer;
+    int write;
+    int done;
+    struct timespec ts;
+};
+
+static void stripe_chunk_run(struct stripe_chunk *chunk){
+
+    if (chunk->write){
+        chunk->ts = channel_write(chunk->ch, chunk->addr, chunk->size, chunk->buffer);
+    }
+    else{
+        chunk->ts = channel_read(chunk->ch, chunk->addr, chunk->size, chunk->buffer);
+    }
+}
+
+static void *stripe_worker_main(void *arg){
+
+    struct stripe_worker *worker = (struct stripe_worker *) arg;
+
+    pthread_mutex_lock(&worker->lock);
+    while (1){
+        while (worker->chunk == NULL && !worker->quit){
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+        if (worker->chunk == NULL){
+            break;
+        }
+        struct stripe_chunk *chunk = worker->chunk;
+        pthread_mutex_unlock(&worker->lock);
+
+        stripe_chunk_run(chunk);
+
+        pthread_mutex_lock(&worker->lock);
+        chunk->done = 1;
+        worker->chunk = NULL;
+        pthread_cond_broadcast(&worker->cond);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return NULL;
+}
+
+static void stripe_worker_start(struct stripe_worker *worker, struct channel_handle *ch){
+
+    worker->ch = ch;
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    worker->chunk = NULL;
+    worker->quit = 0;
+    if (pthread_create(&worker->thread, NULL, stripe_worker_main, worker) != 0){
+        printf("ERROR: stripe worker thread of %s could not be created\n", ch->device);
+        exit(1);
+    }
+}
+
+static void stripe_worker_stop(struct stripe_worker *worker){
+
+    pthread_mutex_lock(&worker->lock);
+    worker->quit = 1;
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->thread, NULL);
+
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->lock);
+}
+
+/* hands chunk to the worker, after the chunk of a concurrent transfer it may still be running */
+static void stripe_worker_post(struct stripe_worker *worker, struct stripe_chunk *chunk){
+
+    pthread_mutex_lock(&worker->lock);
+    while (worker->chunk != NULL){
+        pthread_cond_wait(&worker->cond, &worker->lock);
+    }
+    worker->chunk = chunk;
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static void stripe_worker_wait(struct stripe_worker *worker, struct stripe_chunk *chunk){
+
+    pthread_mutex_lock(&worker->lock);
+    while (!chunk->done){
+        pthread_cond_wait(&worker->cond, &worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/* stripes over the first num_h2c H2C and num_c2h C2H channel handles, which must outlive the engine */
+struct stripe_engine *stripe_create(struct channel_handle **h2c, int num_h2c, struct channel_handle **c2h, int num_c2h){
+
+    assert(num_h2c > 0 && num_h2c <= MAX_CHANNELS);
+    assert(num_c2h > 0 && num_c2h <= MAX_CHANNELS);
+
+    struct stripe_engine *se;
+    se = (struct stripe_engine *) calloc(1, sizeof(struct stripe_engine));
+    assert(se);
+
+    se->num_h2c = num_h2c;
+    se->num_c2h = num_c2h;
+    for (int i = 0; i < num_h2c; i++){
+        se->h2c[i] = h2c[i];
+    }
+    for (int i = 0; i < num_c2h; i++){
+        se->c2h[i] = c2h[i];
+    }
+    for (int i = 1; i < num_h2c; i++){
+        stripe_worker_start(&se->h2c_workers[i], h2c[i]);
+    }
+    for (int i = 1; i < num_c2h; i++){
+        stripe_worker_start(&se->c2h_workers[i], c2h[i]);
+    }
+
+    return se;
+}
+
+void stripe_destroy(struct stripe_engine *se){
+
+    if (se == NULL){
+        return;
+    }
+    for (int i = 1; i < se->num_h2c; i++){
+        stripe_worker_stop(&se->h2c_workers[i]);
+    }
+    for (int i = 1; i < se->num_c2h; i++){
+        stripe_worker_stop(&se->c2h_workers[i]);
+    }
+    free(se);
+}
+
+/* splits the transfer over num_ch channels and hands chunk i to the worker of channel i
+ * chunks are multiples of STRIPE_ALIGN, transfers up to that size use channel 0 only
+ */
+static struct timespec stripe_transfer(struct channel_handle **channels, struct stripe_worker *workers, int num_ch,
+                                       uint64_t *bytes, struct timespec *times,
+                                       uint32_t addr, uint32_t transferSize, char *buffer, int write){
+
+    struct timespec ts_start, ts_end;
+    struct stripe_chunk chunks[MAX_CHANNELS];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    /* round up before and after the division, so that at most num_ch chunks are needed */
+    uint32_t chunk_size = ((transferSize + num_ch - 1) / num_ch + STRIPE_ALIGN - 1) & ~(STRIPE_ALIGN - 1);
+    int num_chunks = 0;
+    uint32_t offset = 0;
+    while (offset < transferSize){
+        assert(chunk_size > 0 && num_chunks < num_ch);
+        uint32_t size = (transferSize - offset < chunk_size) ? transferSize - offset : chunk_size;
+        chunks[num_chunks].ch = channels[num_chunks];
+        chunks[num_chunks].addr = addr + offset;
+        chunks[num_chunks].size = size;
+        chunks[num_chunks].buffer = buffer + offset;
+        chunks[num_chunks].write = write;
+        chunks[num_chunks].done = 0;
+        offset += size;
+        ++num_chunks;
+    }
+
+    /* the calling thread drives the first channel itself */
+    for (int i = 1; i < num_chunks; i++){
+        stripe_worker_post(&workers[i], &chunks[i]);
+    }
+    if (num_chunks > 0){
+        stripe_chunk_run(&chunks[0]);
+    }
+    for (int i = 1; i < num_chunks; i++){
+        stripe_worker_wait(&workers[i], &chunks[i]);
+    }
+
+    for (int i = 0; i < num_chunks; i++){
+        bytes[i] += chunks[i].size;
+        timespec_add(&times[i], &chunks[i].ts);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    timespec_sub(&ts_end, &ts_start);
+
+    return ts_end;
+}
+
+/* transferSize of data will be written to the device at addr, striped over all H2C channels
+ * returns total execution time of function
+ */
+struct timespec stripe_write(struct stripe_engine *se, uint32_t addr, uint32_t transferSize, const void *data){
+    return stripe_transfer(se->h2c, se->h2c_workers, se->num_h2c, se->h2c_bytes, se->h2c_time, addr, transferSize, (char *) data, 1);
+}
+
+/* transferSize of data at addr will be read from the device, striped over all C2H channels
+ * returns total execution time of function
+ */
+struct timespec stripe_read(struct stripe_engine *se, uint32_t addr, uint32_t transferSize, void *output){
+    return stripe_transfer(se->c2h, se->c2h_workers, se->num_c2h, se->c2h_bytes, se->c2h_time, addr, transferSize, (char *) output, 0);
+}
+
+static void print_channel_stats(const struct channel_handle *ch, uint64_t bytes, struct timespec ts){
+
+    double seconds = ts.tv_sec + ts.tv_nsec / 1e9;
+    double bandwidth = (seconds > 0) ? bytes / seconds / 1e6 : 0.0;
+    printf("%-20s: %12llu bytes in %ld.%09ld seconds, %8.1f MB/s\n", ch->device, (unsigned long long) bytes,
+           ts.tv_sec, ts.tv_nsec, bandwidth);
+}
+
+void stripe_print_stats(const struct stripe_engine *se){
+
+    for (int i = 0; i < se->num_h2c; i++){
+        print_channel_stats(se->h2c[i], se->h2c_bytes[i], se->h2c_time[i]);
+    }
+    for (int i = 0; i < se->num_c2h; i++){
+        print_channel_stats(se->c2h[i], se->c2h_bytes[i], se->c2h_time[i]);
+    }
+}
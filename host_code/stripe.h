@@ -0,0 +1,54 @@
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "channel_readwrite.h"
+
+#define MAX_CHANNELS 4 // H2C/C2H can each have upto 4 channels
+
+struct stripe_chunk;
+
+/* persistent worker thread of one channel, runs the chunks posted to it one at a time */
+struct stripe_worker {
+    pthread_t thread;
+    struct channel_handle *ch;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // a chunk was posted or finished
+    struct stripe_chunk *chunk; // posted chunk, NULL when idle
+    int quit;
+};
+
+/* striping transfer engine
+ * a large transfer is split into per-channel chunks, each channel is driven by its own worker thread
+ * through a persistent channel handle (owned by the caller), and the caller waits for completion
+ * the workers are created with the engine; the calling thread drives channel 0 itself
+ */
+struct stripe_engine {
+    int num_h2c;
+    int num_c2h;
+    struct channel_handle *h2c[MAX_CHANNELS];
+    struct channel_handle *c2h[MAX_CHANNELS];
+    struct stripe_worker h2c_workers[MAX_CHANNELS]; // [0] unused
+    struct stripe_worker c2h_workers[MAX_CHANNELS]; // [0] unused
+
+    /* per-channel statistics */
+    uint64_t h2c_bytes[MAX_CHANNELS];
+    uint64_t c2h_bytes[MAX_CHANNELS];
+    struct timespec h2c_time[MAX_CHANNELS];
+    struct timespec c2h_time[MAX_CHANNELS];
+};
+
+struct stripe_engine *stripe_create(struct channel_handle **h2c, int num_h2c, struct channel_handle **c2h, int num_c2h);
+
+void stripe_destroy(struct stripe_engine *se);
+
+struct timespec stripe_write(struct stripe_engine *se, uint32_t addr, uint32_t transferSize, const void *data);
+
+struct timespec stripe_read(struct stripe_engine *se, uint32_t addr, uint32_t transferSize, void *output);
+
+void stripe_print_stats(const struct stripe_engine *se);
+
+#endif
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <immintrin.h>
+
+#include "tile_mask.h"
+
+/* returns 1 if any of the num numbers at src is not zero (NaN counts as not zero, -0.0f as zero) */
+static int any_nonzero_scalar(const float *src, int num){
+
+    for (int i = 0; i < num; i++){
+        if (src[i] != 0.0f){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static int any_nonzero_avx2(const float *src, int num){
+
+    const __m256 zero = _mm256_setzero_ps();
+    int i;
+    for (i = 0; i + 32 <= num; i += 32){
+        __m256 ne = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(_mm256_loadu_ps(src + i), zero, _CMP_NEQ_UQ),
+                                              _mm256_cmp_ps(_mm256_loadu_ps(src + i + 8), zero, _CMP_NEQ_UQ)),
+                                 _mm256_or_ps(_mm256_cmp_ps(_mm256_loadu_ps(src + i + 16), zero, _CMP_NEQ_UQ),
+                                              _mm256_cmp_ps(_mm256_loadu_ps(src + i + 24), zero, _CMP_NEQ_UQ)));
+        if (_mm256_movemask_ps(ne)){
+            return 1;
+        }
+    }
+    for (; i + 8 <= num; i += 8){
+        if (_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(src + i), zero, _CMP_NEQ_UQ))){
+            return 1;
+        }
+    }
+    return any_nonzero_scalar(src + i, num - i);
+}
+
+/* empty mask (every tile zero) of a num_row*num_col matrix, for callers that know the occupancy */
+struct tile_mask *tile_mask_create(int num_row, int num_col, int tile){
+
+    struct tile_mask *m;
+    m = (struct tile_mask *) calloc(1, sizeof(struct tile_mask));
+    assert(m);
+
+    m->tile = tile;
+    m->num_tile_row = (num_row + tile - 1) / tile;
+    m->num_tile_col = (num_col + tile - 1) / tile;
+    m->bits = (uint64_t *) calloc((m->num_tile_row * m->num_tile_col + 63) / 64, sizeof(uint64_t));
+    assert(m->bits);
+
+    return m;
+}
+
+/* occupancy of the row-major num_row*num_col matrix src, one pass over it
+ * a row segment is scanned only while its tile is still empty, so dense tiles cost about one row each
+ */
+struct tile_mask *tile_mask_scan(const float *src, int num_row, int num_col, int tile){
+
+    struct tile_mask *m = tile_mask_create(num_row, num_col, tile);
+    int (*any_nonzero)(const float *, int) = any_nonzero_scalar;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        any_nonzero = any_nonzero_avx2;
+    }
+
+    for (int ti = 0; ti < m->num_tile_row; ti++){
+        int rows = (num_row - ti*tile < tile) ? num_row - ti*tile : tile;
+
+        for (int tj = 0; tj < m->num_tile_col; tj++){
+            int cols = (num_col - tj*tile < tile) ? num_col - tj*tile : tile;
+            const float *block = src + (size_t) num_col * ti*tile + tj*tile;
+
+            for (int p = 0; p < rows; p++){
+                if (any_nonzero(block + (size_t) num_col * p, cols)){
+                    tile_mask_set(m, ti, tj);
+                    break;
+                }
+            }
+        }
+    }
+
+    return m;
+}
+
+void tile_mask_free(struct tile_mask *m){
+
+    if (m == NULL){
+        return;
+    }
+    free(m->bits);
+    free(m);
+}
+
+void tile_mask_set(struct tile_mask *m, int tile_row, int tile_col){
+
+    assert(tile_row < m->num_tile_row && tile_col < m->num_tile_col);
+    int index = tile_row * m->num_tile_col + tile_col;
+    if (!(m->bits[index / 64] & (1ULL << (index % 64)))){
+        m->bits[index / 64] |= 1ULL << (index % 64);
+        m->num_occupied++;
+    }
+}
+
+/* returns 1 if the tile has to be computed, a NULL mask marks every tile as occupied */
+int tile_mask_test(const struct tile_mask *m, int tile_row, int tile_col){
+
+    if (m == NULL){
+        return 1;
+    }
+    int index = tile_row * m->num_tile_col + tile_col;
+    return (m->bits[index / 64] >> (index % 64)) & 1;
+}
+
+/* fraction of occupied tiles */
+double tile_mask_density(const struct tile_mask *m){
+
+    return (double) m->num_occupied / (m->num_tile_row * m->num_tile_col);
+}
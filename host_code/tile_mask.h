@@ -0,0 +1,29 @@
+#ifndef TILE_MASK_H
+#define TILE_MASK_H
+
+#include <stdint.h>
+
+/* occupancy bitmap of the tile*tile tiles of a matrix: a clear bit marks a tile that is entirely zero
+ * tiles are numbered row-major (tile_row * num_tile_col + tile_col)
+ */
+struct tile_mask {
+    int tile;
+    int num_tile_row;
+    int num_tile_col;
+    int num_occupied;
+    uint64_t *bits;
+};
+
+struct tile_mask *tile_mask_create(int num_row, int num_col, int tile);
+
+struct tile_mask *tile_mask_scan(const float *src, int num_row, int num_col, int tile);
+
+void tile_mask_free(struct tile_mask *m);
+
+void tile_mask_set(struct tile_mask *m, int tile_row, int tile_col);
+
+int tile_mask_test(const struct tile_mask *m, int tile_row, int tile_col);
+
+double tile_mask_density(const struct tile_mask *m);
+
+#endif
@@ -8,8 +8,23 @@ void timespec_add(struct timespec *t1, const struct timespec *t2);
 
 void timespec_div(struct timespec *ts, int num);
 
+/* kernels of mat_transpose_blocked */
+#define TRANSPOSE_SCALAR 0
+#define TRANSPOSE_AVX2 1
+#define TRANSPOSE_AVX512 2
+
 void mat_transpose_naive(float *in_matrix, float *out_matrix, int num_row, int num_col);
 
+int mat_transpose_isa(void);
+
+void mat_transpose_blocked(const float *in_matrix, float *out_matrix, int num_row, int num_col, int isa);
+
+void mat_transpose_tiling(float *in_matrix, float *out_matrix, int num_row, int num_col);
+
+void mat_transpose_strided(const float *in_matrix, int ld_in, float *out_matrix, int ld_out, int num_row, int num_col);
+
+void mat_transpose_parallel(float *in_matrix, float *out_matrix, int num_row, int num_col, int num_threads);
+
 struct timespec cpu_innerproduct(float *in_vector1, float *in_vector2, float *out, int size);
 
 struct timespec cpu_matvec(float *in_matrix, float *in_vector, float *out_vector, int num_row, int num_col);
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#include "wait_policy.h"
+
+static uint64_t ts_to_ns(const struct timespec *ts){
+    return (uint64_t) ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts_to_ns(&ts);
+}
+
+/* preset WAIT_POLICY_LATENCY or WAIT_POLICY_CPU, timeout_ns of 0 waits forever */
+struct wait_policy *wait_policy_create(struct completion_waiter *w, int preset, uint64_t timeout_ns){
+
+    struct wait_policy *p;
+    p = (struct wait_policy *) calloc(1, sizeof(struct wait_policy));
+    assert(p);
+
+    p->w = w;
+    p->alpha = 0.125;
+    p->timeout_ns = timeout_ns;
+    if (preset == WAIT_POLICY_CPU){
+        p->sleep_fraction = 0.9;
+        p->spin_budget_ns = 20000;
+    }
+    else{
+        p->sleep_fraction = 0.6;
+        p->spin_budget_ns = 200000;
+    }
+
+    return p;
+}
+
+void wait_policy_destroy(struct wait_policy *p){
+    free(p);
+}
+
+static struct wait_policy_entry *find_entry(struct wait_policy *p, int op_type, uint32_t size){
+
+    for (int i = 0; i < p->num_entries; i++){
+        if (p->entries[i].op_type == op_type && p->entries[i].size == size){
+            return &p->entries[i];
+        }
+    }
+
+    /* table full: reuse the last slot */
+    int idx = (p->num_entries < WAIT_POLICY_MAX_OPS) ? p->num_entries++ : WAIT_POLICY_MAX_OPS - 1;
+    memset(&p->entries[idx], 0, sizeof(struct wait_policy_entry));
+    p->entries[idx].op_type = op_type;
+    p->entries[idx].size = size;
+
+    return &p->entries[idx];
+}
+
+/* waits for the op of op_type on size numbers that was kicked at ts_kick
+ * returns 0 when the op is done, -1 on timeout
+ */
+int wait_policy_wait(struct wait_policy *p, int op_type, uint32_t size, uint32_t busy_code, const struct timespec *ts_kick){
+
+    struct wait_policy_entry *e = find_entry(p, op_type, size);
+    uint64_t kick = ts_to_ns(ts_kick);
+    uint64_t checks = 0;
+    int rc = 0;
+    int done = 0;
+
+    /* 1. sleep through most of the predicted runtime (first op of a kind has no prediction) */
+    uint64_t sleep_until = kick + (uint64_t) (p->sleep_fraction * e->predicted_ns);
+    uint64_t now = now_ns();
+    if (sleep_until > now){
+        struct timespec ts;
+        ts.tv_sec = sleep_until / 1000000000ULL;
+        ts.tv_nsec = sleep_until % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        e->sleep_ns += sleep_until - now;
+    }
+
+    /* 2. spin-poll within the budget */
+    uint64_t spin_start = now_ns();
+    uint64_t first_check = spin_start;
+    while (1){
+        ++checks;
+        if (completion_poll(p->w, busy_code)){
+            done = 1;
+            break;
+        }
+        if ((checks % 16) == 0 && now_ns() - spin_start > p->spin_budget_ns){
+            break;
+        }
+        cpu_relax();
+    }
+
+    /* 3. budget exhausted: stop burning CPU */
+    if (!done){
+        e->num_blocked++;
+        uint64_t elapsed = now_ns() - kick;
+        uint64_t remaining = 0;
+        if (p->timeout_ns > 0){
+            remaining = (elapsed < p->timeout_ns) ? p->timeout_ns - elapsed : 1;
+        }
+        rc = completion_block(p->w, busy_code, remaining, &checks);
+        if (rc != 0){
+            e->num_timeouts++;
+        }
+    }
+
+    uint64_t runtime = now_ns() - kick;
+
+    /* done at the very first check: the op finished somewhere during the sleep */
+    if (checks == 1 && e->predicted_ns > 0){
+        e->num_overslept++;
+        uint64_t estimate = (uint64_t) e->predicted_ns;
+        if (first_check - kick > estimate){
+            e->oversleep_ns += (first_check - kick) - estimate;
+        }
+        /* the sample is only an upper bound, let the prediction drift down until spins show up again */
+        runtime = (uint64_t) (0.9 * runtime);
+    }
+
+    e->wasted_spins += checks - 1;
+    e->num_waits++;
+    if (rc == 0){
+        if (e->predicted_ns == 0){
+            e->predicted_ns = runtime;
+        }
+        else{
+            e->predicted_ns += p->alpha * ((double) runtime - e->predicted_ns);
+        }
+    }
+
+    return rc;
+}
+
+void wait_policy_print_stats(const struct wait_policy *p){
+
+    printf("adaptive wait (sleep %.0f%% of prediction, spin budget %llu ns):\n", 100.0 * p->sleep_fraction,
+           (unsigned long long) p->spin_budget_ns);
+    for (int i = 0; i < p->num_entries; i++){
+        const struct wait_policy_entry *e = &p->entries[i];
+        double n = (e->num_waits > 0) ? (double) e->num_waits : 1.0;
+        printf("  op %d size %5u: %8llu waits, predicted %10.0f ns, slept %10.0f ns/op, wasted spins %8.1f/op, "
+               "overslept %llu (%.0f ns/op), blocked %llu, timeouts %llu\n",
+               e->op_type, e->size, (unsigned long long) e->num_waits, e->predicted_ns, e->sleep_ns / n,
+               e->wasted_spins / n, (unsigned long long) e->num_overslept, e->oversleep_ns / n,
+               (unsigned long long) e->num_blocked, (unsigned long long) e->num_timeouts);
+    }
+}
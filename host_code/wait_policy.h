@@ -0,0 +1,48 @@
+#ifndef WAIT_POLICY_H
+#define WAIT_POLICY_H
+
+#include <stdint.h>
+
+#include "completion.h"
+
+#define WAIT_POLICY_MAX_OPS 32 // number of distinct (op type, size) pairs tracked
+
+#define WAIT_POLICY_LATENCY 0 // wake up early and spin longer
+#define WAIT_POLICY_CPU 1 // sleep through most of the op and block soon after
+
+/* learned runtime and statistics of one (op type, size) pair */
+struct wait_policy_entry {
+    int op_type;
+    uint32_t size;
+    double predicted_ns; // moving average of the HW runtime
+    uint64_t num_waits;
+    uint64_t sleep_ns; // total time slept before polling
+    uint64_t wasted_spins; // register checks that found the op still busy
+    uint64_t num_overslept; // ops already done at the first check after the sleep
+    uint64_t oversleep_ns; // estimated time between completion and the first check
+    uint64_t num_blocked; // ops that exceeded the spin budget and fell back to blocking
+    uint64_t num_timeouts;
+};
+
+/* adaptive hybrid wait: sleep for most of the predicted HW runtime, spin-poll, then block
+ * (user interrupt if available, sched_yield polling otherwise) once the spin budget is exhausted
+ */
+struct wait_policy {
+    struct completion_waiter *w;
+    double sleep_fraction; // fraction of the predicted runtime to sleep
+    double alpha; // weight of a new sample in the moving average
+    uint64_t spin_budget_ns;
+    uint64_t timeout_ns;
+    int num_entries;
+    struct wait_policy_entry entries[WAIT_POLICY_MAX_OPS];
+};
+
+struct wait_policy *wait_policy_create(struct completion_waiter *w, int preset, uint64_t timeout_ns);
+
+void wait_policy_destroy(struct wait_policy *p);
+
+int wait_policy_wait(struct wait_policy *p, int op_type, uint32_t size, uint32_t busy_code, const struct timespec *ts_kick);
+
+void wait_policy_print_stats(const struct wait_policy *p);
+
+#endif
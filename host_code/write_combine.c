@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "write_combine.h"
+
+/* the pending range starts at this offset inside the allocation,
+ * so that it keeps the page offset of its device address (zero-copy in channel_write)
+ */
+#define WC_OFFSET(addr) ((addr) & 0x0FFF)
+
+struct write_combiner *wc_create(struct channel_handle *ch, uint32_t capacity, uint32_t doorbell_addr){
+
+    struct write_combiner *wc;
+    wc = (struct write_combiner *) malloc(sizeof(struct write_combiner));
+    assert(wc);
+
+    wc->ch = ch;
+    wc->doorbell_addr = doorbell_addr;
+    wc->allocated = (char *) channel_alloc_buffer(ch, capacity + 0x1000);
+    wc->capacity = capacity;
+    wc->pending = 0;
+    wc->base = 0;
+    wc->end = 0;
+    wc->num_writes = 0;
+    wc->num_transfers = 0;
+
+    return wc;
+}
+
+void wc_destroy(struct write_combiner *wc){
+
+    if (wc == NULL){
+        return;
+    }
+    wc_flush(wc);
+    channel_free_buffer(wc->allocated);
+    free(wc);
+}
+
+/* sends the pending range, if any, as one DMA */
+void wc_flush(struct write_combiner *wc){
+
+    if (!wc->pending){
+        return;
+    }
+    channel_write(wc->ch, wc->base, wc->end - wc->base, wc->allocated + WC_OFFSET(wc->base));
+    wc->num_transfers++;
+    wc->pending = 0;
+}
+
+/* queues transferSize bytes of data for device address addr
+ * NOTE: reads of the same device range must be preceded by wc_flush (the op code write does it)
+ */
+void wc_write(struct write_combiner *wc, uint32_t addr, uint32_t transferSize, const void *data){
+
+    wc->num_writes++;
+
+    /* op code: everything written before must be in BRAM first, then kick immediately */
+    if (addr == wc->doorbell_addr){
+        wc_flush(wc);
+        channel_write(wc->ch, addr, transferSize, data);
+        wc->num_transfers++;
+        return;
+    }
+
+    if (wc->pending){
+        /* merge if the new range touches or overlaps the pending one and the union still fits */
+        uint32_t new_base = (addr < wc->base) ? addr : wc->base;
+        uint32_t new_end = (addr + transferSize > wc->end) ? addr + transferSize : wc->end;
+        int touches = (addr <= wc->end) && (addr + transferSize >= wc->base);
+
+        if (touches && new_end - new_base <= wc->capacity){
+            if (new_base != wc->base){
+                /* range grows downwards: move the pending data up */
+                memmove(wc->allocated + WC_OFFSET(new_base) + (wc->base - new_base),
+                        wc->allocated + WC_OFFSET(wc->base), wc->end - wc->base);
+                wc->base = new_base;
+            }
+            memcpy(wc->allocated + WC_OFFSET(wc->base) + (addr - wc->base), data, transferSize);
+            wc->end = new_end;
+            return;
+        }
+        wc_flush(wc);
+    }
+
+    /* too large to stage: send as is */
+    if (transferSize > wc->capacity){
+        channel_write(wc->ch, addr, transferSize, data);
+        wc->num_transfers++;
+        return;
+    }
+
+    memcpy(wc->allocated + WC_OFFSET(addr), data, transferSize);
+    wc->base = addr;
+    wc->end = addr + transferSize;
+    wc->pending = 1;
+}
+
+void wc_print_stats(const struct write_combiner *wc){
+    printf("write combiner on %s: %llu writes in %llu DMA transfers\n", wc->ch->device,
+           (unsigned long long) wc->num_writes, (unsigned long long) wc->num_transfers);
+}
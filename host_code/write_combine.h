@@ -0,0 +1,34 @@
+#ifndef WRITE_COMBINE_H
+#define WRITE_COMBINE_H
+
+#include <stdint.h>
+
+#include "channel_readwrite.h"
+
+/* write-combining staging layer for an H2C channel
+ * adjacent or overlapping writes are merged into one pending range and sent as a single DMA
+ * pending data is flushed before a write to doorbell_addr (op code) or when the buffer fills
+ */
+struct write_combiner {
+    struct channel_handle *ch;
+    uint32_t doorbell_addr;
+    char *allocated;
+    uint32_t capacity;
+    int pending;
+    uint32_t base; // device address of the pending range
+    uint32_t end;
+    uint64_t num_writes; // writes requested by the caller
+    uint64_t num_transfers; // DMA submissions actually issued
+};
+
+struct write_combiner *wc_create(struct channel_handle *ch, uint32_t capacity, uint32_t doorbell_addr);
+
+void wc_destroy(struct write_combiner *wc);
+
+void wc_write(struct write_combiner *wc, uint32_t addr, uint32_t transferSize, const void *data);
+
+void wc_flush(struct write_combiner *wc);
+
+void wc_print_stats(const struct write_combiner *wc);
+
+#endif
@@ -1173,7 +1173,13 @@ struct xdma_transfer *engine_transfer_completion(struct xdma_engine *engine,
 	BUG_ON(!engine);
 	BUG_ON(!transfer);
 
-	if ((transfer->iocb) && (transfer->last_in_request)) {
+	if ((transfer->iocb) && (!transfer->last_in_request)) {
+		/* asynchronous I/O, not the last transfer: nobody waits on it */
+		dbg_tfr("Freeing (async I/O req) transfer %p, iocb %p\n",
+			transfer, transfer->iocb);
+		transfer_destroy(engine->lro, transfer);
+		transfer = NULL;
+	} else if ((transfer->iocb) && (transfer->last_in_request)) {
 		/* asynchronous I/O? */
 		struct kiocb *iocb = transfer->iocb;
 		ssize_t done = transfer->size_of_request;
@@ -3124,6 +3130,31 @@ static ssize_t sg_aio_read_write(struct kiocb *iocb, const struct iovec *iov,
 	dbg_tfr("dir_to_dev=%d %s request\n",  dir_to_dev,
 		dir_to_dev ? "write" : "read");
 
+	/* synchronous vectored I/O (readv/writev): there is no completion
+	 * callback, so transfer each segment and wait for it here */
+	if (is_sync_kiocb(iocb)) {
+		if (dir_to_dev != engine->dir_to_dev)
+			return -EINVAL;
+		for (seg = 0; seg < nr_segs; seg++) {
+			ssize_t res;
+
+			rc = check_transfer_align(engine, iov[seg].iov_base,
+				iov[seg].iov_len, pos, 1);
+			if (rc) {
+				dbg_tfr("Invalid transfer alignment detected\n");
+				return total_done ? total_done : rc;
+			}
+			res = transfer_data(engine, (char *)iov[seg].iov_base,
+				iov[seg].iov_len, &pos, 0);
+			if (res < 0)
+				return total_done ? total_done : res;
+			total_done += res;
+		}
+		iocb->ki_pos = pos;
+		dbg_tfr("sync request done, %lld bytes\n", (s64)total_done);
+		return total_done;
+	}
+
 	/* iterate over all vector segments */
 	for (seg = 0; seg < nr_segs; seg++) {
 		const char __user *buf = iov[seg].iov_base;
@@ -3167,10 +3198,12 @@ static ssize_t sg_aio_read_write(struct kiocb *iocb, const struct iovec *iov,
 			/* remember I/O context for later completion */
 			transfer->iocb = iocb;
 			/* last transfer for the given request? */
-			if (transfer_len >= remaining) {
+			if ((transfer_len >= remaining) &&
+				(seg == nr_segs - 1)) {
 				/* mark as last transfer, using request size */
 				transfer->last_in_request = 1;
-				transfer->size_of_request = done + transfer_len;
+				transfer->size_of_request = total_done + done +
+					transfer_len;
 			}
 			/* queue the transfer on the hardware */
 			transfer_queue(engine, transfer);
@@ -3182,6 +3215,8 @@ static ssize_t sg_aio_read_write(struct kiocb *iocb, const struct iovec *iov,
 					(s64)remaining, (s64)done);
 		}
 		total_done += done;
+		/* next segment continues at the following device address */
+		pos += done;
 	}
 	dbg_tfr("queued a total of %lld bytes, returns -EIOCBQUEUED.\n",
 		(s64)total_done);